@@ -5,7 +5,12 @@
 
 
 
-g++ -o papara -O3 -msse4a -std=c++11 -I. -I ivy_mike/src/ -I ublasJama-1.0.2.3 papara.cpp pvec.cpp pars_align_seq.cpp pars_align_gapp_seq.cpp parsimony.cpp sequence_model.cpp papara2_main.cpp blast_partassign.cpp align_utils.cpp ivy_mike/src/time.cpp ivy_mike/src/tree_parser.cpp ivy_mike/src/getopt.cpp ivy_mike/src/demangle.cpp ivy_mike/src/multiple_alignment.cpp ublasJama-1.0.2.3/EigenvalueDecomposition.cpp -lpthread
+# the scoring kernels are compiled once per instruction set. The best one is selected at runtime.
+g++ -c -O3 -msse4.1 -std=c++11 -I. -I ivy_mike/src/ scoring_kernel_sse41.cpp
+g++ -c -O3 -mavx2 -std=c++11 -I. -I ivy_mike/src/ scoring_kernel_avx2.cpp
+g++ -c -O3 -mavx512bw -mavx512vl -std=c++11 -I. -I ivy_mike/src/ scoring_kernel_avx512bw.cpp
+
+g++ -o papara -O3 -msse4.1 -std=c++11 -I. -I ivy_mike/src/ -I ublasJama-1.0.2.3 papara.cpp pvec.cpp pars_align_seq.cpp pars_align_gapp_seq.cpp parsimony.cpp sequence_model.cpp papara2_main.cpp blast_partassign.cpp kmer_prefilter.cpp align_utils.cpp scoring_kernel.cpp scoring_kernel_sse41.o scoring_kernel_avx2.o scoring_kernel_avx512bw.o ivy_mike/src/time.cpp ivy_mike/src/tree_parser.cpp ivy_mike/src/getopt.cpp ivy_mike/src/demangle.cpp ivy_mike/src/multiple_alignment.cpp ublasJama-1.0.2.3/EigenvalueDecomposition.cpp -lpthread
 
 #-I/usr/include/boost141/
 
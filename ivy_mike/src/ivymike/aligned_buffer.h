@@ -252,27 +252,28 @@ public:
     
 }
 
-template<typename T, size_t alignment = 4096>
-struct aligned_buffer : private std::vector<T,ab_internal_::alloc<T,alignment> > {
+// alloc_t can be used to make the underlying std::vector a distinct type (e.g., one with internal linkage)
+template<typename T, size_t alignment = 4096, typename alloc_t = ab_internal_::alloc<T,alignment> >
+struct aligned_buffer : private std::vector<T,alloc_t> {
 public:
-    typedef typename std::vector<T,ab_internal_::alloc<T,alignment> >::iterator iterator;
-    typedef typename std::vector<T,ab_internal_::alloc<T,alignment> >::const_iterator const_iterator;
+    typedef typename std::vector<T,alloc_t>::iterator iterator;
+    typedef typename std::vector<T,alloc_t>::const_iterator const_iterator;
     
-    aligned_buffer() : std::vector<T,ab_internal_::alloc<T,alignment> >() {}
-    aligned_buffer( size_t size ) : std::vector<T,ab_internal_::alloc<T,alignment> >(size) {}
-    aligned_buffer( size_t size, const T &v ) : std::vector<T,ab_internal_::alloc<T,alignment> >(size, v) {}
+    aligned_buffer() : std::vector<T,alloc_t>() {}
+    aligned_buffer( size_t size ) : std::vector<T,alloc_t>(size) {}
+    aligned_buffer( size_t size, const T &v ) : std::vector<T,alloc_t>(size, v) {}
     
 
-    using std::vector<T,ab_internal_::alloc<T,alignment> >::begin;
-    using std::vector<T,ab_internal_::alloc<T,alignment> >::end;
-    using std::vector<T,ab_internal_::alloc<T,alignment> >::size;
-    using std::vector<T,ab_internal_::alloc<T,alignment> >::resize;
-    using std::vector<T,ab_internal_::alloc<T,alignment> >::reserve;
-    using std::vector<T,ab_internal_::alloc<T,alignment> >::push_back;
-    using std::vector<T,ab_internal_::alloc<T,alignment> >::data;
-    using std::vector<T,ab_internal_::alloc<T,alignment> >::assign;
+    using std::vector<T,alloc_t>::begin;
+    using std::vector<T,alloc_t>::end;
+    using std::vector<T,alloc_t>::size;
+    using std::vector<T,alloc_t>::resize;
+    using std::vector<T,alloc_t>::reserve;
+    using std::vector<T,alloc_t>::push_back;
+    using std::vector<T,alloc_t>::data;
+    using std::vector<T,alloc_t>::assign;
     
-    using std::vector<T,ab_internal_::alloc<T,alignment> >::operator[];
+    using std::vector<T,alloc_t>::operator[];
     
     inline T* operator() (ptrdiff_t o) {
         return &(operator[](o));
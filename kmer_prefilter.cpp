@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <stdexcept>
+#include <cassert>
+
+#include "kmer_prefilter.h"
+#include "parsimony.h"
+
+using papara::kmer_prefilter;
+
+namespace {
+
+// parsimony states are bit-vectors. A k-mer position stores the index of the single set bit (5 bits are enough for
+// the 32bit states of the aa model), ambiguous states have no code.
+const size_t code_bits = 5;
+
+int state_code( int ps ) {
+    if( ps == 0 || (ps & (ps - 1)) != 0 ) {
+        return -1;
+    }
+
+    int code = 0;
+    while( (ps & 1) == 0 ) {
+        ps >>= 1;
+        ++code;
+    }
+
+    return code;
+}
+
+// the minimizers are chosen by hash value rather than lexicographically, which would favor low complexity k-mers like AAAA...
+uint64_t mix( uint64_t x ) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+bool more_shared( const std::pair<uint32_t, uint32_t> &a, const std::pair<uint32_t, uint32_t> &b ) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+}
+
+kmer_prefilter::kmer_prefilter( size_t k, size_t w )
+  : k_(k), w_(w), num_edges_(0)
+{
+    if( k_ == 0 || k_ * code_bits > 64 || w_ == 0 ) {
+        throw std::runtime_error( "kmer_prefilter: unsupported k-mer or window size" );
+    }
+}
+
+void kmer_prefilter::minimizers( const std::vector<int> &states, std::vector<uint64_t> *out ) const {
+    const uint64_t mask = (k_ * code_bits == 64) ? uint64_t(-1) : ((uint64_t(1) << (k_ * code_bits)) - 1);
+
+    // k-mers and their hashes of the current run of unambiguous states
+    std::vector<uint64_t> kmers;
+    std::vector<uint64_t> hashes;
+
+    uint64_t kmer = 0;
+    size_t run = 0;
+
+    const size_t first = out->size();
+
+    for( size_t i = 0; i <= states.size(); ++i ) {
+        const int code = i < states.size() ? state_code( states[i] ) : -1;
+
+        if( code >= 0 ) {
+            kmer = ((kmer << code_bits) | uint64_t(code)) & mask;
+            ++run;
+
+            if( run >= k_ ) {
+                kmers.push_back( kmer );
+                hashes.push_back( mix( kmer ));
+            }
+            continue;
+        }
+
+        // end of a run: one minimizer per window of w k-mers (or for the whole run, if it is shorter than that)
+        if( !kmers.empty() ) {
+            const size_t num_windows = kmers.size() >= w_ ? kmers.size() - w_ + 1 : 1;
+            const size_t win = std::min( w_, kmers.size() );
+
+            for( size_t j = 0; j < num_windows; ++j ) {
+                const size_t min_idx = std::distance( hashes.begin(), std::min_element( hashes.begin() + j, hashes.begin() + j + win ));
+
+                if( out->size() == first || out->back() != kmers[min_idx] ) {
+                    out->push_back( kmers[min_idx] );
+                }
+            }
+        }
+
+        kmers.clear();
+        hashes.clear();
+        kmer = 0;
+        run = 0;
+    }
+
+    std::sort( out->begin() + first, out->end() );
+    out->erase( std::unique( out->begin() + first, out->end() ), out->end() );
+}
+
+void kmer_prefilter::add_edge( const std::vector<int> &pvec, const std::vector<unsigned int> &aux ) {
+    assert( pvec.size() == aux.size() );
+
+    std::vector<int> states;
+    states.reserve( pvec.size() );
+
+    for( size_t i = 0; i < pvec.size(); ++i ) {
+        if( aux[i] != AUX_CGAP ) {
+            states.push_back( pvec[i] );
+        }
+    }
+
+    std::vector<uint64_t> mins;
+    minimizers( states, &mins );
+
+    for( std::vector<uint64_t>::iterator it = mins.begin(); it != mins.end(); ++it ) {
+        index_.push_back( std::make_pair( *it, uint32_t(num_edges_) ));
+    }
+
+    ++num_edges_;
+}
+
+void kmer_prefilter::build_index() {
+    std::sort( index_.begin(), index_.end() );
+    std::vector<std::pair<uint64_t, uint32_t> >( index_ ).swap( index_ );
+
+    counts_.assign( num_edges_, 0 );
+}
+
+void kmer_prefilter::top_edges( const std::vector<int> &qs_pvec, size_t num_edges, std::vector<size_t> *out ) {
+    assert( counts_.size() == num_edges_ );
+
+    out->clear();
+    qs_minimizers_.clear();
+    minimizers( qs_pvec, &qs_minimizers_ );
+
+    for( std::vector<uint64_t>::iterator it = qs_minimizers_.begin(); it != qs_minimizers_.end(); ++it ) {
+        std::vector<std::pair<uint64_t, uint32_t> >::const_iterator first = std::lower_bound( index_.begin(), index_.end(), std::make_pair( *it, uint32_t(0) ));
+
+        for( ; first != index_.end() && first->first == *it; ++first ) {
+            if( counts_[first->second] == 0 ) {
+                touched_.push_back( first->second );
+            }
+            ++counts_[first->second];
+        }
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t> > ranked;
+    ranked.reserve( touched_.size() );
+
+    for( std::vector<uint32_t>::iterator it = touched_.begin(); it != touched_.end(); ++it ) {
+        ranked.push_back( std::make_pair( counts_[*it], *it ));
+        counts_[*it] = 0;
+    }
+    touched_.clear();
+
+    const size_t n = std::min( num_edges, ranked.size() );
+    std::partial_sort( ranked.begin(), ranked.begin() + n, ranked.end(), more_shared );
+
+    for( size_t i = 0; i < n; ++i ) {
+        out->push_back( ranked[i].second );
+    }
+}
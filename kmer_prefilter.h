@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __kmer_prefilter_h
+#define __kmer_prefilter_h
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+#include <utility>
+
+namespace papara {
+
+// optional search space reduction for huge references (papara -e): ranks the reference edges for each query by the
+// number of minimizers (the k-mer with the smallest hash value in each window of w consecutive k-mers) it shares with the
+// ancestral state vector of the edge. The ancestral states are used without the cgap columns (i.e., like the gap-free
+// query), and ambiguous states break the k-mers.
+// This is a heuristic: the edge with the best alignment score is not guaranteed to be among the top ranked ones.
+class kmer_prefilter {
+public:
+    kmer_prefilter( size_t k, size_t w );
+
+    // edges are numbered in the order in which they are added. pvec/aux are the ancestral state vector of an edge as in
+    // references::pvec_at/aux_at.
+    void add_edge( const std::vector<int> &pvec, const std::vector<unsigned int> &aux );
+
+    // has to be called after the last add_edge
+    void build_index();
+
+    // the (at most) num_edges edges that share the most minimizers with the query (given as parsimony states), best first
+    // and the lower edge first on ties. Edges that share no minimizer with the query are not returned at all.
+    void top_edges( const std::vector<int> &qs_pvec, size_t num_edges, std::vector<size_t> *out );
+
+    size_t num_edges() const {
+        return num_edges_;
+    }
+
+    size_t index_size() const {
+        return index_.size();
+    }
+
+private:
+    // appends the distinct minimizers of the (gap free) state sequence to out
+    void minimizers( const std::vector<int> &states, std::vector<uint64_t> *out ) const;
+
+    const size_t k_;
+    const size_t w_;
+
+    size_t num_edges_;
+
+    // (minimizer, edge) pairs, sorted
+    std::vector<std::pair<uint64_t, uint32_t> > index_;
+
+    // scratch space of top_edges
+    std::vector<uint32_t> counts_;
+    std::vector<uint32_t> touched_;
+    std::vector<uint64_t> qs_minimizers_;
+};
+
+}
+
+#endif
@@ -22,6 +22,7 @@
 #include <boost/bind.hpp>
 #include <boost/dynamic_bitset.hpp>
 #include <iterator>
+#include <sstream>
 
 #include "ivymike/fasta.h"
 #include "ivymike/demangle.h"
@@ -32,6 +33,8 @@
 #include "align_pvec_vec.h"
 #include "stepwise_align.h"
 #include "align_utils.h"
+#include "scoring_kernel.h"
+#include "kmer_prefilter.h"
 
 
 
@@ -43,8 +46,7 @@ using namespace ivy_mike::tree_parser_ms;
 
 using namespace papara;
 
-bool papara::g_dump_aux = false;
-
+namespace papara {
 
 class log_stream_buffer : public std::streambuf
 {
@@ -121,6 +123,8 @@ private:
     std::vector<log_sink *> log_sinks;
 };
 
+}
+
 // // lifted from http://www.horstmann.com/cpp/iostreams.html
 // class log_stream_buffer : public std::filebuf
 // {
@@ -175,55 +179,38 @@ private:
 // }
       
 
-static log_stream_buffer ls_buf;
-std::ostream papara::lout(&ls_buf);
-
-static ivy_mike::mutex log_buffer_mutex;
-
-
-// open_log_file::open_log_file( const char *filename ) {
-//     
-//     ivy_mike::lock_guard<ivy_mike::mutex> lock( log_buffer_mutex );
-//     if( log_is_open ) {
-//         std::cerr << "papara logfile is already open." << std::endl;
-//         abort();
-//     }
-//     
-//     
-//     ls_buf.open(filename);
-//     log_is_open = true;
-// }
+run_options::run_options()
+  : mode( scoring_mode_auto ),
+    edge_pruning( true ),
+    prefix_reuse( true ),
+    traceback_max_cells( align_arrays_traceback<int>().max_tb_cells ),
+    banded_traceback( true ),
+    vector_traceback( true )
+{}
 
-// open_log_file::~open_log_file() {
-//     ivy_mike::lock_guard<ivy_mike::mutex> lock( log_buffer_mutex );
-//     if( !log_is_open ) {
-//         std::cerr << "papara logfile is already closed. (This should be impossible) " << std::endl;
-//         abort();
-//     }
-//     ls_buf.close();
-//     log_is_open = false;
-// }
+run_context::run_context() : buf_(new log_stream_buffer()), log_(buf_.get()) {}
 
+run_context::~run_context() {}
 
-add_log_tee::add_log_tee( std::ostream &os ) : os_(os) {
-    ivy_mike::lock_guard<ivy_mike::mutex> lock( log_buffer_mutex );
-    ls_buf.add_tee(&os);
+add_log_tee::add_log_tee( run_context &ctx, std::ostream &os ) : ctx_(ctx), os_(os) {
+    ivy_mike::lock_guard<ivy_mike::mutex> lock( ctx_.buf_mutex_ );
+    ctx_.buf_->add_tee(&os);
 }
 
 add_log_tee::~add_log_tee() {
-    ivy_mike::lock_guard<ivy_mike::mutex> lock( log_buffer_mutex );
-    ls_buf.remove_tee(&os_);
+    ivy_mike::lock_guard<ivy_mike::mutex> lock( ctx_.buf_mutex_ );
+    ctx_.buf_->remove_tee(&os_);
 }
 
 
-add_log_sink::add_log_sink( log_sink *s ) : s_(s) {
-    ivy_mike::lock_guard<ivy_mike::mutex> lock( log_buffer_mutex );
-    ls_buf.add_sink(s);
+add_log_sink::add_log_sink( run_context &ctx, log_sink *s ) : ctx_(ctx), s_(s) {
+    ivy_mike::lock_guard<ivy_mike::mutex> lock( ctx_.buf_mutex_ );
+    ctx_.buf_->add_sink(s);
 }
 
 add_log_sink::~add_log_sink() {
-    ivy_mike::lock_guard<ivy_mike::mutex> lock( log_buffer_mutex );
-    ls_buf.remove_sink(s_);
+    ivy_mike::lock_guard<ivy_mike::mutex> lock( ctx_.buf_mutex_ );
+    ctx_.buf_->remove_sink(s_);
 }
 
 
@@ -231,6 +218,74 @@ std::string papara::get_version_string() {
     return std::string( "2.5" );
 }
 
+// FNV-1a hash over a sequence of values (each one widened to 64bit)
+class fnv1a_hash {
+public:
+    fnv1a_hash() : h_(14695981039346656037ULL) {}
+
+    void add( uint64_t v ) {
+        h_ = (h_ ^ v) * 1099511628211ULL;
+    }
+
+    template<typename iiter>
+    void add( iiter first, iiter last ) {
+        for( ; first != last; ++first ) {
+            add( uint64_t(*first) );
+        }
+    }
+
+    uint64_t get() const {
+        return h_;
+    }
+
+private:
+    uint64_t h_;
+};
+
+// groups the items 0..n-1 into sets of identical items: sort them by hash(i) and compare the ones with the same hash
+// using equal(a, b). rep[i] is the representative of item i (the lowest index of its group), unique the list of
+// representatives in increasing order.
+template<typename hash_fn, typename equal_fn>
+void group_duplicates( size_t n, hash_fn hash, equal_fn equal, std::vector<size_t> *rep, std::vector<size_t> *unique ) {
+    std::vector<std::pair<uint64_t,size_t> > hashes( n );
+
+    for( size_t i = 0; i < n; ++i ) {
+        hashes[i] = std::make_pair( hash(i), i );
+    }
+
+    std::sort( hashes.begin(), hashes.end() );
+
+    rep->resize( n );
+    unique->clear();
+
+    std::vector<size_t> reps; // the different items with the current hash
+    for( size_t j = 0; j < hashes.size(); ++j ) {
+        if( j == 0 || hashes[j].first != hashes[j-1].first ) {
+            reps.clear();
+        }
+
+        const size_t i = hashes[j].second;
+        (*rep)[i] = i;
+
+        for( std::vector<size_t>::iterator it = reps.begin(); it != reps.end(); ++it ) {
+            if( equal( *it, i )) {
+                (*rep)[i] = *it;
+                break;
+            }
+        }
+
+        if( (*rep)[i] == i ) {
+            reps.push_back( i );
+        }
+    }
+
+    for( size_t i = 0; i < n; ++i ) {
+        if( (*rep)[i] == i ) {
+            unique->push_back( i );
+        }
+    }
+}
+
 template<typename seq_tag>
 queries<seq_tag>::queries( const std::string &opt_qs_name ) {
 
@@ -359,6 +414,27 @@ void queries<seq_tag>::preprocess() {
 //            write_ref_pvecs( "ref.bin" );
 //        }
 
+    find_duplicates();
+}
+
+template<typename seq_tag>
+void queries<seq_tag>::find_duplicates() {
+    // identical queries have the same c-state/p-state sequence and bounds
+    group_duplicates( m_qs_cseqs.size(),
+        [this]( size_t i ) {
+            fnv1a_hash h;
+            h.add( m_qs_cseqs[i].begin(), m_qs_cseqs[i].end() );
+            h.add( m_qs_pvecs[i].begin(), m_qs_pvecs[i].end() );
+
+            const std::pair<size_t,size_t> bounds = get_per_qs_bounds( i );
+            h.add( bounds.first );
+            h.add( bounds.second );
+            return h.get();
+        },
+        [this]( size_t a, size_t b ) {
+            return m_qs_cseqs[a] == m_qs_cseqs[b] && m_qs_pvecs[a] == m_qs_pvecs[b] && get_per_qs_bounds( a ) == get_per_qs_bounds( b );
+        },
+        &m_qs_rep, &m_qs_unique );
 }
 
 
@@ -443,11 +519,11 @@ void queries<seq_tag>::normalize_name(std::string& str) {
 //////////////////////////////////////////////////////////////
 
 template<typename pvec_t, typename seq_tag>
-references<pvec_t,seq_tag>::references(const char* opt_tree_name, const char* opt_alignment_name, queries<seq_tag>* qs) : m_ln_pool(new ln_pool( std::unique_ptr<node_data_factory>(new my_fact<my_adata>) )), spg_(pvec_pgap::pgap_model, &pm_)
+references<pvec_t,seq_tag>::references(run_context &ctx, const char* opt_tree_name, const char* opt_alignment_name, queries<seq_tag>* qs) : ctx_(ctx), m_ln_pool(new ln_pool( std::unique_ptr<node_data_factory>(new my_fact<my_adata>) )), m_ref_len(0), m_lazy(false), m_block_bytes(0)
 {
 
     //std::cerr << "papara_nt instantiated as: " << typeid(*this).name() << "\n";
-    lout << "references container instantiated as: " << ivy_mike::demangle(typeid(*this).name()) << "\n";
+    ctx_.log() << "references container instantiated as: " << ivy_mike::demangle(typeid(*this).name()) << "\n";
 
 
 
@@ -602,12 +678,12 @@ references<pvec_t,seq_tag>::references(const char* opt_tree_name, const char* op
                 m_ref_seqs[i].swap( seq_tmp );
 
                 //initialize the corresponding adata object with the cleaned ref seq.
-                tmp_adata.at(i)->init_pvec( m_ref_seqs[i] );
+                tmp_adata.at(i)->init_pvec( m_ref_seqs[i], &pm_ );
             }
         }
     }
     pm_.reset( m_ref_seqs );
-    std::cout << "p: " << pm_.setup_pmatrix(0.1) << "\n";
+    ctx_.log() << "p: " << pm_.setup_pmatrix(0.1) << "\n";
 
     // initialize empty non-gap map. It is lazily filled as needed when necessary
     ref_ng_map_.resize( m_ref_seqs.size() );
@@ -618,66 +694,510 @@ references<pvec_t,seq_tag>::references(const char* opt_tree_name, const char* op
 
     visit_edges( n, m_ec );
 
-    lout << "edges: " << m_ec.m_edges.size() << "\n";
+    ctx_.log() << "edges: " << m_ec.m_edges.size() << "\n";
 
 }
 
+// calls fn(i) for all i in [0, n), from n_threads threads. Small ranges are not worth starting the threads for.
+template<typename fn_t>
+class parallel_range {
+public:
+    parallel_range( size_t n, std::atomic<size_t> *next, const fn_t &fn ) : n_(n), next_(next), fn_(fn) {}
+
+    void operator()() {
+        for( size_t i = next_->fetch_add( 1 ); i < n_; i = next_->fetch_add( 1 )) {
+            fn_(i);
+        }
+    }
+
+    static void run( size_t n, size_t n_threads, const fn_t &fn ) {
+        std::atomic<size_t> next(0);
+
+        if( n_threads <= 1 || n < 4 * n_threads ) {
+            parallel_range( n, &next, fn )();
+            return;
+        }
+
+        ivy_mike::thread_group tg;
+        for( size_t i = 1; i < n_threads; ++i ) {
+            tg.create_thread( parallel_range( n, &next, fn ));
+        }
+
+        parallel_range( n, &next, fn )();
+        tg.join_all();
+    }
+
+private:
+    size_t n_;
+    std::atomic<size_t> *next_;
+    fn_t fn_;
+};
+
+// computes the ancestral state vectors of all edges of a tree in one pass, instead of one (incremental) rooted traversal
+// per edge (see driver::do_newview): each lnode of an inner node gets the vector of the subtree behind it (with the
+// children lnode->next->back and lnode->next->next->back), and the vector of the edge (n1, n2) is the newview of the ones
+// of n1 and n2. The children and tip cases are the same as in rooted_traversal_order/do_newview, so are the vectors.
+// The directional vectors are computed level by level from the tips (the vectors of a level only depend on the lower
+// ones, so each level runs in parallel), and freed as soon as everything that needs them is done.
 template<typename pvec_t, typename seq_tag>
-void references<pvec_t,seq_tag>::build_ref_vecs() {
-    // pre-create the ancestral state vectors. This step is necessary for the threaded version, because otherwise, each
-    // thread would need an independent copy of the tree to do concurrent newviews. Anyway, having a copy of the tree
-    // in each thread will most likely use more memory than storing the pre-calculated vectors.
+class edge_vec_builder {
+    typedef my_adata_gen<pvec_t,seq_tag> my_adata;
+    typedef ivy_mike::tree_parser_ms::lnode lnode;
+
+    // the inputs of one newview. d1/d2 are the indices of the directional vectors of c1/c2, or size_t(-1) for tips.
+    struct bifurcation {
+        lnode *c1;
+        lnode *c2;
+        size_t d1;
+        size_t d2;
+        double z1;
+        double z2;
+        ivy_mike::tip_case tc;
+    };
+
+public:
+    edge_vec_builder( const std::vector<std::pair<lnode *, lnode *> > &edges ) {
+        // every lnode is the end of exactly one edge
+        std::map<lnode *, size_t> index;
+        for( size_t i = 0; i < edges.size(); ++i ) {
+            add_lnode( edges[i].first, i, &index );
+            add_lnode( edges[i].second, i, &index );
+        }
 
-    // TODO: maybe try lazy create/cache of the asv's in the threads
+        for( size_t d = 0; d < dir_lnodes_.size(); ++d ) {
+            lnode *n = dir_lnodes_[d];
 
-    ivy_mike::timer t1;
+            bifurcation b = make_bifurcation( n->next->back, n->next->next->back, index );
+            if( b.c1 != n->next->back ) {
+                std::swap( b.z1, b.z2 ); // in rooted_traversal_order, the branch lengths are swapped with the children
+            }
+            dir_inputs_.push_back( b );
 
+            // the directional vectors that have this one as a child: the other two lnodes of the node behind it
+            if( n->back->m_data->isTip ) {
+                dir_parents_.push_back( std::make_pair( size_t(-1), size_t(-1) ));
+            } else {
+                dir_parents_.push_back( std::make_pair( index[n->back->next], index[n->back->next->next] ));
+            }
+        }
 
+        for( size_t i = 0; i < edges.size(); ++i ) {
+            edge_inputs_.push_back( make_bifurcation( edges[i].first, edges[i].second, index ));
+        }
 
-    assert( m_ref_aux.empty() && m_ref_pvecs.empty() );
+        dirs_.resize( dir_lnodes_.size() );
+    }
 
-    m_ref_pvecs.reserve( m_ec.m_edges.size() );
-    m_ref_aux.reserve( m_ec.m_edges.size() );
+    // calls store(i, root_pvec) for every edge i. The calls for different edges may run concurrently.
+    template<typename store_t>
+    void run( size_t n_threads, const store_t &store ) {
+        const size_t none = size_t(-1);
 
+        // the number of inputs that are not ready yet (per directional vector/edge), and of the newviews that still need
+        // a directional vector
+        std::vector<size_t> dir_pending( dir_inputs_.size() );
+        std::vector<size_t> edge_pending( edge_inputs_.size() );
+        std::vector<size_t> consumers( dir_inputs_.size(), 0 );
 
-    for( size_t i = 0; i < m_ec.m_edges.size(); i++ ) {
-        pvec_t root_pvec;
+        std::vector<size_t> level;
+        std::vector<size_t> ready_edges;
 
-//             std::cout << "newview for branch " << i << ": " << *(m_ec.m_edges[i].first->m_data) << " " << *(m_ec.m_edges[i].second->m_data) << "\n";
+        for( size_t d = 0; d < dir_inputs_.size(); ++d ) {
+            dir_pending[d] = add_consumer( dir_inputs_[d], &consumers );
+            if( dir_pending[d] == 0 ) {
+                level.push_back( d );
+            }
+        }
+        for( size_t i = 0; i < edge_inputs_.size(); ++i ) {
+            edge_pending[i] = add_consumer( edge_inputs_[i], &consumers );
+            if( edge_pending[i] == 0 ) {
+                ready_edges.push_back( i ); // only in a tree of two tips
+            }
+        }
+
+        parallel_range<edge_newview<store_t> >::run( ready_edges.size(), n_threads, edge_newview<store_t>( this, &ready_edges, &store ));
+
+        std::vector<size_t> next_level;
+        std::vector<size_t> done;
+        while( !level.empty() ) {
+            parallel_range<dir_newview>::run( level.size(), n_threads, dir_newview( this, &level ));
+
+            ready_edges.clear();
+            next_level.clear();
+            done.clear();
+
+            for( std::vector<size_t>::iterator it = level.begin(); it != level.end(); ++it ) {
+                collect_inputs( dir_inputs_[*it], &done );
+
+                if( --edge_pending[dir_edge_[*it]] == 0 ) {
+                    ready_edges.push_back( dir_edge_[*it] );
+                }
+
+                const std::pair<size_t,size_t> &parents = dir_parents_[*it];
+                if( parents.first != none && --dir_pending[parents.first] == 0 ) {
+                    next_level.push_back( parents.first );
+                }
+                if( parents.second != none && --dir_pending[parents.second] == 0 ) {
+                    next_level.push_back( parents.second );
+                }
+            }
+
+            parallel_range<edge_newview<store_t> >::run( ready_edges.size(), n_threads, edge_newview<store_t>( this, &ready_edges, &store ));
+
+            for( std::vector<size_t>::iterator it = ready_edges.begin(); it != ready_edges.end(); ++it ) {
+                collect_inputs( edge_inputs_[*it], &done );
+            }
+
+            for( std::vector<size_t>::iterator it = done.begin(); it != done.end(); ++it ) {
+                if( --consumers[*it] == 0 ) {
+                    dirs_[*it].reset();
+                }
+            }
+
+            level.swap( next_level );
+        }
+    }
+
+private:
+    class dir_newview {
+    public:
+        dir_newview( edge_vec_builder *b, const std::vector<size_t> *level ) : b_(b), level_(level) {}
+
+        void operator()( size_t i ) const {
+            const size_t d = (*level_)[i];
+            b_->dirs_[d].reset( new pvec_t );
+            b_->newview( *b_->dirs_[d], b_->dir_inputs_[d] );
+        }
+
+    private:
+        edge_vec_builder *b_;
+        const std::vector<size_t> *level_;
+    };
+
+    template<typename store_t>
+    class edge_newview {
+    public:
+        edge_newview( edge_vec_builder *b, const std::vector<size_t> *edges, const store_t *store ) : b_(b), edges_(edges), store_(store) {}
+
+        void operator()( size_t i ) const {
+            const size_t e = (*edges_)[i];
+            pvec_t root_pvec;
+            b_->newview( root_pvec, b_->edge_inputs_[e] );
+            (*store_)( e, root_pvec );
+        }
+
+    private:
+        edge_vec_builder *b_;
+        const std::vector<size_t> *edges_;
+        const store_t *store_;
+    };
+
+    void add_lnode( lnode *n, size_t edge, std::map<lnode *, size_t> *index ) {
+        if( n->m_data->isTip ) {
+            return;
+        }
+
+        (*index)[n] = dir_lnodes_.size();
+        dir_lnodes_.push_back( n );
+        dir_edge_.push_back( edge );
+    }
+
+    // tips first (with TIP_INNER), as in rooted_traversal_order and do_newview. The branch lengths stay in place.
+    static bifurcation make_bifurcation( lnode *n1, lnode *n2, const std::map<lnode *, size_t> &index ) {
+        const bool tip1 = n1->m_data->isTip;
+        const bool tip2 = n2->m_data->isTip;
+
+        bifurcation b;
+        b.c1 = n1;
+        b.c2 = n2;
+        b.z1 = n1->backLen;
+        b.z2 = n2->backLen;
+
+        if( tip1 && tip2 ) {
+            b.tc = TIP_TIP;
+        } else if( tip1 || tip2 ) {
+            b.tc = TIP_INNER;
+        } else {
+            b.tc = INNER_INNER;
+        }
+
+        if( !tip1 && tip2 ) {
+            std::swap( b.c1, b.c2 );
+        }
+
+        b.d1 = b.c1->m_data->isTip ? size_t(-1) : index.find( b.c1 )->second;
+        b.d2 = b.c2->m_data->isTip ? size_t(-1) : index.find( b.c2 )->second;
+        return b;
+    }
+
+    // counts the newview of b as consumer of its directional inputs, returns their number
+    static size_t add_consumer( const bifurcation &b, std::vector<size_t> *consumers ) {
+        size_t n = 0;
+        if( b.d1 != size_t(-1) ) {
+            ++(*consumers)[b.d1];
+            ++n;
+        }
+        if( b.d2 != size_t(-1) ) {
+            ++(*consumers)[b.d2];
+            ++n;
+        }
+        return n;
+    }
 
-        if( i == 340 ) {
-            g_dump_aux = true;
+    static void collect_inputs( const bifurcation &b, std::vector<size_t> *done ) {
+        if( b.d1 != size_t(-1) ) {
+            done->push_back( b.d1 );
+        }
+        if( b.d2 != size_t(-1) ) {
+            done->push_back( b.d2 );
         }
+    }
 
-        driver<pvec_t,seq_tag>::do_newview( root_pvec, m_ec.m_edges[i].first, m_ec.m_edges[i].second, true );
+    pvec_t &input( lnode *c, size_t d ) {
+        if( d == size_t(-1) ) {
+            return c->m_data->template get_as<my_adata>()->get_pvec();
+        } else {
+            assert( dirs_[d].get() != 0 );
+            return *dirs_[d];
+        }
+    }
 
-        g_dump_aux = false;
-        // TODO: try something fancy with rvalue refs...
+    void newview( pvec_t &p, const bifurcation &b ) {
+        pvec_t::newview( p, input( b.c1, b.d1 ), input( b.c2, b.d2 ), b.z1, b.z2, b.tc );
+    }
 
-        m_ref_pvecs.push_back( std::vector<int>() );
-        m_ref_aux.push_back( std::vector<unsigned int>() );
+    std::vector<lnode *> dir_lnodes_;
+    std::vector<size_t> dir_edge_;
+    std::vector<bifurcation> dir_inputs_;
+    std::vector<std::pair<size_t,size_t> > dir_parents_;
+    std::vector<bifurcation> edge_inputs_;
+    std::vector<std::unique_ptr<pvec_t> > dirs_;
+};
 
-        root_pvec.to_int_vec(m_ref_pvecs.back());
-        root_pvec.to_aux_vec(m_ref_aux.back());
+template<typename pvec_t, typename seq_tag>
+void references<pvec_t,seq_tag>::root_to_vecs( pvec_t &root_pvec, std::vector<int> *pvec, std::vector<unsigned int> *aux, std::vector<double> *gapp ) {
+    // TODO: try something fancy with rvalue refs...
 
+    pvec->clear();
+    aux->clear();
+    root_pvec.to_int_vec(*pvec);
+    root_pvec.to_aux_vec(*aux);
 
-        m_ref_gapp.push_back( std::vector<double>() );
+    if( gapp != 0 ) {
+        gapp->clear();
 
         if( ivy_mike::same_type<pvec_t,pvec_pgap>::result ) {
             // WTF: this is why mixing static and dynamic polymorphism is a BAD idea!
             pvec_pgap *rvp = reinterpret_cast<pvec_pgap *>(&root_pvec);
-            rvp->to_gap_post_vec(m_ref_gapp.back());
+            rvp->to_gap_post_vec(*gapp);
 
-//              std::transform( m_ref_gapp.back().begin(), m_ref_gapp.back().end(), std::ostream_iterator<int>(std::cout), ivy_mike::scaler_clamp<double>(10,0,9) );
+//              std::transform( gapp->begin(), gapp->end(), std::ostream_iterator<int>(std::cout), ivy_mike::scaler_clamp<double>(10,0,9) );
 //
 //              std::cout << "\n";
         }
+    }
+}
+
+template<typename pvec_t, typename seq_tag>
+void references<pvec_t,seq_tag>::newview_at( size_t i, std::vector<int> *pvec, std::vector<unsigned int> *aux, std::vector<double> *gapp ) const {
+    pvec_t root_pvec;
+
+//             std::cout << "newview for branch " << i << ": " << *(m_ec.m_edges[i].first->m_data) << " " << *(m_ec.m_edges[i].second->m_data) << "\n";
+
+    driver<pvec_t,seq_tag>::do_newview( root_pvec, m_ec.m_edges[i].first, m_ec.m_edges[i].second, true );
+    root_to_vecs( root_pvec, pvec, aux, gapp );
+}
+
+template<typename pvec_t, typename seq_tag>
+void references<pvec_t,seq_tag>::build_ref_vecs( size_t max_bytes, size_t n_threads ) {
+    // pre-create the ancestral state vectors. This step is necessary for the threaded version, because otherwise, each
+    // thread would need an independent copy of the tree to do concurrent newviews. Anyway, having a copy of the tree
+    // in each thread will most likely use more memory than storing the pre-calculated vectors. They are all created in
+    // one pass over the tree (see edge_vec_builder).
+    // If they do not fit into max_bytes, the vectors are created on demand instead (one newview at a time): the ones of
+    // the blocks by the producer of the block queue in depth-first order (see create_packed), the others by unpack_at,
+    // which caches the recently used ones.
+
+    ivy_mike::timer t1;
+
 
 
+    assert( m_ref_packed.empty() && m_ref_slot.empty() && !m_ref_seqs.empty() );
+
+    const size_t num_edges = m_ec.m_edges.size();
+    m_ref_len = m_ref_seqs.front().size();
+
+    const size_t num_bytes = num_edges * m_ref_len * sizeof(packed_t);
+    m_lazy = max_bytes != 0 && num_bytes > max_bytes;
+
+    if( !m_lazy ) {
+        // the vectors are packed right away (see packed_column), so that the unpacked ones never exist for all edges at once
+        m_ref_packed.resize( num_edges * m_ref_len );
+        m_ref_slot.resize( num_edges );
+
+        edge_vec_builder<pvec_t,seq_tag>( m_ec.m_edges ).run( n_threads, [this]( size_t i, pvec_t &root_pvec ) {
+            std::vector<int> pvec;
+            std::vector<unsigned int> aux;
+            root_to_vecs( root_pvec, &pvec, &aux, 0 ); // the gap probabilities are not used by scoring or traceback
+            assert( pvec.size() == m_ref_len && aux.size() == m_ref_len );
+
+            packed_t *cells = m_ref_packed.data() + i * m_ref_len;
+            for( size_t j = 0; j < m_ref_len; ++j ) {
+                cells[j] = packed_column<seq_tag>::pack( pvec[j], aux[j] );
+            }
+            m_ref_slot[i] = i;
+        });
     }
 
 //     std::cout << "pvecs created: " << t1.elapsed() << "\n";
 
+    if( !m_lazy ) {
+        ctx_.log() << "reference vectors: " << num_edges << " edges created in " << t1.elapsed() << "s" << std::endl;
+        find_duplicates();
+        return;
+    }
+
+    // no duplicate detection in lazy mode (it would need all vectors at once): every edge is its own representative
+    m_ref_rep.resize( num_edges );
+    m_ref_unique.resize( num_edges );
+    for( size_t i = 0; i < num_edges; ++i ) {
+        m_ref_rep[i] = i;
+        m_ref_unique[i] = i;
+    }
+
+    // half of the budget for the cache, the other half for the blocks in flight
+    m_block_bytes = max_bytes - max_bytes / 2;
+
+    const size_t num_slots = std::max( size_t(1), (max_bytes / 2) / std::max( size_t(1), m_ref_len * sizeof(packed_t) ));
+    m_ref_packed.assign( num_slots * m_ref_len, packed_t() );
+    m_ref_slot.assign( num_edges, size_t(-1) );
+    m_slot_edge.assign( num_slots, size_t(-1) );
+    m_slot_lru.clear();
+    m_slot_pos.resize( num_slots );
+    for( size_t i = 0; i < num_slots; ++i ) {
+        m_slot_pos[i] = m_slot_lru.insert( m_slot_lru.end(), i );
+    }
+
+    ctx_.log() << "reference vectors: created on demand, caching " << num_slots << " of " << num_edges << " edges, "
+               << m_block_bytes / 1024 << "KB for the blocks in flight" << std::endl;
+}
+
+template<typename pvec_t, typename seq_tag>
+void references<pvec_t,seq_tag>::unpack_at( size_t i, int *pvec, unsigned int *aux ) const {
+    if( !m_lazy ) {
+        packed_column<seq_tag>::unpack( packed_at(i), m_ref_len, pvec, aux );
+        return;
+    }
+
+    {
+        ivy_mike::lock_guard<ivy_mike::mutex> lock( m_cache_mtx );
+
+        const size_t slot = m_ref_slot.at(i);
+        if( slot != size_t(-1) ) {
+            m_slot_lru.splice( m_slot_lru.end(), m_slot_lru, m_slot_pos[slot] );
+            packed_column<seq_tag>::unpack( m_ref_packed.data() + slot * m_ref_len, m_ref_len, pvec, aux );
+            return;
+        }
+    }
+
+    // not cached: the newviews modify the inner vectors of the tree, so only one thread at a time can create vectors.
+    // Another thread may have created this one in the meantime.
+    ivy_mike::lock_guard<ivy_mike::mutex> tree_lock( m_tree_mtx );
+
+    {
+        ivy_mike::lock_guard<ivy_mike::mutex> lock( m_cache_mtx );
+
+        const size_t slot = m_ref_slot[i];
+        if( slot != size_t(-1) ) {
+            m_slot_lru.splice( m_slot_lru.end(), m_slot_lru, m_slot_pos[slot] );
+            packed_column<seq_tag>::unpack( m_ref_packed.data() + slot * m_ref_len, m_ref_len, pvec, aux );
+            return;
+        }
+    }
+
+    std::vector<int> p;
+    std::vector<unsigned int> a;
+    newview_at( i, &p, &a, 0 );
+    assert( p.size() == m_ref_len && a.size() == m_ref_len );
+
+    std::copy( p.begin(), p.end(), pvec );
+    std::copy( a.begin(), a.end(), aux );
+
+    // replace the least recently used vector
+    ivy_mike::lock_guard<ivy_mike::mutex> lock( m_cache_mtx );
+
+    const size_t slot = m_slot_lru.front();
+    m_slot_lru.splice( m_slot_lru.end(), m_slot_lru, m_slot_lru.begin() );
+    if( m_slot_edge[slot] != size_t(-1) ) {
+        m_ref_slot[m_slot_edge[slot]] = size_t(-1);
+    }
+
+    packed_t *cells = m_ref_packed.data() + slot * m_ref_len;
+    for( size_t j = 0; j < m_ref_len; ++j ) {
+        cells[j] = packed_column<seq_tag>::pack( p[j], a[j] );
+    }
+
+    m_slot_edge[slot] = i;
+    m_ref_slot[i] = slot;
+}
+
+template<typename pvec_t, typename seq_tag>
+void references<pvec_t,seq_tag>::create_packed( const size_t *first, const size_t *last, packed_t *out ) const {
+    assert( m_lazy );
+
+    std::vector<int> p;
+    std::vector<unsigned int> a;
+
+    // the same as unpack_at, without the cache: the vectors of the blocks are not needed again until the next pass
+    ivy_mike::lock_guard<ivy_mike::mutex> tree_lock( m_tree_mtx );
+
+    for( ; first != last; ++first, out += m_ref_len ) {
+        newview_at( *first, &p, &a, 0 );
+        assert( p.size() == m_ref_len && a.size() == m_ref_len );
+
+        for( size_t j = 0; j < m_ref_len; ++j ) {
+            out[j] = packed_column<seq_tag>::pack( p[j], a[j] );
+        }
+    }
+}
+
+template<typename pvec_t, typename seq_tag>
+void references<pvec_t,seq_tag>::find_duplicates() {
+    // like queries::find_duplicates, for the ancestral state vectors and cgap flags of the edges (i.e., everything the
+    // scoring and traceback use). Trees with many (nearly) identical sequences have lots of edges with identical vectors.
+    // Expects one packed vector per edge, afterwards only the ones of the representatives are kept.
+    const size_t num_edges = m_ref_slot.size();
+
+    group_duplicates( num_edges,
+        [this]( size_t i ) {
+            const packed_t *cells = m_ref_packed.data() + i * m_ref_len;
+
+            fnv1a_hash h;
+            h.add( cells, cells + m_ref_len );
+            return h.get();
+        },
+        [this]( size_t a, size_t b ) {
+            const packed_t *cells = m_ref_packed.data() + a * m_ref_len;
+            return std::equal( cells, cells + m_ref_len, m_ref_packed.data() + b * m_ref_len );
+        },
+        &m_ref_rep, &m_ref_unique );
+
+    // move the vectors of the representatives to the front (in increasing order, so nothing is overwritten before it is moved)
+    for( size_t slot = 0; slot < m_ref_unique.size(); ++slot ) {
+        const size_t i = m_ref_unique[slot];
+
+        std::copy( m_ref_packed.begin() + i * m_ref_len, m_ref_packed.begin() + (i + 1) * m_ref_len, m_ref_packed.begin() + slot * m_ref_len );
+        m_ref_slot[i] = slot;
+    }
+
+    for( size_t i = 0; i < num_edges; ++i ) {
+        if( m_ref_rep[i] != i ) {
+            m_ref_slot[i] = m_ref_slot[m_ref_rep[i]];
+        }
+    }
+
+    m_ref_packed.resize( m_ref_unique.size() * m_ref_len );
+    std::vector<packed_t>(m_ref_packed).swap(m_ref_packed); // old fashioned shrink_to_fit
 }
 template<typename pvec_t, typename seq_tag>
 const std::vector<int> &references<pvec_t,seq_tag>::ng_map_at( size_t i ) {
@@ -706,15 +1226,46 @@ const std::vector<int> &references<pvec_t,seq_tag>::ng_map_at( size_t i ) {
 }
 
 
+template<typename pvec_t, typename seq_tag>
+size_t references<pvec_t,seq_tag>::cluster_bound( const size_t *first, const size_t *last, std::vector<int> *pvec, std::vector<unsigned int> *aux ) const {
+    assert( first < last );
+
+    unpack_at( *first, pvec, aux );
+
+    std::vector<bool> mixed( pvec->size() );
+    std::vector<int> p;
+    std::vector<unsigned int> a;
+
+    for( const size_t *it = first + 1; it != last; ++it ) {
+        unpack_at( *it, &p, &a );
+
+        for( size_t j = 0; j < pvec->size(); ++j ) {
+            (*pvec)[j] |= p[j];
+
+            if( (a[j] == AUX_CGAP) != ((*aux)[j] == AUX_CGAP) ) {
+                mixed[j] = true;
+                (*aux)[j] = AUX_CGAP;
+            }
+        }
+    }
+
+    return std::count( mixed.begin(), mixed.end(), true );
+}
+
 template<typename pvec_t, typename seq_tag>
 void references<pvec_t,seq_tag>::write_pvecs(const char* name) {
     std::ofstream os( name );
 
-    os << m_ref_pvecs.size();
-    for( size_t i = 0; i < m_ref_pvecs.size(); ++i ) {
-        os << " " << m_ref_pvecs[i].size() << " ";
-        os.write( (char *)m_ref_pvecs[i].data(), m_ref_pvecs[i].size() * sizeof(int));
-        os.write( (char *)m_ref_aux[i].data(), m_ref_aux[i].size() * sizeof(unsigned int));
+    std::vector<int> pvec;
+    std::vector<unsigned int> aux;
+
+    os << num_pvecs();
+    for( size_t i = 0; i < num_pvecs(); ++i ) {
+        unpack_at( i, &pvec, &aux );
+
+        os << " " << pvec.size() << " ";
+        os.write( (char *)pvec.data(), pvec.size() * sizeof(int));
+        os.write( (char *)aux.data(), aux.size() * sizeof(unsigned int));
     }
 }
 
@@ -730,13 +1281,12 @@ size_t references<pvec_t,seq_tag>::max_name_length() const {
 
 
 bool scoring_results::offer(size_t qs, size_t ref, int score) {
-    ivy_mike::lock_guard<ivy_mike::mutex> lock(mtx_);
-
     candss_.at( qs ).offer( score, ref );
 
     if( best_score_.at(qs) < score || (best_score_.at(qs) == score && ref < best_ref_.at(qs))) {
         best_score_[qs] = score;
         best_ref_.at(qs) = ref;
+        best_end_.at(qs) = size_t(-1);
         return true;
     }
 
@@ -747,8 +1297,33 @@ bool scoring_results::offer(size_t qs, size_t ref, int score) {
 
 
 
+void scoring_results::merge(const scoring_results& other) {
+    assert( other.size() == size() );
+
+    for( size_t qs = 0; qs < size(); ++qs ) {
+        const candidates &cands = other.candss_[qs];
+        for( size_t i = 0; i < cands.size(); ++i ) {
+            candss_[qs].offer( cands[i].score(), cands[i].ref() );
+        }
+
+        const size_t ref = other.best_ref_[qs];
+        const int score = other.best_score_[qs];
+
+        if( ref != size_t(-1) && (best_score_[qs] < score || (best_score_[qs] == score && ref < best_ref_[qs]))) {
+            best_score_[qs] = score;
+            best_ref_[qs] = ref;
+            best_end_[qs] = other.best_end_[qs];
+        }
+    }
+}
+
+
 namespace papara {
 void scoring_results::candidates::offer(int score, size_t ref) {
+    // almost all offers are rejected once the list is full, so check that before touching the vector
+    if( !accepts( score, ref )) {
+        return;
+    }
 
     candidate c( score,ref);
 
@@ -776,61 +1351,314 @@ bool scoring_results::candidate::operator<(const scoring_results::candidate& oth
 // driver stuff
 ////////////////////////////////////////////////////////
 
-template<typename seq_tag>
-class worker {
+// the scoring kernels of one worker thread: for each score precision (narrowest first) enough kernels to cover a whole block.
+// A query is scored with the narrowest precision that can represent its scores. If an 8bit kernel saturates, the
+// (query, block) pair is transparently re-scored with the next wider precision. As a query that saturated once will most
+// likely do so again for the next block, it then starts with the wider precision from there on.
+class kernel_ladder {
+public:
+    kernel_ladder( kernel_isa isa, score_bits min_bits, size_t block_width, const papara_score_parameters &sp, const std::vector<int> &cstate_map, size_t num_qs )
+      : cstate_map_(cstate_map),
+        block_width_(block_width),
+        first_level_(num_qs, 0)
+    {
+        const score_bits all_bits[] = { score_8bit, score_16bit, score_32bit };
 
+        for( size_t i = 0; i < sizeof(all_bits) / sizeof(all_bits[0]); ++i ) {
+            if( all_bits[i] < min_bits ) {
+                continue;
+            }
 
+            levels_.push_back( level( all_bits[i] ));
+            level &l = levels_.back();
 
-    const static size_t VW = vu_config<seq_tag>::width;
-    typedef typename vu_config<seq_tag>::scalar vu_scalar_t;
-    typedef typename block_queue<seq_tag>::block_t block_t;
-    typedef model<seq_tag> seq_model;
+            while( l.kernels.size() * l.width < block_width ) {
+                std::unique_ptr<scoring_kernel> k = create_scoring_kernel( isa, all_bits[i], sp.match, sp.match_cgap, sp.gap_open, sp.gap_extend );
 
+                l.width = k->width();
+                if( block_width % l.width != 0 ) {
+                    throw std::runtime_error( "kernel_ladder: block width is not a multiple of the kernel width" );
+                }
 
+                l.kernels.push_back( std::shared_ptr<scoring_kernel>( k.release() ));
+            }
+        }
+    }
 
-    block_queue<seq_tag> &block_queue_;
-    scoring_results &results_;
+    // the pointer arrays must stay valid until the next call
+    void init_block( const int **seqptrs, const unsigned int **auxptrs, size_t reflen ) {
+        seqptrs_ = seqptrs;
+        auxptrs_ = auxptrs;
+        reflen_ = reflen;
 
-    const queries<seq_tag> &qs_;
+        // the profiles are built lazily, only for the precisions that are actually needed for this block
+        for( std::vector<level>::iterator it = levels_.begin(); it != levels_.end(); ++it ) {
+            it->block_ready = false;
+        }
+    }
 
-    const size_t rank_;
+    // score cseq against the current block. out (and end_cols, if non-null, see scoring_kernel::align) must have room
+    // for block_width entries. For checkpoint_rows see prefix_plan.
+    void align( size_t qs_idx, const std::vector<uint8_t> &cseq, std::pair<size_t,size_t> bounds, int *out, size_t *end_cols = 0, const size_t *checkpoint_rows = 0, size_t num_checkpoint_rows = 0 ) {
+        bool rescore = false;
 
-    const papara_score_parameters sp_;
+        for( std::vector<level>::iterator it = levels_.begin() + first_level_.at(qs_idx); it != levels_.end(); ++it ) {
+            if( cseq.size() > it->kernels.front()->max_query_len() ) {
+                continue;
+            }
 
-    static void copy_to_profile( const block_t &block, aligned_buffer<vu_scalar_t> *prof, aligned_buffer<vu_scalar_t> *aux_prof ) {
-        size_t reflen = block.ref_len;
+            if( !it->block_ready ) {
+                for( size_t i = 0; i < it->kernels.size(); ++i ) {
+                    it->kernels[i]->init_block( seqptrs_ + i * it->width, auxptrs_ + i * it->width, reflen_, cstate_map_.data(), cstate_map_.size() );
+                }
+                it->block_ready = true;
+            }
 
+            bool ok = true;
+            for( size_t i = 0; ok && i < it->kernels.size(); ++i ) {
+                ok = it->kernels[i]->align( cseq.data(), cseq.data() + cseq.size(), bounds.first, bounds.second, out + i * it->width, end_cols != 0 ? end_cols + i * it->width : 0, checkpoint_rows, num_checkpoint_rows );
+            }
 
+            if( ok ) {
+                ++it->num_scored;
+                if( rescore ) {
+                    ++it->num_rescored;
+                }
+                return;
+            }
 
-        assert( reflen * VW == prof->size() );
-        assert( reflen * VW == aux_prof->size() );
+            rescore = true;
+            first_level_[qs_idx] = uint8_t(std::distance( levels_.begin(), it ) + 1);
+        }
 
-        typename aligned_buffer<vu_scalar_t>::iterator it = prof->begin();
-        typename aligned_buffer<vu_scalar_t>::iterator ait = aux_prof->begin();
-    //         std::cout << "reflen: " << reflen << " " << size_t(&(*it)) << "\n";
+        throw std::runtime_error( "kernel_ladder: query cannot be scored with any score type" );
+    }
 
-        for( size_t i = 0; i < reflen; ++i ) {
-            for( size_t j = 0; j < VW; ++j ) {
-    //                 std::cout << "ij: " << i << " " << j << " " << pvecs[j].size() <<  "\n";
+    uint64_t ticks_all() const {
+        uint64_t ticks = 0;
+        for( std::vector<level>::const_iterator it = levels_.begin(); it != levels_.end(); ++it ) {
+            for( size_t i = 0; i < it->kernels.size(); ++i ) {
+                ticks += it->kernels[i]->ticks_all();
+            }
+        }
+        return ticks;
+    }
 
+    uint64_t inner_iters_all() const {
+        uint64_t iters = 0;
+        for( std::vector<level>::const_iterator it = levels_.begin(); it != levels_.end(); ++it ) {
+            for( size_t i = 0; i < it->kernels.size(); ++i ) {
+                iters += it->kernels[i]->inner_iters_all();
+            }
+        }
+        return iters;
+    }
 
-                *it = vu_scalar_t(block.seqptrs[j][i]);
-                *ait = (block.auxptrs[j][i] == AUX_CGAP) ? vu_scalar_t(-1) : 0;
+    void print_stats( std::ostream &os ) const {
+        for( std::vector<level>::const_iterator it = levels_.begin(); it != levels_.end(); ++it ) {
+            if( it != levels_.begin() ) {
+                os << ", ";
+            }
+            os << it->bits << "bit: " << it->num_scored;
 
-                ++it;
-                ++ait;
+            if( it->num_rescored != 0 ) {
+                os << " (" << it->num_rescored << " re-scored)";
             }
         }
+    }
 
+private:
+    struct level {
+        level( score_bits b ) : bits(b), width(0), block_ready(false), num_scored(0), num_rescored(0) {}
 
-        assert( it == prof->end());
-        assert( ait == aux_prof->end());
+        score_bits bits;
+        size_t width;
+        std::vector<std::shared_ptr<scoring_kernel> > kernels;
+        bool block_ready;
 
+        uint64_t num_scored;
+        uint64_t num_rescored;
+    };
+
+    const std::vector<int> &cstate_map_;
+    const size_t block_width_;
+
+    std::vector<level> levels_;
+    std::vector<uint8_t> first_level_; // per query: index of the narrowest level that did not saturate so far
+
+    const int **seqptrs_;
+    const unsigned int **auxptrs_;
+    size_t reflen_;
+};
+
+// shared-prefix reuse of the scoring kernels (see pvec_aligner_vec::align): when the queries are scored in
+// lexicographic order, query k shares its first lcp(k-1, k) rows with the previous one. These rows have to be
+// checkpointed by the last query before k that actually computed them, i.e., the last one that shares fewer rows with
+// its own predecessor (all queries in between share at least as many rows with k). Rows shared by many queries are
+// thereby computed once per block.
+class prefix_plan {
+public:
+    template<typename seq_tag>
+    void build( const queries<seq_tag> &qs, const std::vector<size_t> &order ) {
+        const size_t n = order.size();
+
+        shared_.assign( n, 0 );
+        for( size_t k = 1; k < n; ++k ) {
+            const std::vector<uint8_t> &a = qs.cseq_at( order[k-1] );
+            const std::vector<uint8_t> &b = qs.cseq_at( order[k] );
+
+            // the last row of a query is never shared
+            const size_t max_shared = std::min( a.size(), b.size() - std::min( b.size(), size_t(1) ));
+            shared_[k] = std::distance( b.begin(), std::mismatch( b.begin(), b.begin() + max_shared, a.begin() ).first );
+        }
+
+        // (query, rows) pairs of the checkpoints, found with a stack of the queries with increasing shared_
+        std::vector<std::pair<size_t,size_t> > saves;
+        std::vector<size_t> stack;
+        for( size_t k = 0; k < n; ++k ) {
+            while( !stack.empty() && shared_[stack.back()] >= shared_[k] ) {
+                stack.pop_back();
+            }
+
+            if( shared_[k] > 0 && !stack.empty() ) {
+                saves.push_back( std::make_pair( stack.back(), shared_[k] ));
+            }
+            stack.push_back( k );
+        }
+
+        std::sort( saves.begin(), saves.end() );
+        saves.erase( std::unique( saves.begin(), saves.end() ), saves.end() );
+
+        rows_.resize( saves.size() );
+        first_.assign( n + 1, 0 );
+        for( size_t i = 0; i < saves.size(); ++i ) {
+            rows_[i] = saves[i].second;
+            ++first_[saves[i].first + 1];
+        }
+        for( size_t k = 0; k < n; ++k ) {
+            first_[k + 1] += first_[k];
+        }
+    }
+
+    // the checkpoint rows of the k-th query (in the order passed to build)
+    const size_t *rows( size_t k ) const {
+        return rows_.data() + first_[k];
+    }
+
+    size_t num_rows( size_t k ) const {
+        return first_[k + 1] - first_[k];
+    }
+
+    // number of rows that the k-th query shares with the previous one
+    size_t shared( size_t k ) const {
+        return shared_[k];
+    }
+
+private:
+    std::vector<size_t> shared_;
+    std::vector<size_t> rows_;
+    std::vector<size_t> first_;
+};
+
+// orders the queries by the lexicographic rank of their sequences
+class lower_rank {
+public:
+    lower_rank( const std::vector<size_t> &rank ) : rank_(&rank) {}
+
+    bool operator()( size_t a, size_t b ) const {
+        return (*rank_)[a] < (*rank_)[b];
+    }
+
+private:
+    const std::vector<size_t> *rank_;
+};
+
+// the kernels build their profiles from plain int/unsigned int vectors (see scoring_kernel::init_block): unpacks the
+// vectors of a block (see packed_column) into buffers of the worker thread, which stay valid until the next call.
+template<typename seq_tag>
+class unpacked_block {
+public:
+    void unpack( const typename block_queue<seq_tag>::block_t &block ) {
+        pvecs_.resize( block.width * block.ref_len );
+        auxs_.resize( block.width * block.ref_len );
+        seqptrs_.resize( block.width );
+        auxptrs_.resize( block.width );
+
+        for( size_t i = 0; i < block.width; ++i ) {
+            if( i > 0 && block.edges[i] == block.edges[i-1] ) {
+                // the same vector (i.e., the padding of the last block)
+                seqptrs_[i] = seqptrs_[i-1];
+                auxptrs_[i] = auxptrs_[i-1];
+                continue;
+            }
+
+            packed_column<seq_tag>::unpack( block.cellptrs[i], block.ref_len, &pvecs_[i * block.ref_len], &auxs_[i * block.ref_len] );
+            seqptrs_[i] = &pvecs_[i * block.ref_len];
+            auxptrs_[i] = &auxs_[i * block.ref_len];
+        }
     }
 
+    const int **seqptrs() {
+        return seqptrs_.data();
+    }
+
+    const unsigned int **auxptrs() {
+        return auxptrs_.data();
+    }
+
+private:
+    std::vector<int> pvecs_;
+    std::vector<unsigned int> auxs_;
+    std::vector<const int *> seqptrs_;
+    std::vector<const unsigned int *> auxptrs_;
+};
+
+template<typename seq_tag>
+class worker {
+
+
+
+    typedef typename block_queue<seq_tag>::block_t block_t;
+    typedef typename block_queue<seq_tag>::cluster_t cluster_t;
+    typedef model<seq_tag> seq_model;
+
+
+
+    run_context &ctx_;
+    block_queue<seq_tag> &block_queue_;
+    scoring_results &results_; // thread-local (see run_workers), so the pruning thresholds only reflect this thread's blocks
+
+    const queries<seq_tag> &qs_;
+
+    const size_t rank_;
+
+    const papara_score_parameters sp_;
+
+    const kernel_isa isa_;
+    const score_bits min_bits_;
+    const size_t block_width_;
+
+    // lexicographic rank per query for the shared-prefix reuse (empty if it is switched off)
+    const std::vector<size_t> &prefix_rank_;
+
+    // print the progress and the per-thread statistics (not for the prefilter recall check, see calc_scores)
+    const bool log_stats_;
+
+    class more_votes {
+    public:
+        more_votes( const std::vector<size_t> &votes ) : votes_(&votes) {}
+
+        bool operator()( size_t a, size_t b ) const {
+            return (*votes_)[a] > (*votes_)[b];
+        }
+
+    private:
+        const std::vector<size_t> *votes_;
+    };
+
 public:
-    worker( block_queue<seq_tag> *bq, scoring_results *res, const queries<seq_tag> &qs, size_t rank, const papara_score_parameters &sp ) 
-      : block_queue_(*bq), results_(*res), qs_(qs), rank_(rank), sp_(sp) {}
+    worker( run_context &ctx, block_queue<seq_tag> *bq, scoring_results *res, const queries<seq_tag> &qs, size_t rank, const papara_score_parameters &sp, kernel_isa isa, score_bits min_bits, size_t block_width, const std::vector<size_t> &prefix_rank, bool log_stats )
+      : ctx_(ctx), block_queue_(*bq), results_(*res), qs_(qs), rank_(rank), sp_(sp), isa_(isa), min_bits_(min_bits), block_width_(block_width), prefix_rank_(prefix_rank), log_stats_(log_stats) {}
     void operator()() {
 
 
@@ -843,201 +1671,703 @@ public:
 
         uint64_t ncup = 0;
 
-        uint64_t inner_iters = 0;
-        uint64_t ticks_all = 0;
-
         uint64_t ncup_short = 0;
 
-        uint64_t inner_iters_short = 0;
-        uint64_t ticks_all_short = 0;
+        uint64_t inner_iters_short_start = 0;
+        uint64_t ticks_all_short_start = 0;
 
 
-        aligned_buffer<vu_scalar_t> pvec_prof;
-        aligned_buffer<vu_scalar_t> aux_prof;
-        align_vec_arrays<vu_scalar_t> arrays;
-        aligned_buffer<vu_scalar_t> out_scores(VW);
-        aligned_buffer<vu_scalar_t> out_scores2(VW);
-        
+        // the kernels only see the c-state -> p-state mapping as a plain table
+        std::vector<int> cstate_map( seq_model::num_cstates() );
+        for( size_t i = 0; i < cstate_map.size(); ++i ) {
+            cstate_map[i] = seq_model::c2p(i);
+        }
+
+        kernel_ladder kernels( isa_, min_bits_, block_width_, sp_, cstate_map, qs_.size() );
+        unpacked_block<seq_tag> block_vecs;
+        std::vector<int> out_scores( block_width_ );
+        std::vector<size_t> out_end_cols( block_width_ );
+
+        // branch-and-bound: the scores of the upper bound vectors of the blocks in the current cluster (per query).
+        // The bound vectors are aligned with the same kernels, which makes the alignment of a query against a whole cluster
+        // of blocks about as expensive as against a single block, and the blocks whose bound cannot beat the current
+        // results of a query are skipped. A difference in the cgap flags only costs the bound vector match_cgap per
+        // diagonal step, so the bound is raised by that for each of these columns (up to the query length).
+        kernel_ladder bound_kernels( isa_, min_bits_, block_width_, sp_, cstate_map, qs_.size() );
+        unpacked_block<seq_tag> bound_vecs;
+        std::vector<int> bound_scores;
+        std::vector<size_t> block_votes( block_width_ );
+        std::vector<size_t> block_order;
+        const int cgap_slack = std::max( 0, -sp_.match_cgap );
+        uint64_t num_pairs = 0;
+        uint64_t num_pruned = 0;
+
+        prefix_plan plan;
+        uint64_t num_rows = 0;
+        uint64_t num_shared_rows = 0;
+
         size_t queue_size;
         size_t init_queue_size = -1;
         
-        while( true ) {
-            block_t block;
+        cluster_t cluster;
 
-            if( !block_queue_.get_block(&block, &queue_size)) {
-                break;
+        while( block_queue_.get_cluster(&cluster, &queue_size) ) {
+            if( init_queue_size == size_t(-1) ) {
+                init_queue_size = queue_size + 1;
             }
 
-            if( init_queue_size == size_t(-1) ) {
-                init_queue_size = queue_size;
+            // the queries of the cluster (if the cluster does not name any, it is for all of them). Duplicate queries are
+            // not aligned, their results are copied from their representative (see queries::rep_at).
+            if( cluster.queries.empty() ) {
+                cluster.queries = qs_.unique_queries();
             }
-            
-            if( cups_per_ref == uint64_t(-1) ) {
-                cups_per_ref = qs_.calc_cups_per_ref(block.ref_len );
+
+            if( !prefix_rank_.empty() ) {
+                std::sort( cluster.queries.begin(), cluster.queries.end(), lower_rank( prefix_rank_ ));
+                plan.build( qs_, cluster.queries );
+
+                for( size_t k = 0; k < cluster.queries.size(); ++k ) {
+                    num_rows += qs_.cseq_at( cluster.queries[k] ).size();
+                    num_shared_rows += plan.shared( k );
+                }
             }
 
-#if 1
-       //     assert( VW == 8 );
+            if( !cluster.blocks.empty() ) {
+                cups_per_ref = 0;
+                for( std::vector<size_t>::iterator it = cluster.queries.begin(); it != cluster.queries.end(); ++it ) {
+                    cups_per_ref += qs_.cseq_at(*it).size() * cluster.blocks.front().ref_len;
+                }
+            }
 
-            pvec_prof.resize( VW * block.ref_len );
-            aux_prof.resize( VW * block.ref_len );
+            if( cluster.has_bounds ) {
+                assert( cluster.bounds.width == block_width_ );
 
-            copy_to_profile(block, &pvec_prof, &aux_prof );
+                bound_scores.resize( qs_.size() * block_width_ );
+                bound_vecs.unpack( cluster.bounds );
+                bound_kernels.init_block( bound_vecs.seqptrs(), bound_vecs.auxptrs(), cluster.bounds.ref_len );
 
-            pvec_aligner_vec<vu_scalar_t,VW> pav( block.seqptrs, block.auxptrs, block.ref_len, sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend, seq_model::c2p, seq_model::num_cstates() );
+                std::fill( block_votes.begin(), block_votes.end(), 0 );
 
-//            const align_pvec_score<vu_scalar_t,VW> aligner( block.seqptrs, block.auxptrs, block.ref_len, score_mismatch, score_match_cgap, score_gap_open, score_gap_extend );
-            for( unsigned int i = 0; i < qs_.size(); i++ ) {
+                for( size_t k = 0; k < cluster.queries.size(); ++k ) {
+                    const size_t i = cluster.queries[k];
+                    int *bs = bound_scores.data() + i * block_width_;
 
-                //align_pvec_score_vec<vu_scalar_t, VW, false, typename seq_model::pars_state_t>( pvec_prof, aux_prof, qs_.pvec_at(i), score_match, score_match_cgap, score_gap_open, score_gap_extend, out_scores, arrays );
+                    if( prefix_rank_.empty() ) {
+                        bound_kernels.align( i, qs_.cseq_at(i), qs_.get_per_qs_bounds( i ), bs );
+                    } else {
+                        bound_kernels.align( i, qs_.cseq_at(i), qs_.get_per_qs_bounds( i ), bs, 0, plan.rows( k ), plan.num_rows( k ));
+                    }
 
+                    for( size_t j = 0; j < cluster.blocks.size(); ++j ) {
+                        bs[j] += cgap_slack * int(std::min( cluster.num_mixed[j], qs_.cseq_at(i).size() ));
+                    }
 
-                std::pair<size_t,size_t> bounds = qs_.get_per_qs_bounds( i );
-//		std::cout << "bounds: " << bounds.first << " " << bounds.second << "\n";
+                    ++block_votes[std::distance( bs, std::max_element( bs, bs + cluster.blocks.size() ))];
+                }
+            }
+
+            // start with the blocks that have the highest bound for most queries: the better the scores found early on,
+            // the more of the remaining blocks can be skipped. The order has no influence on the results.
+            block_order.resize( cluster.blocks.size() );
+            for( size_t j = 0; j < block_order.size(); ++j ) {
+                block_order[j] = j;
+            }
 
-                // if no bounds are available, get_per_qs_bounds will return [size_t(-1),size_t(-1)], which align is supposed to interpret as 'full range'
-                pav.align( qs_.cseq_at(i).begin(), qs_.cseq_at(i).end(), sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend, out_scores.begin(), bounds.first, bounds.second );
+            if( cluster.has_bounds ) {
+                std::stable_sort( block_order.begin(), block_order.end(), more_votes( block_votes ));
+            }
 
-                //aligner.align(qs_.pvec_at(i).begin(), qs_.pvec_at(i).end());
-                //const vu_scalar_t *score_vec = aligner.get_scores();
+            for( std::vector<size_t>::iterator it = block_order.begin(); it != block_order.end(); ++it ) {
+                const size_t j = *it;
+                block_t &block = cluster.blocks[j];
 
+                if( cups_per_ref == uint64_t(-1) ) {
+                    cups_per_ref = qs_.calc_cups_per_ref(block.ref_len );
+                }
 
+                assert( block.width == block_width_ );
 
-                //ncup += block.num_valid * block.ref_len * qs_.pvec_at(i).size();
-#if 0 // test against old version
-                align_pvec_score_vec<vu_scalar_t, VW>( pvec_prof.begin(), pvec_prof.end(), aux_prof.begin(), qs_.pvec_at(i).begin(), qs_.pvec_at(i).end(), score_match, score_match_cgap, score_gap_open, score_gap_extend, out_scores2.begin(), arrays );
-                bool eq = std::equal( out_scores.begin(), out_scores.end(), out_scores2.begin() );
+                block_vecs.unpack( block );
+                kernels.init_block( block_vecs.seqptrs(), block_vecs.auxptrs(), block.ref_len );
 
+                for( size_t k = 0; k < cluster.queries.size(); ++k ) {
+                    const size_t i = cluster.queries[k];
+                    ++num_pairs;
 
-                if( !eq ) {
-                    std::cout << "meeeeeeep!\n";
-                }
-                //std::cout << "eq: " << eq << "\n";
-#endif
+                    if( cluster.has_bounds && bound_scores[i * block_width_ + j] < results_.pruning_threshold( i ) ) {
+                        ++num_pruned;
+                        continue;
+                    }
 
-//                 std::cout << "scores: ";
-//                 std::copy( out_scores.begin(), out_scores.end(), std::ostream_iterator<int>(std::cout, "\n" ) );
-//                 std::cout << "\n";
-                results_.offer( i, block.edges, block.edges + block.num_valid, out_scores.begin() );
+                    std::pair<size_t,size_t> bounds = qs_.get_per_qs_bounds( i );
+//		std::cout << "bounds: " << bounds.first << " " << bounds.second << "\n";
 
-            }
+                    // if no bounds are available, get_per_qs_bounds will return [size_t(-1),size_t(-1)], which align is supposed to interpret as 'full range'
+                    if( prefix_rank_.empty() ) {
+                        kernels.align( i, qs_.cseq_at(i), bounds, out_scores.data(), out_end_cols.data() );
+                    } else {
+                        kernels.align( i, qs_.cseq_at(i), bounds, out_scores.data(), out_end_cols.data(), plan.rows( k ), plan.num_rows( k ));
+                    }
 
-            ncup += block.num_valid * cups_per_ref;
-            ncup_short += block.num_valid * cups_per_ref;
+//                     std::cout << "scores: ";
+//                     std::copy( out_scores.begin(), out_scores.end(), std::ostream_iterator<int>(std::cout, "\n" ) );
+//                     std::cout << "\n";
+                    results_.offer( i, block.edges, block.edges + block.num_valid, out_scores.begin(), out_end_cols.data() );
 
-            ticks_all += pav.ticks_all();
-            ticks_all_short += pav.ticks_all();
+                }
 
-            inner_iters += pav.inner_iters_all();
-            inner_iters_short += pav.inner_iters_all();
+                ncup += block.num_valid * cups_per_ref;
+                ncup_short += block.num_valid * cups_per_ref;
+            }
 
-            if( rank_ == 0 &&  tprint.elapsed() > 10 ) {
+            if( log_stats_ && rank_ == 0 &&  tprint.elapsed() > 10 ) {
 
                 //std::cout << "thread " << rank_ << " " << ncup << " in " << tstatus.elapsed() << " : "
                 
                 float fdone = (init_queue_size - queue_size) / float(init_queue_size);
                 
-                lout << fdone * 100 << "% done. ";
-                lout << ncup / (tstatus.elapsed() * 1e9) << " gncup/s, " << ticks_all / double(inner_iters) << " tpili (short: " << ncup_short / (tprint.elapsed() * 1e9) << ", " << ticks_all_short / double(inner_iters_short) << ")" << std::endl;
+                const uint64_t ticks_all = kernels.ticks_all();
+                const uint64_t inner_iters = kernels.inner_iters_all();
+
+                ctx_.log() << fdone * 100 << "% done. ";
+                ctx_.log() << ncup / (tstatus.elapsed() * 1e9) << " gncup/s, " << ticks_all / double(inner_iters) << " tpili (short: " << ncup_short / (tprint.elapsed() * 1e9) << ", " << (ticks_all - ticks_all_short_start) / double(inner_iters - inner_iters_short_start) << ")" << std::endl;
 
                 ncup_short = 0;
-                ticks_all_short = 0;
-                inner_iters_short = 0;
+                ticks_all_short_start = ticks_all;
+                inner_iters_short_start = inner_iters;
 
                 tprint = ivy_mike::timer();
             }
 
         }
-#else
+        if( log_stats_ ) {
+            ivy_mike::lock_guard<ivy_mike::mutex> lock( *block_queue_.hack_mutex() );
+            ctx_.log() << "thread " << rank_ << ": " << ncup / (tstatus.elapsed() * 1e9) << " gncup/s (query/block pairs scored with ";
+            kernels.print_stats( ctx_.log() );
+            ctx_.log() << ")" << std::endl;
 
-//        assert( block.gapp_ptrs[0] != 0 );
-//        assert( VW == 4 );
-//        const align_pvec_gapp_score<4> aligner( block.seqptrs, block.gapp_ptrs, block.ref_len, score_mismatch, score_match_cgap, score_gap_open, score_gap_extend );
-//        for( unsigned int i = 0; i < m_pnt.m_qs_names.size(); i++ ) {
-//
-//            size_t stride = 1;
-//            size_t aux_stride = 1;
-//
-//            aligner.align(m_pnt.m_qs_pvecs[i]);
-//            const float *score_vec = aligner.get_scores();
-//
-//            ncup += block.num_valid * block.ref_len * m_pnt.m_qs_pvecs[i].size();
-//            {
-//                ivy_mike::lock_guard<ivy_mike::mutex> lock( m_pnt.m_qmtx );
-//
-//                for( int k = 0; k < block.num_valid; k++ ) {
-//
-//
-//
-//                    if( score_vec[k] < m_pnt.m_qs_bestscore[i] || (score_vec[k] == m_pnt.m_qs_bestscore[i] && block.edges[k] < m_pnt.m_qs_bestedge[i] )) {
-//                        const bool validate = false;
-//                        if( validate ) {
-//                            const int *seqptr = block.seqptrs[k];
-//                            const double *gapp_ptr = block.gapp_ptrs[k];
-//
-////                                std::vector<double> gapp_tmp(gapp_ptr, gapp_ptr + block.ref_len);
-//
-//
-//                            pars_align_gapp_seq pas( seqptr, m_pnt.m_qs_pvecs[i].data(), block.ref_len, m_pnt.m_qs_pvecs[i].size(), stride, gapp_ptr, aux_stride, seq_arrays_gapp, 0, score_gap_open, score_gap_extend, score_mismatch, score_match_cgap );
-//                            int res = pas.alignFreeshift(INT_MAX);
-//
-//                            if( res != score_vec[k] ) {
-//
-//
-//                                std::cout << "meeeeeeep! score: " << score_vec[k] << " " << res << "\n";
-//                            }
-//                        }
-//
-//                        m_pnt.m_qs_bestscore[i] = score_vec[k];
-//                        m_pnt.m_qs_bestedge[i] = block.edges[k];
-//                    }
-//                }
-//            }
-//        }
-//    }
+            if( num_pruned != 0 ) {
+                ctx_.log() << "thread " << rank_ << ": skipped " << num_pruned << " of " << num_pairs << " query/block pairs by their upper bound" << std::endl;
+            }
+            if( num_shared_rows != 0 ) {
+                ctx_.log() << "thread " << rank_ << ": " << num_shared_rows << " of " << num_rows << " query rows shared with the previous query" << std::endl;
+            }
+        }
+    }
+};
+
+
+// each worker thread collects its results in a scoring_results object of its own, which are merged into res once all
+// threads are done (in the order of the thread ranks, though the merge does not depend on it).
+static void merge_thread_results( const std::deque<scoring_results> &thread_res, scoring_results *res ) {
+    for( std::deque<scoring_results>::const_iterator it = thread_res.begin(); it != thread_res.end(); ++it ) {
+        res->merge( *it );
+    }
+}
+
+// the duplicate queries are not scored: copy the results of their representatives. The duplicate edges are not scored
+// either: they are added to the candidates with the score of their representative.
+template<typename pvec_t, typename seq_tag>
+void copy_duplicate_results( const references<pvec_t,seq_tag> &refs, const queries<seq_tag> &qs, scoring_results *res ) {
+    if( res->max_candidates() != 0 && refs.unique_pvecs().size() != refs.num_pvecs() ) {
+        std::vector<std::vector<size_t> > dups( refs.num_pvecs() );
+        for( size_t i = 0; i < refs.num_pvecs(); ++i ) {
+            if( refs.rep_at(i) != i ) {
+                dups[refs.rep_at(i)].push_back( i );
+            }
+        }
+
+        for( std::vector<size_t>::const_iterator it = qs.unique_queries().begin(); it != qs.unique_queries().end(); ++it ) {
+            res->add_duplicate_refs( *it, dups );
+        }
+    }
+
+    for( size_t i = 0; i < qs.size(); ++i ) {
+        if( qs.rep_at(i) != i ) {
+            res->copy_query( qs.rep_at(i), i );
+        }
+    }
+}
+
+template<typename seq_tag>
+void run_workers( run_context &ctx, size_t n_threads, block_queue<seq_tag> *bq, papara::scoring_results *res, const queries<seq_tag> &qs, const papara::papara_score_parameters &sp, kernel_isa isa, score_bits min_bits, size_t vec_width, const std::vector<size_t> &prefix_rank, bool log_stats ) {
+    typedef worker<seq_tag> worker_t;
+
+    std::deque<scoring_results> thread_res;
+    for( size_t i = 0; i < n_threads; ++i ) {
+        thread_res.emplace_back( res->size(), scoring_results::candidates( res->max_candidates() ));
+    }
+
+    ivy_mike::thread_group tg;
+
+    for( size_t i = 1; i < n_threads; ++i ) {
+        tg.create_thread(worker_t(ctx, bq, &thread_res[i], qs, i, sp, isa, min_bits, vec_width, prefix_rank, log_stats));
+    }
+
+    // lazy mode: the vectors of the blocks are created by a thread of its own (see block_queue::produce)
+    if( bq->lazy() ) {
+        tg.create_thread( [bq]() { bq->produce(); } );
+    }
+
+    worker_t w0(ctx, bq, &thread_res[0], qs, 0, sp, isa, min_bits, vec_width, prefix_rank, log_stats );
+
+    try {
+        w0();
+    } catch( ... ) {
+        bq->cancel_producer();
+        throw;
+    }
+
+    tg.join_all();
+    bq->rethrow_producer_error();
+
+    merge_thread_results( thread_res, res );
+}
+
+// work list of the query-striped scoring mode: groups of (similarly long) queries, which are aligned against all references.
+class query_group_queue {
+public:
+    query_group_queue() : next_(0) {}
+
+    // WARNING: this method is not synchronized, and shall only be called before the worker threads are running
+    void push_back( const std::vector<size_t> &group ) {
+        groups_.push_back( group );
+    }
+
+    // lock-free, like block_queue::get_cluster
+    bool get_group( std::vector<size_t> *group, size_t *queue_size = 0 ) {
+        const size_t i = next_.fetch_add( 1, std::memory_order_relaxed );
+
+        if( i >= groups_.size() ) {
+            return false;
+        }
+
+        group->swap( groups_[i] );
+
+        if( queue_size != 0 ) {
+            *queue_size = groups_.size() - i - 1;
+        }
+
+        return true;
+    }
+
+    ivy_mike::mutex *hack_mutex() {
+        return &mtx_;
+    }
+
+private:
+    query_group_queue( const query_group_queue & );
+    query_group_queue &operator=( const query_group_queue & );
+
+    ivy_mike::mutex mtx_; // only used to serialize the log output of the worker threads
+    std::vector<std::vector<size_t> > groups_;
+    std::atomic<size_t> next_;
+};
+
+template<typename seq_tag>
+class cseq_size_less {
+public:
+    cseq_size_less( const queries<seq_tag> &qs ) : qs_(&qs) {}
+
+    bool operator()( size_t a, size_t b ) const {
+        return qs_->cseq_at(a).size() < qs_->cseq_at(b).size();
+    }
+
+private:
+    const queries<seq_tag> *qs_;
+};
+
+template<typename seq_tag>
+class cseq_lexicographic_less {
+public:
+    cseq_lexicographic_less( const queries<seq_tag> &qs ) : qs_(&qs) {}
+
+    bool operator()( size_t a, size_t b ) const {
+        return qs_->cseq_at(a) < qs_->cseq_at(b);
+    }
+
+private:
+    const queries<seq_tag> *qs_;
+};
+
+// worker of the query-striped scoring mode (for trees with few edges compared to the number of queries): aligns a group of
+// queries at a time against all reference edges. Groups with queries that are too long for the 16bit kernel are split up
+// and aligned with the 32bit one.
+template<typename pvec_t, typename seq_tag>
+class qs_worker {
+    typedef model<seq_tag> seq_model;
+
+    query_group_queue &group_queue_;
+    scoring_results &results_;
+
+    const references<pvec_t,seq_tag> &refs_;
+    const queries<seq_tag> &qs_;
+
+    const size_t rank_;
+
+    const papara_score_parameters sp_;
+
+    const kernel_isa isa_;
+
+public:
+    qs_worker( query_group_queue *gq, scoring_results *res, const references<pvec_t,seq_tag> &refs, const queries<seq_tag> &qs, size_t rank, const papara_score_parameters &sp, kernel_isa isa )
+      : group_queue_(*gq), results_(*res), refs_(refs), qs_(qs), rank_(rank), sp_(sp), isa_(isa) {}
+
+    void operator()() {
+        ivy_mike::timer tstatus;
+        ivy_mike::timer tprint;
+
+        uint64_t ncup = 0;
+
+        std::vector<int> cstate_map( seq_model::num_cstates() );
+        for( size_t i = 0; i < cstate_map.size(); ++i ) {
+            cstate_map[i] = seq_model::c2p(i);
+        }
+
+        std::unique_ptr<query_scoring_kernel> kernels[2] = {
+            create_query_scoring_kernel( isa_, score_16bit, sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend ),
+            create_query_scoring_kernel( isa_, score_32bit, sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend )
+        };
+
+        uint64_t num_scored[2] = {0, 0};
+
+        std::vector<size_t> group;
+        std::vector<const uint8_t *> b_starts;
+        std::vector<size_t> b_lens;
+        std::vector<int> pvec;
+        std::vector<unsigned int> aux;
+        std::vector<int> out_scores;
+
+        size_t queue_size;
+        size_t init_queue_size = -1;
+
+        while( group_queue_.get_group( &group, &queue_size ) ) {
+            if( init_queue_size == size_t(-1) ) {
+                init_queue_size = queue_size + 1;
+            }
+
+            size_t max_len = 0;
+            size_t sum_len = 0;
+            for( std::vector<size_t>::iterator it = group.begin(); it != group.end(); ++it ) {
+                max_len = std::max( max_len, qs_.cseq_at(*it).size() );
+                sum_len += qs_.cseq_at(*it).size();
+            }
+
+            const size_t level = max_len <= kernels[0]->max_query_len() ? 0 : 1;
+            query_scoring_kernel &kernel = *kernels[level];
+
+            if( max_len > kernel.max_query_len() ) {
+                throw std::runtime_error( "qs_worker: query cannot be scored with any score type" );
+            }
+
+            const size_t width = kernel.width();
+            out_scores.resize( width );
+
+            for( std::vector<size_t>::const_iterator it = refs_.unique_pvecs().begin(); it != refs_.unique_pvecs().end(); ++it ) {
+                const size_t edge = *it;
+                refs_.unpack_at( edge, &pvec, &aux );
+                kernel.init_edge( pvec.data(), aux.data(), refs_.pvec_size(), cstate_map.data(), cstate_map.size() );
+
+                for( size_t chunk = 0; chunk < group.size(); chunk += width ) {
+                    const size_t num = std::min( width, group.size() - chunk );
+
+                    b_starts.clear();
+                    b_lens.clear();
+                    for( size_t i = chunk; i < chunk + num; ++i ) {
+                        b_starts.push_back( qs_.cseq_at(group[i]).data() );
+                        b_lens.push_back( qs_.cseq_at(group[i]).size() );
+                    }
+
+                    kernel.align( b_starts.data(), b_lens.data(), num, out_scores.data() );
+                    results_.offer_queries( edge, group.begin() + chunk, group.begin() + chunk + num, out_scores.begin() );
+                }
+            }
+
+            num_scored[level] += group.size() * refs_.unique_pvecs().size();
+            ncup += sum_len * refs_.pvec_size() * refs_.unique_pvecs().size();
+
+            if( rank_ == 0 && tprint.elapsed() > 10 ) {
+                float fdone = (init_queue_size - queue_size) / float(init_queue_size);
+
+                refs_.context().log() << fdone * 100 << "% done. " << ncup / (tstatus.elapsed() * 1e9) << " gncup/s" << std::endl;
+                tprint = ivy_mike::timer();
+            }
+        }
 
-#endif
         {
-            ivy_mike::lock_guard<ivy_mike::mutex> lock( *block_queue_.hack_mutex() );
-            lout << "thread " << rank_ << ": " << ncup / (tstatus.elapsed() * 1e9) << " gncup/s" << std::endl;
+            ivy_mike::lock_guard<ivy_mike::mutex> lock( *group_queue_.hack_mutex() );
+            refs_.context().log() << "thread " << rank_ << ": " << ncup / (tstatus.elapsed() * 1e9) << " gncup/s (query/edge pairs scored with 16bit: " << num_scored[0] << ", 32bit: " << num_scored[1] << ")" << std::endl;
         }
     }
 };
 
+// decide between edge-striped (one query against a block of edges) and query-striped (a group of queries against one edge)
+// scoring. Both do the same dp, so the estimated cost is the number of vectorized dp steps, including the idle lanes of
+// the last, partially filled edge block and the padding of each query group up to its longest query. In query mode the
+// per edge/group profile (column classes x lanes) is added, which matters for protein data with its many distinct states.
+// The mode can be forced by the options of the run (see run_options).
+template<typename pvec_t, typename seq_tag>
+bool use_query_striped_scoring( const references<pvec_t,seq_tag> &refs, const queries<seq_tag> &qs, size_t edge_width, size_t query_width ) {
+    const scoring_mode mode = refs.context().options().mode;
+    if( mode != scoring_mode_auto ) {
+        return mode == scoring_mode_query;
+    }
+
+    // the query-striped scoring passes over all edges once per query group, which is too expensive if the vectors are
+    // created on demand
+    if( refs.lazy() ) {
+        return false;
+    }
+
+    const size_t num_edges = refs.unique_pvecs().size();
+    const size_t ref_len = refs.pvec_size();
+
+    // the query-striped kernels know nothing about per query bounds
+    for( size_t i = 0; i < qs.size(); ++i ) {
+        if( qs.get_per_qs_bounds(i).first != size_t(-1) ) {
+            return false;
+        }
+    }
+
+    std::vector<size_t> lens;
+    uint64_t sum_len = 0;
+    for( std::vector<size_t>::const_iterator it = qs.unique_queries().begin(); it != qs.unique_queries().end(); ++it ) {
+        lens.push_back( qs.cseq_at(*it).size() );
+        sum_len += lens.back();
+    }
+    std::sort( lens.begin(), lens.end() );
+
+    uint64_t padded_len = 0;
+    for( size_t i = 0; i < lens.size(); i += query_width ) {
+        padded_len += lens[std::min( i + query_width, lens.size() ) - 1];
+    }
+
+    const uint64_t edge_blocks = (num_edges + edge_width - 1) / edge_width;
+    const double edge_cost = double(edge_blocks) * sum_len * ref_len;
+    double query_cost = double(num_edges) * padded_len * ref_len;
+
+    if( query_cost >= edge_cost ) {
+        return false;
+    }
+
+    // number of profile entries, assuming that filling one costs about as much as 1/8 of a vectorized dp step
+    uint64_t num_classes = 0;
+    std::vector<int64_t> keys( ref_len );
+    std::vector<int> pvec;
+    std::vector<unsigned int> aux;
+    for( size_t i = 0; i < num_edges; ++i ) {
+        refs.unpack_at( refs.unique_pvecs()[i], &pvec, &aux );
+        for( size_t j = 0; j < ref_len; ++j ) {
+            keys[j] = int64_t(pvec[j]) * 2 + ((aux[j] == AUX_CGAP) ? 1 : 0);
+        }
+        std::sort( keys.begin(), keys.end() );
+        num_classes += std::distance( keys.begin(), std::unique( keys.begin(), keys.end() ));
+    }
+
+    query_cost += double(num_classes) * padded_len * query_width / 8.0;
+
+    return query_cost < edge_cost;
+}
 
 template <typename pvec_t,typename seq_tag>
-void driver<pvec_t,seq_tag>::calc_scores(size_t n_threads, const my_references& refs, const my_queries& qs, scoring_results* res, const papara_score_parameters& sp) {
+void driver<pvec_t,seq_tag>::calc_scores(size_t n_threads, const my_references& refs, const my_queries& qs, scoring_results* res, const papara_score_parameters& sp, const std::vector<std::vector<size_t> > *qs_edges) {
 
     //
     // build the alignment blocks
     //
 
 
+    refs.context().log() << "queries: " << qs.size() << " (" << qs.unique_queries().size() << " unique sequences)" << std::endl;
+    refs.context().log() << "reference edges: " << refs.num_pvecs() << " (" << refs.unique_pvecs().size() << " unique ancestral state vectors)" << std::endl;
+
+    // pick the scoring kernels for the best instruction set supported by this cpu. Use the 8bit kernels only if
+    // most queries are short enough for them: the width of the reference blocks depends on both, and the 16bit
+    // kernels of the other queries would only see the (wider) 8bit blocks.
+    const kernel_isa isa = select_kernel_isa( refs.context().options().kernel.c_str() );
+    score_bits min_bits = vu_config<seq_tag>::min_score_bits;
+
+    if( min_bits == score_8bit ) {
+        const size_t max_len = create_scoring_kernel( isa, score_8bit, sp.match, sp.match_cgap, sp.gap_open, sp.gap_extend )->max_query_len();
+
+        const std::vector<size_t> &unique = qs.unique_queries();
+        size_t num_short = 0;
+        for( std::vector<size_t>::const_iterator it = unique.begin(); it != unique.end(); ++it ) {
+            num_short += qs.cseq_at(*it).size() <= max_len;
+        }
+
+        if( num_short * 2 < unique.size() ) {
+            min_bits = score_16bit;
+        }
+    }
+
+    const size_t vec_width = create_scoring_kernel( isa, min_bits, sp.match, sp.match_cgap, sp.gap_open, sp.gap_extend )->width();
+    const size_t qs_width = create_query_scoring_kernel( isa, score_16bit, sp.match, sp.match_cgap, sp.gap_open, sp.gap_extend )->width();
+
+    if( qs_edges == 0 && use_query_striped_scoring( refs, qs, vec_width, qs_width )) {
+        // few edges, many queries: align groups of queries of similar length against one edge at a time
+        std::vector<size_t> order( qs.unique_queries() );
+        std::stable_sort( order.begin(), order.end(), cseq_size_less<seq_tag>( qs ));
+
+        query_group_queue gq;
+        for( size_t i = 0; i < order.size(); i += qs_width ) {
+            gq.push_back( std::vector<size_t>( order.begin() + i, order.begin() + std::min( i + qs_width, order.size() )));
+        }
+
+        ivy_mike::timer t1;
+        ivy_mike::thread_group tg;
+        refs.context().log() << "papara_core version " << papara::get_version_string() << std::endl;
+        refs.context().log() << "start scoring, using " << n_threads <<  " threads" << std::endl;
+        refs.context().log() << "scoring kernel: " << kernel_isa_name( isa ) << ", query-striped (" << qs_width << " queries per edge, " << refs.unique_pvecs().size() << " edges)" << std::endl;
+
+        typedef qs_worker<pvec_t,seq_tag> qs_worker_t;
+
+        std::deque<scoring_results> thread_res;
+        for( size_t i = 0; i < n_threads; ++i ) {
+            thread_res.emplace_back( res->size(), scoring_results::candidates( res->max_candidates() ));
+        }
+
+        for( size_t i = 1; i < n_threads; ++i ) {
+            tg.create_thread(qs_worker_t(&gq, &thread_res[i], refs, qs, i, sp, isa));
+        }
+
+        qs_worker_t w0(&gq, &thread_res[0], refs, qs, 0, sp, isa);
+        w0();
+
+        tg.join_all();
+
+        merge_thread_results( thread_res, res );
+        copy_duplicate_results( refs, qs, res );
+
+        refs.context().log() << "scoring finished: " << t1.elapsed() << std::endl;
+        return;
+    }
+
+    // branch-and-bound pruning of the edge blocks needs a few blocks to pay off, and relies on the score of the bound
+    // vectors being an upper bound: more matching states and free gaps in cgap columns must not lower the score.
+    // It can be switched off by the options of the run.
+    const bool prune = qs_edges == 0
+            && sp.match >= 0 && sp.gap_open <= 0 && sp.gap_extend <= 0
+            && refs.unique_pvecs().size() >= 4 * vec_width
+            && refs.context().options().edge_pruning;
+
+    // split the clusters into tiles of several queries, so that there are enough work units to keep all threads busy (and
+    // to balance the load between them) even for small trees. A tile should still contain enough queries to amortize
+    // the per block setup (profile and bound alignment) of the kernels.
+    const size_t num_blocks = (refs.unique_pvecs().size() + vec_width - 1) / vec_width;
+    const size_t num_clusters = prune ? (num_blocks + vec_width - 1) / vec_width : num_blocks;
+    const size_t min_tiles = 8 * n_threads;
+    size_t qs_chunk = 0;
+
+    if( n_threads > 1 && num_clusters < min_tiles ) {
+        const size_t tiles_per_cluster = (min_tiles + num_clusters - 1) / num_clusters;
+        const size_t min_chunk = 16;
+
+        qs_chunk = std::max( min_chunk, (qs.unique_queries().size() + tiles_per_cluster - 1) / tiles_per_cluster );
+    }
+
+    // the edge-striped kernels score the queries of a work unit in lexicographic order and reuse the rows of the shared
+    // prefixes (see prefix_plan). The tiles are cut from the sorted queries, to keep similar ones together.
+    // It can be switched off by the options of the run.
+    const bool prefix_reuse = refs.context().options().prefix_reuse;
+
+    std::vector<size_t> lex_order( qs.unique_queries() );
+    std::vector<size_t> prefix_rank;
+    if( prefix_reuse ) {
+        std::sort( lex_order.begin(), lex_order.end(), cseq_lexicographic_less<seq_tag>( qs ));
+
+        prefix_rank.resize( qs.size() );
+        for( size_t i = 0; i < lex_order.size(); ++i ) {
+            prefix_rank[lex_order[i]] = i;
+        }
+    }
+
+    // if the references create their vectors on demand, a producer thread creates the ones of the blocks in queue order
+    // (see block_queue::produce)
+    const typename block_queue<seq_tag>::vec_source_t vec_source = [&refs]( const size_t *first, const size_t *last, typename packed_column<seq_tag>::cell_t *out ) {
+        refs.create_packed( first, last, out );
+    };
+
     block_queue<seq_tag> bq;
-    build_block_queue(refs, &bq);
+    if( refs.lazy() ) {
+        bq.set_vec_source( vec_source, refs.block_bytes() );
+    }
+    if( qs_edges != 0 ) {
+        build_group_block_queue(refs, *qs_edges, &bq, vec_width);
+    } else {
+        build_block_queue(refs, &bq, vec_width, prune, lex_order, qs_chunk);
+    }
 
     //
     // work
     //
     ivy_mike::timer t1;
-    ivy_mike::thread_group tg;
-	lout << "papara_core version " << papara::get_version_string() << std::endl;
-    lout << "start scoring, using " << n_threads <<  " threads" << std::endl;
+	refs.context().log() << "papara_core version " << papara::get_version_string() << std::endl;
+    refs.context().log() << "start scoring, using " << n_threads <<  " threads" << std::endl;
+    refs.context().log() << "scoring kernel: " << kernel_isa_name( isa ) << ", " << min_bits << "bit scores (" << vec_width << " edges per block)" << std::endl;
+    if( prune ) {
+        refs.context().log() << "pruning edge blocks by upper bounds (" << vec_width << " blocks per cluster)" << std::endl;
+    }
+    if( qs_edges == 0 && qs_chunk != 0 ) {
+        refs.context().log() << "work units: " << bq.size() << " tiles of " << qs_chunk << " queries" << std::endl;
+    }
+    if( qs_edges != 0 ) {
+        refs.context().log() << "prefilter: " << bq.size() << " query groups" << std::endl;
+    }
 
-    typedef worker<seq_tag> worker_t;
+    run_workers( refs.context(), n_threads, &bq, res, qs, sp, isa, min_bits, vec_width, prefix_rank, true );
+    copy_duplicate_results( refs, qs, res );
 
-    for( size_t i = 1; i < n_threads; ++i ) {
-        tg.create_thread(worker_t(&bq, res, qs, i, sp));
+    refs.context().log() << "scoring finished: " << t1.elapsed() << std::endl;
+
+    if( qs_edges == 0 ) {
+        return;
     }
 
-    worker_t w0(&bq, res, qs, 0, sp );
+    // the prefilter is a heuristic: check how often it found the same results as the full search for a sample of the queries
+    const std::vector<size_t> &unique = qs.unique_queries();
+    const size_t num_sampled = std::min( unique.size(), std::max( size_t(10), unique.size() / 100 ));
+    if( num_sampled == 0 ) {
+        return;
+    }
 
-    w0();
+    ivy_mike::timer t2;
+    std::vector<size_t> sample;
+    for( size_t i = 0; i < num_sampled; ++i ) {
+        sample.push_back( unique[(i * unique.size()) / num_sampled] );
+    }
 
-    tg.join_all();
+    block_queue<seq_tag> full_bq;
+    typename block_queue<seq_tag>::cluster_t cluster;
+    cluster.queries = sample;
+    build_blocks( refs, refs.unique_pvecs(), vec_width, &cluster.blocks );
+    if( !refs.lazy() ) {
+        full_bq.push_back( cluster );
+    } else {
+        // one cluster per block, so that the producer never needs the vectors of all edges at once
+        full_bq.set_vec_source( vec_source, refs.block_bytes() );
+
+        std::vector<typename block_queue<seq_tag>::block_t> blocks;
+        blocks.swap( cluster.blocks );
+        for( size_t i = 0; i < blocks.size(); ++i ) {
+            cluster.blocks.assign( 1, blocks[i] );
+            full_bq.push_back( cluster );
+        }
+    }
+
+    scoring_results full_res( qs.size(), scoring_results::candidates(0) );
+    // without the per-thread statistics, which would read as if they belonged to the main pass
+    run_workers( refs.context(), n_threads, &full_bq, &full_res, qs, sp, isa, min_bits, vec_width, prefix_rank, false );
 
-    lout << "scoring finished: " << t1.elapsed() << std::endl;
+    size_t num_same_score = 0;
+    size_t num_same_edge = 0;
+    for( std::vector<size_t>::iterator it = sample.begin(); it != sample.end(); ++it ) {
+        num_same_score += res->bestscore_at(*it) == full_res.bestscore_at(*it);
+        num_same_edge += res->bestedge_at(*it) == full_res.bestedge_at(*it);
+    }
 
+    refs.context().log() << "prefilter recall (" << num_sampled << " sampled queries vs. full search): best score found for "
+         << 100.0 * num_same_score / num_sampled << "%, same best edge for " << 100.0 * num_same_edge / num_sampled
+         << "% (" << t2.elapsed() << "s)" << std::endl;
 }
 
 template <typename pvec_t,typename seq_tag>
@@ -1107,18 +2437,14 @@ void driver<pvec_t,seq_tag>::do_newview(pvec_t& root_pvec, lnode* n1, lnode* n2,
 
 
 template <typename pvec_t,typename seq_tag>
-void driver<pvec_t,seq_tag>::build_block_queue(const my_references& refs, my_block_queue* bq) {
-    // creates the list of ref-block to be consumed by the worker threads.  A ref-block onsists of N ancestral state sequences, where N='width of the vector unit'.
-    // The vectorized alignment implementation will align a QS against a whole ref-block at a time, rather than a single ancestral state sequence as in the
-    // sequencial algorithm.
-
-    const static size_t VW = vu_config<seq_tag>::width;
+void driver<pvec_t,seq_tag>::build_blocks(const my_references& refs, const std::vector<size_t> &edges, size_t width, std::vector<typename my_block_queue::block_t> *blocks) {
+    // groups the edges into blocks of 'width' ancestral state vectors. The last block is padded with copies of its last edge.
+    const size_t VW = width;
 
     typedef typename block_queue<seq_tag>::block_t block_t;
 
-
-    size_t n_groups = (refs.num_pvecs() / VW);
-    if( (refs.num_pvecs() % VW) != 0 ) {
+    size_t n_groups = (edges.size() / VW);
+    if( (edges.size() % VW) != 0 ) {
         n_groups++;
     }
 
@@ -1136,16 +2462,16 @@ void driver<pvec_t,seq_tag>::build_block_queue(const my_references& refs, my_blo
 
 
         block_t block;
+        block.width = VW;
 
         for( unsigned int i = 0; i < VW; i++ ) {
 
-            size_t edge = j * VW + i;
-            if( edge < refs.num_pvecs()) {
+            if( j * VW + i < edges.size()) {
+                const size_t edge = edges[j * VW + i];
                 block.edges[i] = edge;
                 block.num_valid++;
 
-                block.seqptrs[i] = refs.pvec_at(edge).data();
-                block.auxptrs[i] = refs.aux_at(edge).data();
+                block.cellptrs[i] = refs.packed_at(edge);
 
                 //                if( !m_ref_gapp[edge].empty() ) {
                 //                    block.gapp_ptrs[i] = m_ref_gapp[edge].data();
@@ -1164,19 +2490,192 @@ void driver<pvec_t,seq_tag>::build_block_queue(const my_references& refs, my_blo
                 num_valid++;
             } else {
                 if( i < 1 ) {
-                    std::cout << "edge: " << edge << " " << refs.num_pvecs() << std::endl;
+                    std::cout << "edge: " << j * VW + i << " " << edges.size() << std::endl;
 
                     throw std::runtime_error( "bad integer mathematics" );
                 }
                 block.edges[i] = block.edges[i-1];
 
-                block.seqptrs[i] = block.seqptrs[i-1];
-                block.auxptrs[i] = block.auxptrs[i-1];
+                block.cellptrs[i] = block.cellptrs[i-1];
                 block.gapp_ptrs[i] = block.gapp_ptrs[i-1];
             }
 
         }
-        bq->push_back(block);
+        blocks->push_back(block);
+    }
+}
+
+template <typename pvec_t,typename seq_tag>
+void driver<pvec_t,seq_tag>::build_block_queue(const my_references& refs, my_block_queue* bq, size_t width, bool with_bounds, const std::vector<size_t> &qs_idx, size_t qs_chunk) {
+    // creates the list of ref-block to be consumed by the worker threads.  A ref-block onsists of N ancestral state sequences, where N='width of the vector unit'.
+    // The vectorized alignment implementation will align a QS against a whole ref-block at a time, rather than a single ancestral state sequence as in the
+    // sequencial algorithm.
+
+    if( width == 0 || width > vu_config<seq_tag>::max_width ) {
+        throw std::runtime_error( "build_block_queue: unsupported vector width" );
+    }
+
+    const size_t VW = width;
+
+    typedef typename block_queue<seq_tag>::block_t block_t;
+
+
+    std::vector<block_t> blocks;
+    build_blocks( refs, refs.unique_pvecs(), VW, &blocks );
+
+    // group the blocks into clusters of up to VW blocks, and build an upper bound vector for each block (see worker).
+    // Without bounds every block forms a cluster of its own.
+    const size_t cluster_size = with_bounds ? VW : 1;
+
+    for( size_t j = 0; j < blocks.size(); j += cluster_size ) {
+        typename block_queue<seq_tag>::cluster_t cluster;
+        cluster.blocks.assign( blocks.begin() + j, blocks.begin() + std::min( j + cluster_size, blocks.size() ));
+
+        cluster.has_bounds = with_bounds && cluster.blocks.size() > 1;
+
+        if( cluster.has_bounds ) {
+            block_t &bounds = cluster.bounds;
+            bounds.width = VW;
+            bounds.ref_len = refs.pvec_size();
+
+            for( size_t i = 0; i < VW; ++i ) {
+                if( i < cluster.blocks.size() ) {
+                    const block_t &b = cluster.blocks[i];
+                    std::vector<int> pvec;
+                    std::vector<unsigned int> aux;
+
+                    cluster.num_mixed[i] = refs.cluster_bound( b.edges, b.edges + b.num_valid, &pvec, &aux );
+
+                    bounds.cellptrs[i] = bq->store_bound( pvec, aux );
+                    bounds.edges[i] = i;
+                    bounds.num_valid++;
+                } else {
+                    cluster.num_mixed[i] = cluster.num_mixed[i-1];
+                    bounds.cellptrs[i] = bounds.cellptrs[i-1];
+                    bounds.edges[i] = bounds.edges[i-1];
+                }
+            }
+        }
+
+        // the unit of work is a tile: the blocks of the cluster against a range of the queries. The tiles of a cluster
+        // share the bound vectors (and are queued one after the other).
+        if( qs_chunk == 0 || qs_chunk >= qs_idx.size() ) {
+            bq->push_back(cluster);
+            continue;
+        }
+
+        for( size_t i = 0; i < qs_idx.size(); i += qs_chunk ) {
+            cluster.queries.assign( qs_idx.begin() + i, qs_idx.begin() + std::min( i + qs_chunk, qs_idx.size() ));
+
+            bq->push_back(cluster);
+        }
+    }
+}
+
+template <typename pvec_t,typename seq_tag>
+void driver<pvec_t,seq_tag>::build_group_block_queue(const my_references& refs, const std::vector<std::vector<size_t> > &qs_edges, my_block_queue* bq, size_t width) {
+    // the queries are grouped by their top ranked edge (neighboring edges have similar numbers, see visit_edges), and each
+    // group is aligned against the union of the edges of its queries. The union may grow to twice the number of edges of a
+    // single query (rounded up to full blocks), which costs some extra work for the queries, but lets them share the blocks.
+
+    if( width == 0 || width > vu_config<seq_tag>::max_width ) {
+        throw std::runtime_error( "build_group_block_queue: unsupported vector width" );
+    }
+
+    std::vector<std::pair<size_t,size_t> > order; // (top edge, query)
+    size_t max_edges = 0;
+    for( size_t i = 0; i < qs_edges.size(); ++i ) {
+        // queries without edges are not aligned (duplicates, see prefilter_edges)
+        if( qs_edges[i].empty() ) {
+            continue;
+        }
+
+        order.push_back( std::make_pair( qs_edges[i].front(), i ));
+        max_edges = std::max( max_edges, qs_edges[i].size() );
+    }
+    std::sort( order.begin(), order.end() );
+
+    const size_t max_union = ((std::max( 2 * max_edges, width ) + width - 1) / width) * width;
+
+    typename my_block_queue::cluster_t cluster;
+    std::vector<size_t> group_edges;
+    std::vector<size_t> merged;
+
+    for( size_t i = 0; i <= order.size(); ++i ) {
+        if( i < order.size() ) {
+            std::vector<size_t> edges( qs_edges[order[i].second] );
+            std::sort( edges.begin(), edges.end() );
+
+            merged.clear();
+            std::set_union( group_edges.begin(), group_edges.end(), edges.begin(), edges.end(), std::back_inserter( merged ));
+
+            if( cluster.queries.empty() || merged.size() <= max_union ) {
+                group_edges.swap( merged );
+                cluster.queries.push_back( order[i].second );
+                continue;
+            }
+        }
+
+        // the current group is complete
+        build_blocks( refs, group_edges, width, &cluster.blocks );
+        bq->push_back( cluster );
+
+        cluster = typename my_block_queue::cluster_t();
+        group_edges.clear();
+
+        if( i < order.size() ) {
+            --i; // start the next group with this query
+        }
+    }
+}
+
+template <typename pvec_t,typename seq_tag>
+void driver<pvec_t,seq_tag>::prefilter_edges(const my_references& refs, const my_queries& qs, size_t num_edges, std::vector<std::vector<size_t> > *qs_edges) {
+    typedef model<seq_tag> seq_model;
+
+    ivy_mike::timer t1;
+
+    // dna: 12-mers in windows of 8, protein: 5-mers in windows of 4
+    const bool is_dna = seq_model::num_cstates() <= 16;
+    kmer_prefilter pf( is_dna ? 12 : 5, is_dna ? 8 : 4 );
+
+    // only the representatives of identical edges are indexed (see references::rep_at)
+    const std::vector<size_t> &edges = refs.unique_pvecs();
+    std::vector<int> pvec;
+    std::vector<unsigned int> aux;
+    for( size_t i = 0; i < edges.size(); ++i ) {
+        refs.unpack_at( edges[i], &pvec, &aux );
+        pf.add_edge( pvec, aux );
+    }
+    pf.build_index();
+
+    // the duplicate queries get no edges, they are not aligned at all (see queries::rep_at)
+    qs_edges->assign( qs.size(), std::vector<size_t>() );
+
+    size_t num_fallback = 0;
+    std::vector<int> qs_pvec;
+
+    for( std::vector<size_t>::const_iterator it = qs.unique_queries().begin(); it != qs.unique_queries().end(); ++it ) {
+        const size_t i = *it;
+        qs_pvec.assign( qs.pvec_at(i).begin(), qs.pvec_at(i).end() );
+
+        pf.top_edges( qs_pvec, num_edges, &(*qs_edges)[i] );
+
+        for( std::vector<size_t>::iterator eit = (*qs_edges)[i].begin(); eit != (*qs_edges)[i].end(); ++eit ) {
+            *eit = edges[*eit];
+        }
+
+        // nothing to go by: use the full search for this query
+        if( (*qs_edges)[i].empty() ) {
+            ++num_fallback;
+            (*qs_edges)[i] = edges;
+        }
+    }
+
+    refs.context().log() << "prefilter: " << pf.index_size() << " minimizers for " << pf.num_edges() << " edges, top " << num_edges << " edges per query (" << t1.elapsed() << "s)" << std::endl;
+
+    if( num_fallback != 0 ) {
+        refs.context().log() << "prefilter: " << num_fallback << " queries share no minimizer with the references and are aligned against all edges" << std::endl;
     }
 }
 
@@ -1200,110 +2699,302 @@ void driver<pvec_t,seq_tag>::print_best_scores(std::ostream& os, const my_querie
     }
 }
 
-template <typename pvec_t,typename seq_tag>
-std::vector< std::vector< uint8_t > > driver<pvec_t,seq_tag>::generate_traces(std::ostream& os_quality, std::ostream& os_cands, const my_queries& qs, const my_references& refs, const scoring_results& res, const papara_score_parameters& sp) {
+// worker of the traceback phase: recomputes the best alignment (and the candidate alignments, if requested) of the queries,
+// which are handed out in chunks through an atomic cursor. Every thread has its own traceback arrays, and the results are
+// stored per query, so that the output does not depend on the number of threads.
+// The queries are handed out in the order of their best edge (see generate_traces), so that the banded tracebacks of
+// queries sharing the best edge can be run side by side (align_freeshift_pvec_banded_batch).
+// orders queries by best edge, then by the column where the best alignment ends
+struct best_edge_order {
+    best_edge_order( const scoring_results &res ) : res_(res) {}
+
+    bool operator()( size_t a, size_t b ) const {
+        if( res_.bestedge_at(a) != res_.bestedge_at(b) ) {
+            return res_.bestedge_at(a) < res_.bestedge_at(b);
+        } else if( res_.bestend_at(a) != res_.bestend_at(b) ) {
+            return res_.bestend_at(a) < res_.bestend_at(b);
+        } else {
+            return a < b;
+        }
+    }
 
+    const scoring_results &res_;
+};
 
+template<typename pvec_t, typename seq_tag>
+class trace_worker {
     typedef typename queries<seq_tag>::pars_state_t pars_state_t;
     typedef model<seq_tag> seq_model;
+    typedef typename std::vector<pars_state_t>::const_iterator qs_iter;
 
+    const static size_t batch_width = 4;
 
-    lout << "generating best scoring alignments\n";
-    ivy_mike::timer t1;
-
+public:
+    trace_worker( std::atomic<size_t> *next, std::atomic<size_t> *num_banded, std::atomic<size_t> *num_batched, const std::vector<size_t> &order, const queries<seq_tag> &qs, const references<pvec_t,seq_tag> &refs, const scoring_results &res, const papara_score_parameters &sp, size_t max_tb_cells, bool use_band, bool vectorized, bool with_cands, std::vector<std::vector<uint8_t> > *traces, std::vector<int> *scores, std::vector<std::vector<std::string> > *cand_lines )
+      : next_(*next), num_banded_(*num_banded), num_batched_(*num_batched), order_(order), qs_(qs), refs_(refs), res_(res), sp_(sp), max_tb_cells_(max_tb_cells), use_band_(use_band), vectorized_(vectorized), with_cands_(with_cands), traces_(*traces), scores_(*scores), cand_lines_(*cand_lines), ref_edge_(-1) {}
 
+    void operator()() {
+        const size_t chunk = 16;
 
-    std::vector<pars_state_t> out_qs_ps;
-    align_arrays_traceback<int> arrays;
+        arrays_.max_tb_cells = max_tb_cells_;
+        arrays_.vectorized = vectorized_;
 
-    std::vector<std::vector<uint8_t> > qs_traces( qs.size() );
+        while( true ) {
+            const size_t first = next_.fetch_add( chunk, std::memory_order_relaxed );
+            if( first >= order_.size() ) {
+                break;
+            }
 
-    std::vector<uint8_t> cand_trace;
+            const size_t last = std::min( first + chunk, order_.size() );
 
-    std::deque<size_t> bounded_bad_scores;
-    
-    for( size_t i = 0; i < qs.size(); i++ ) {
-        size_t best_edge = res.bestedge_at(i);
+            for( size_t j = first; j < last; ) {
+                size_t num = 0;
+                while( vectorized_ && num < batch_width && j + num < last && use_band( order_[j + num] )
+                       && res_.bestedge_at( order_[j + num] ) == res_.bestedge_at( order_[j] ))
+                {
+                    ++num;
+                }
 
-        assert( size_t(best_edge) < refs.num_pvecs() );
+                if( num > 1 ) {
+                    trace_batch( &order_[j], num );
+                    j += num;
+                } else {
+                    trace( order_[j] );
+                    ++j;
+                }
+            }
+        }
+    }
 
-        int score = -1;
+private:
+    // the best score and its end column are known from the scoring kernels (unless the query has bounds, for which the
+    // scores are not comparable), which restricts the dp to a band
+    bool use_band( size_t i ) const {
+        return use_band_ && res_.bestend_at(i) != size_t(-1) && qs_.get_per_qs_bounds(i).first == size_t(-1);
+    }
 
+    // unpacks the vector of an edge into ref_pvec_/ref_aux_ (the queries come grouped by best edge, so this is mostly a no-op)
+    void load_ref( size_t edge ) {
+        if( ref_edge_ != edge ) {
+            refs_.unpack_at( edge, &ref_pvec_, &ref_aux_ );
+            ref_edge_ = edge;
+        }
+    }
 
+    void trace( size_t i ) {
+        const size_t best_edge = res_.bestedge_at(i);
+        assert( best_edge < refs_.num_pvecs() );
 
-        const std::vector<pars_state_t> &qp = qs.pvec_at(i);
+        const std::vector<pars_state_t> &qp = qs_.pvec_at(i);
+        load_ref( best_edge );
 
-        score = align_freeshift_pvec<int>(
-                    refs.pvec_at(best_edge).begin(), refs.pvec_at(best_edge).end(),
-                    refs.aux_at(best_edge).begin(),
+        const bool banded = use_band( i )
+                && align_freeshift_pvec_banded<int>(
+                    ref_pvec_.begin(), ref_pvec_.end(),
+                    ref_aux_.begin(),
                     qp.begin(), qp.end(),
-                    sp.match, sp.match_cgap, sp.gap_open, sp.gap_extend, qs_traces.at(i), arrays
+                    sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend, res_.bestscore_at(i), res_.bestend_at(i), traces_[i], arrays_
                 );
 
-
-//         std::cout << "scores: " << score << " " << res.bestscore_at(i) << "\n";
-        
-        std::pair<size_t,size_t> bounds = qs.get_per_qs_bounds( i );
-        
-        
-        if( bounds.first == size_t(-1) ) {
-            if( score != res.bestscore_at(i) ) {
-                std::cout << "meeeeeeep! score: " << res.bestscore_at(i) << " " << score << "\n";
-                throw std::runtime_error( "alignment scores differ between the vectorized and sequential alignment kernels.");
-            }
+        if( banded ) {
+            scores_[i] = res_.bestscore_at(i);
+            num_banded_.fetch_add( 1, std::memory_order_relaxed );
         } else {
-            if( score != res.bestscore_at(i) ) {
-                bounded_bad_scores.push_back(i);
+            scores_[i] = align_freeshift_pvec<int>(
+                        ref_pvec_.begin(), ref_pvec_.end(),
+                        ref_aux_.begin(),
+                        qp.begin(), qp.end(),
+                        sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend, traces_[i], arrays_
+                    );
+        }
+
+        trace_candidates( i );
+    }
+
+    // banded traceback of num (<= batch_width) queries with the same best edge. The ones that do not work out this way
+    // get the single query treatment.
+    void trace_batch( const size_t *idx, size_t num ) {
+        const size_t best_edge = res_.bestedge_at(idx[0]);
+
+        qs_iter bstarts[batch_width];
+        size_t bsizes[batch_width];
+        int known_scores[batch_width];
+        size_t end_cols[batch_width];
+        std::vector<uint8_t> *tb_outs[batch_width];
+        bool ok[batch_width];
+
+        for( size_t j = 0; j < num; ++j ) {
+            const size_t i = idx[j];
+            bstarts[j] = qs_.pvec_at(i).begin();
+            bsizes[j] = qs_.pvec_at(i).size();
+            known_scores[j] = res_.bestscore_at(i);
+            end_cols[j] = res_.bestend_at(i);
+            tb_outs[j] = &traces_[i];
+        }
+
+        load_ref( best_edge );
+        align_freeshift_pvec_banded_batch( ref_pvec_.begin(), ref_pvec_.end(), ref_aux_.begin(),
+                                           bstarts, bsizes, num, sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend,
+                                           known_scores, end_cols, tb_outs, ok, arrays_ );
+
+        for( size_t j = 0; j < num; ++j ) {
+            const size_t i = idx[j];
+
+            if( ok[j] ) {
+                scores_[i] = res_.bestscore_at(i);
+                num_banded_.fetch_add( 1, std::memory_order_relaxed );
+                num_batched_.fetch_add( 1, std::memory_order_relaxed );
+                trace_candidates( i );
+            } else {
+                trace( i );
             }
         }
+    }
 
+    void trace_candidates( size_t i ) {
+        if( !with_cands_ ) {
+            return;
+        }
 
+        const std::vector<pars_state_t> &qp = qs_.pvec_at(i);
+        const scoring_results::candidates &cands = res_.candidates_at(i);
+        cand_lines_[i].clear();
 
+        for( size_t j = 0; j < cands.size(); ++j ) {
+            const scoring_results::candidate &cand = cands[j];
 
+            cand_trace_.clear();
+            refs_.unpack_at( cand.ref(), &cand_pvec_, &cand_aux_ );
 
-        if( os_cands.good() ) {
-            const scoring_results::candidates &cands = res.candidates_at(i);
+            align_freeshift_pvec<int>(
+                        cand_pvec_.begin(), cand_pvec_.end(),
+                        cand_aux_.begin(),
+                        qp.begin(), qp.end(),
+                        sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend, cand_trace_, arrays_
+                    );
+            out_qs_ps_.clear();
 
-            std::vector<std::vector<uint8_t> > unique_traces;
+            gapstream_to_alignment_no_ref_gaps(cand_trace_, qp, &out_qs_ps_, seq_model::gap_pstate() );
 
-            for( size_t j = 0; j < cands.size(); ++j ) {
-                const scoring_results::candidate &cand = cands[j];
+            // the query index is prepended in generate_traces, where the lines are copied to the duplicates of the query
+            std::ostringstream os_cands;
+            os_cands << cand.ref() << " " << cand.score() << "\t";
+            std::transform( out_qs_ps_.begin(), out_qs_ps_.end(), std::ostream_iterator<char>(os_cands), seq_model::p2s );
+            cand_lines_[i].push_back( os_cands.str() );
+        }
+    }
 
-                cand_trace.clear();
+    std::atomic<size_t> &next_;
+    std::atomic<size_t> &num_banded_;
+    std::atomic<size_t> &num_batched_;
+    const std::vector<size_t> &order_;
+    const queries<seq_tag> &qs_;
+    const references<pvec_t,seq_tag> &refs_;
+    const scoring_results &res_;
+    const papara_score_parameters sp_;
+    const size_t max_tb_cells_;
+    const bool use_band_;
+    const bool vectorized_;
+    const bool with_cands_;
+
+    std::vector<std::vector<uint8_t> > &traces_;
+    std::vector<int> &scores_;
+    std::vector<std::vector<std::string> > &cand_lines_;
+
+    align_arrays_traceback<int> arrays_;
+    std::vector<uint8_t> cand_trace_;
+    std::vector<pars_state_t> out_qs_ps_;
+
+    size_t ref_edge_;
+    std::vector<int> ref_pvec_;
+    std::vector<unsigned int> ref_aux_;
+    std::vector<int> cand_pvec_;
+    std::vector<unsigned int> cand_aux_;
+};
 
-                score = align_freeshift_pvec<int>(
-                            refs.pvec_at(cand.ref()).begin(), refs.pvec_at(cand.ref()).end(),
-                            refs.aux_at(cand.ref()).begin(),
-                            qp.begin(), qp.end(),
-                            sp.match, sp.match_cgap, sp.gap_open, sp.gap_extend, cand_trace, arrays
-                        );
-                out_qs_ps.clear();
+template <typename pvec_t,typename seq_tag>
+std::vector< std::vector< uint8_t > > driver<pvec_t,seq_tag>::generate_traces(std::ostream& os_quality, std::ostream& os_cands, const my_queries& qs, const my_references& refs, const scoring_results& res, const papara_score_parameters& sp, size_t n_threads) {
 
-                std::vector<std::vector<uint8_t> >::iterator it;// = unique_traces.end(); //
+    refs.context().log() << "generating best scoring alignments\n";
+    ivy_mike::timer t1;
 
-                if( !true ) {
-                    it = std::lower_bound(unique_traces.begin(), unique_traces.end(), cand_trace );
-                } else {
-                    it = unique_traces.end();
-                }
+    std::vector<std::vector<uint8_t> > qs_traces( qs.size() );
+    std::vector<int> scores( qs.size() );
 
-                if( it == unique_traces.end() || *it != cand_trace ) {
+    const bool with_cands = os_cands.good();
+    std::vector<std::vector<std::string> > cand_lines( with_cands ? qs.size() : 0 );
 
-                    gapstream_to_alignment_no_ref_gaps(cand_trace, qp, &out_qs_ps, seq_model::gap_pstate() );
+    // alignments with more cells than this use the checkpointed traceback (see align_freeshift_pvec), which needs much
+    // less memory per thread for long references and queries, but repeats the dp. The banded and vectorized traceback
+    // can be switched off (see run_options).
+    const run_options &opts = refs.context().options();
+    const size_t max_tb_cells = opts.traceback_max_cells;
+    const bool use_band = opts.banded_traceback;
+    const bool vectorized = opts.vector_traceback;
 
-                    unique_traces.insert(it, cand_trace);
-                    os_cands << i << " " << cand.ref() << " " << cand.score() << "\t";
+    {
+        typedef trace_worker<pvec_t,seq_tag> trace_worker_t;
 
-                    //os << std::setw(pad) << std::left << qs.name_at(i);
-                    std::transform( out_qs_ps.begin(), out_qs_ps.end(), std::ostream_iterator<char>(os_cands), seq_model::p2s );
-                    os_cands << std::endl;
-                }
+        std::atomic<size_t> next(0);
+        std::atomic<size_t> num_banded(0);
+        std::atomic<size_t> num_batched(0);
 
-            }
+        // hand out the queries grouped by best edge (and by end column within an edge, to keep the batched bands narrow).
+        // Only the representatives of identical queries are traced, the others get a copy of the trace.
+        std::vector<size_t> order( qs.unique_queries() );
+        std::sort( order.begin(), order.end(), best_edge_order( res ));
+        ivy_mike::thread_group tg;
+
+        for( size_t i = 1; i < n_threads; ++i ) {
+            tg.create_thread(trace_worker_t(&next, &num_banded, &num_batched, order, qs, refs, res, sp, max_tb_cells, use_band, vectorized, with_cands, &qs_traces, &scores, &cand_lines));
         }
 
+        trace_worker_t w0(&next, &num_banded, &num_batched, order, qs, refs, res, sp, max_tb_cells, use_band, vectorized, with_cands, &qs_traces, &scores, &cand_lines);
+        w0();
+
+        tg.join_all();
+
+        refs.context().log() << "banded traceback for " << num_banded.load() << " of " << order.size() << " queries (" << num_batched.load() << " batched by best edge)" << std::endl;
+
+        for( size_t i = 0; i < qs.size(); ++i ) {
+            if( qs.rep_at(i) != i ) {
+                qs_traces[i] = qs_traces[qs.rep_at(i)];
+                scores[i] = scores[qs.rep_at(i)];
+            }
+        }
     }
+
+    std::deque<size_t> bounded_bad_scores;
     
+    for( size_t i = 0; i < qs.size(); i++ ) {
+        const int score = scores[i];
+
+//         std::cout << "scores: " << score << " " << res.bestscore_at(i) << "\n";
+        
+        std::pair<size_t,size_t> bounds = qs.get_per_qs_bounds( i );
+        
+        
+        if( bounds.first == size_t(-1) ) {
+            if( score != res.bestscore_at(i) ) {
+                std::cout << "meeeeeeep! score: " << res.bestscore_at(i) << " " << score << "\n";
+                throw std::runtime_error( "alignment scores differ between the vectorized and sequential alignment kernels.");
+            }
+        } else {
+            if( score != res.bestscore_at(i) ) {
+                bounded_bad_scores.push_back(i);
+            }
+        }
+
+        if( with_cands ) {
+            const std::vector<std::string> &lines = cand_lines[qs.rep_at(i)];
+            for( std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); ++it ) {
+                os_cands << i << " " << *it << "\n";
+            }
+        }
+    }
+
+    refs.context().log() << "traceback finished: " << t1.elapsed() << std::endl;
+
     if( !bounded_bad_scores.empty() ) {
         std::cout << "There were internal problems handling per-gene QS. This is most likely due to overhangs into another partition. The overhangs will be chopped off, but the alignment may be wrong.\n";
     
@@ -1458,12 +3149,12 @@ void driver<pvec_t,seq_tag>::align_best_scores(std::ostream& os, std::ostream& o
 
     }
 
-    lout << "mean quality: " << mean_quality / n_quality << "\n";
+    refs.context().log() << "mean quality: " << mean_quality / n_quality << "\n";
 
 }
 
 template <typename pvec_t,typename seq_tag>
-void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp ) {
+void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp, size_t n_threads ) {
     typedef typename queries<seq_tag>::pars_state_t pars_state_t;
     typedef model<seq_tag> seq_model;
 
@@ -1488,7 +3179,7 @@ void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const m
     
     
     // create the best alignment traces per qs
-    std::vector<std::vector<uint8_t> > qs_traces = generate_traces(os_quality, os_cands, qs, refs, res, sp );
+    std::vector<std::vector<uint8_t> > qs_traces = generate_traces(os_quality, os_cands, qs, refs, res, sp, n_threads );
 
 
     // collect ref gaps introduiced by qs
@@ -34,6 +34,11 @@
 #include <algorithm>
 #include <numeric>
 #include <memory>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 #include <boost/io/ios_state.hpp>
 #include <boost/iostreams/tee.hpp>
@@ -47,6 +52,7 @@
 #include "pvec.h"
 // #include "align_utils.h"
 #include "blast_partassign.h"
+#include "scoring_kernel.h"
 
 
 
@@ -78,21 +84,82 @@ public:
     virtual void post( char overflow, char *start, char *end ) = 0;
 };
 
-// RAII guard for adding/removing a 'tee stream' to the papara log
+class log_stream_buffer;
+
+// edge-striped (one query against a block of edges) or query-striped (a group of queries against one edge) scoring
+enum scoring_mode {
+    scoring_mode_auto, // by estimated cost (see use_query_striped_scoring)
+    scoring_mode_edge,
+    scoring_mode_query
+};
+
+// how the scoring and traceback of a run are done. None of these change the results, the defaults are the fastest
+// settings (the others are mostly useful for benchmarking/debugging). papara2_main.cpp sets them from the command line.
+struct run_options {
+    run_options();
+
+    std::string kernel;         // scoring kernel (see select_kernel_isa), empty: the best one supported by the cpu
+    scoring_mode mode;
+    bool edge_pruning;          // skip edge blocks by upper bounds (see driver::calc_scores)
+    bool prefix_reuse;          // reuse the dp rows of shared query prefixes (see prefix_plan)
+    size_t traceback_max_cells; // larger alignments use the checkpointed traceback (see align_freeshift_pvec)
+    bool banded_traceback;      // band the traceback by the known best score (see trace_worker)
+    bool vector_traceback;      // vectorized traceback dp (see align_freeshift_pvec_fill_strips)
+};
+
+// the state of a single papara run, which is passed down to the references, the driver and its workers instead of
+// living in globals: the log (every run writes to the log of its own context, so several runs can be hosted
+// concurrently in one process without mixing their output) and the options of the run.
+class run_context {
+public:
+    run_context();
+    ~run_context();
+
+    // writing is not synchronized: threads of the same run have to serialize their output (see block_queue::hack_mutex)
+    std::ostream &log() {
+        return log_;
+    }
+
+    // not synchronized: set them before the run starts
+    run_options &options() {
+        return options_;
+    }
+
+    const run_options &options() const {
+        return options_;
+    }
+
+private:
+    friend class add_log_tee;
+    friend class add_log_sink;
+
+    // copy ctor and assignment not implemented
+    run_context( const run_context & );
+    run_context &operator=( const run_context & );
+
+    std::unique_ptr<log_stream_buffer> buf_;
+    ivy_mike::mutex buf_mutex_;
+    std::ostream log_;
+    run_options options_;
+};
+
+// RAII guard for adding/removing a 'tee stream' to the log of a run
 class add_log_tee {
 public:
-    add_log_tee( std::ostream &os );
+    add_log_tee( run_context &ctx, std::ostream &os );
     ~add_log_tee();
 private:
+    run_context &ctx_;
     std::ostream &os_;
 };
 
-// RAII guard for adding/removing a 'sink' to the papara log
+// RAII guard for adding/removing a 'sink' to the log of a run
 class add_log_sink {
 public:
-    add_log_sink( log_sink *s );
+    add_log_sink( run_context &ctx, log_sink *s );
     ~add_log_sink();
 private:
+    run_context &ctx_;
     log_sink *s_;
 };
 
@@ -102,10 +169,15 @@ class vu_config {
 };
 
 
+// score types of the vectorized scoring kernels. The reference parsimony states are stored in the profile using the score type,
+// so only DNA can use the 8bit and 16bit kernels (see scoring_kernel.h). The actual block width (i.e., the number of
+// reference edges in a block_queue::block_t) depends on the instruction set and the narrowest score type used at runtime,
+// max_width is the widest possible.
 template<>
 class vu_config<tag_dna> {
 public:
-    const static size_t width = 8;
+    const static size_t max_width = 64;
+    const static score_bits min_score_bits = score_8bit;
     typedef short scalar;
     const static scalar full_mask = scalar(-1);
 };
@@ -113,11 +185,40 @@ public:
 template<>
 class vu_config<tag_aa> {
 public:
-    const static size_t width = 4;
+    const static size_t max_width = 16;
+    const static score_bits min_score_bits = score_32bit;
     typedef int scalar;
     const static scalar full_mask = scalar(-1);
 };
 
+// one column of an ancestral state vector in the compact storage of the references (see references::packed_at): the
+// parsimony state and the aux flags (see parsimony.h) packed into the parsimony state type of the model, with the aux
+// flags in the upper two bits. For DNA this is one byte per column instead of an int plus an unsigned int.
+template<typename seq_tag>
+class packed_column {
+public:
+    typedef typename model<seq_tag>::pars_state_t cell_t;
+
+    const static int aux_shift = sizeof(cell_t) * 8 - 2;
+
+    static cell_t pack( int state, unsigned int aux ) {
+        if( state < 0 || uint64_t(state) >= (uint64_t(1) << aux_shift) || aux > 3 ) {
+            throw std::runtime_error( "packed_column: parsimony state or aux flags out of range" );
+        }
+
+        return cell_t( cell_t(state) | cell_t(aux << aux_shift) );
+    }
+
+    static void unpack( const cell_t *cells, size_t n, int *pvec, unsigned int *aux ) {
+        const cell_t state_mask = cell_t((cell_t(1) << aux_shift) - 1);
+
+        for( size_t i = 0; i < n; ++i ) {
+            pvec[i] = int(cells[i] & state_mask);
+            aux[i] = (unsigned int)(cells[i] >> aux_shift);
+        }
+    }
+};
+
 struct papara_score_parameters {
     
     static papara_score_parameters default_scores() {
@@ -228,10 +329,6 @@ namespace {
 
 }
 
-//extern log_stream lout;
-
-extern std::ostream lout;
-
 class ostream_test {
     std::ostream &m_os;
 
@@ -244,9 +341,6 @@ public:
 
 
 
-extern bool g_dump_aux;
-
-
 
 template<class pvec_t,typename seq_tag>
 class my_adata_gen : public ivy_mike::tree_parser_ms::adata {
@@ -273,10 +367,10 @@ public:
     virtual void visit() {
 //         std::cout << "tr: " << m_ct << "\n";
     }
-    void init_pvec(const std::vector< uint8_t >& seq) {
+    void init_pvec(const std::vector< uint8_t >& seq, probgap_model *pgap_model ) {
 
 
-        m_pvec.init2( seq, model<seq_tag>() );
+        m_pvec.init2( seq, model<seq_tag>(), pgap_model );
 //         std::cout << "init_pvec: " << m_pvec.size() << "\n";
 //                 m_pvec.reserve(seq.size());
 //         for( std::vector< uint8_t >::const_iterator it = seq.begin(); it != seq.end(); ++it ) {
@@ -383,6 +477,18 @@ public:
         }
         
         per_qs_bounds_ = bounds;
+        find_duplicates();
+    }
+
+    // queries with the same sequence (and bounds) get the same scores and alignments, so only the first one of them
+    // (its representative) is scored and traced, and the results are copied to the others.
+    size_t rep_at( size_t i ) const {
+        return m_qs_rep.at(i);
+    }
+
+    // the representatives of all queries, in increasing order
+    const std::vector<size_t> &unique_queries() const {
+        return m_qs_unique;
     }
     
     std::pair<size_t,size_t> get_per_qs_bounds( size_t i ) const {
@@ -413,6 +519,8 @@ public:
 private:
     // WARNING: unsafe move semantics on qs
     void add( const std::string &name, std::vector<uint8_t> &qs ) ;
+
+    void find_duplicates() ;
     
     std::vector <std::string> m_qs_names;
     std::vector <std::vector<uint8_t> > m_qs_seqs;
@@ -422,6 +530,9 @@ private:
     std::vector<std::vector <pars_state_t> > m_qs_pvecs;
 
     std::vector<std::pair<size_t,size_t> > per_qs_bounds_;
+
+    std::vector<size_t> m_qs_rep;
+    std::vector<size_t> m_qs_unique;
 };
 
 
@@ -431,17 +542,25 @@ public:
 
     typedef model<seq_tag> seq_model;
     typedef my_adata_gen<pvec_t,seq_tag> my_adata;
+    typedef typename packed_column<seq_tag>::cell_t packed_t;
 
 
 
-    references( const char* opt_tree_name, const char *opt_alignment_name, queries<seq_tag> *qs )
+    references( run_context &ctx, const char* opt_tree_name, const char *opt_alignment_name, queries<seq_tag> *qs )
       ;
 
+    run_context &context() const {
+        return ctx_;
+    }
+
     void remove_full_gaps() {
         
     }
     
-    void build_ref_vecs() ;
+    // creates the ancestral state vectors of all edges (using n_threads threads). If they need more than max_bytes
+    // (0 = no limit) of packed storage, they are instead created on demand (see create_packed and unpack_at): half of
+    // max_bytes is used for a cache of the vectors, the other half for the blocks in flight during scoring (see block_bytes).
+    void build_ref_vecs( size_t max_bytes = 0, size_t n_threads = 1 ) ;
 
     const size_t find_name( const std::string &name ) const {
         // FIXME: linear search
@@ -466,23 +585,69 @@ public:
         return m_ref_seqs.size();
     }
 
-    const std::vector<int> &pvec_at( size_t i ) const {
-        return m_ref_pvecs.at(i);
+    // the ancestral state vectors are stored packed (see packed_column), pvec_size() columns per edge. Returns 0 if
+    // the vectors are created on demand, they are only available through unpack_at then.
+    const packed_t *packed_at( size_t i ) const {
+        if( m_lazy ) {
+            return 0;
+        }
+
+        return m_ref_packed.data() + m_ref_slot.at(i) * m_ref_len;
+    }
+
+    // unpacks the ancestral state vector and aux flags of edge i
+    void unpack_at( size_t i, std::vector<int> *pvec, std::vector<unsigned int> *aux ) const {
+        pvec->resize( m_ref_len );
+        aux->resize( m_ref_len );
+        unpack_at( i, pvec->data(), aux->data() );
+    }
+
+    // the same into buffers of pvec_size() elements. Can be called concurrently, also if the vectors are created on
+    // demand (the newviews on the tree are serialized).
+    void unpack_at( size_t i, int *pvec, unsigned int *aux ) const ;
+
+    // creates the packed vectors of the edges [first, last) (pvec_size() cells each, one after the other in out), with
+    // one incremental newview per edge. Meant for the producer of the lazy mode (see block_queue::produce), which asks for
+    // the edges of consecutive blocks, i.e., in depth-first order (see visit_edges): each newview then only has to
+    // update the short path between two neighboring edges. Bypasses the cache of unpack_at.
+    void create_packed( const size_t *first, const size_t *last, packed_t *out ) const ;
+
+    bool lazy() const {
+        return m_lazy;
+    }
+
+    // lazy mode: the packed vectors the blocks in flight may use during scoring (see block_queue::set_vec_source)
+    size_t block_bytes() const {
+        return m_block_bytes;
+    }
+
+    // edges with identical ancestral state vectors (and cgap flags) get the same scores, so only the first one of them
+    // (its representative) is scored. Only the representatives keep their vectors, packed_at/unpack_at of the other
+    // edges return those of their representative.
+    size_t rep_at( size_t i ) const {
+        return m_ref_rep.at(i);
     }
 
-    const std::vector<unsigned int> &aux_at( size_t i ) const {
-        return m_ref_aux.at(i);
+    // the representatives of all edges, in increasing order
+    const std::vector<size_t> &unique_pvecs() const {
+        return m_ref_unique;
     }
 
+    // upper bound vector of the edges listed in [first, last): the union of their parsimony states and the cgap flag of any
+    // of them. As the edges are numbered in depth-first order (see visit_edges), consecutive edges (or representatives,
+    // see rep_at) are a cluster of neighboring edges in the tree, whose ancestral states mostly agree. Returns the number
+    // of columns where the cgap flags disagree.
+    size_t cluster_bound( const size_t *first, const size_t *last, std::vector<int> *pvec, std::vector<unsigned int> *aux ) const ;
+
     const std::vector<int> &ng_map_at( size_t i );
     
     size_t num_pvecs() const {
-        return m_ref_pvecs.size();
+        return m_ref_slot.size();
     }
 
     size_t pvec_size() const {
-        assert( !m_ref_pvecs.empty());
-        return m_ref_pvecs.front().size();
+        assert( !m_ref_slot.empty());
+        return m_ref_len;
     }
 
     void write_pvecs( const char * name ) ;
@@ -504,6 +669,13 @@ public:
         return tree_;
     }
 private:
+    void find_duplicates() ;
+
+    void newview_at( size_t i, std::vector<int> *pvec, std::vector<unsigned int> *aux, std::vector<double> *gapp ) const ;
+
+    static void root_to_vecs( pvec_t &root_pvec, std::vector<int> *pvec, std::vector<unsigned int> *aux, std::vector<double> *gapp ) ;
+
+    run_context &ctx_;
     std::vector <std::string > m_ref_names;
     std::vector <std::vector<uint8_t> > m_ref_seqs;
     std::unique_ptr<ivy_mike::tree_parser_ms::ln_pool> m_ln_pool;
@@ -511,19 +683,34 @@ private:
     std::shared_ptr<im_tree_parser::lnode> tree_;
     
     
-    std::vector<std::vector <int> > m_ref_pvecs;
-    std::vector<std::vector <unsigned int> > m_ref_aux;
-    std::vector<std::vector <double> > m_ref_gapp;
+    // the vectors of the representatives one after the other, and the index of the representative's vector per edge.
+    // In lazy mode these are the slots of the cache (size_t(-1) for edges not in it), ordered by their last use in
+    // m_slot_lru (least recently used first, m_slot_pos points to the entry of each slot).
+    mutable std::vector<packed_t> m_ref_packed;
+    mutable std::vector<size_t> m_ref_slot;
+    size_t m_ref_len;
+    bool m_lazy;
+    size_t m_block_bytes;
+    mutable std::vector<size_t> m_slot_edge;
+    mutable std::list<size_t> m_slot_lru;
+    mutable std::vector<std::list<size_t>::iterator> m_slot_pos;
+    mutable ivy_mike::mutex m_cache_mtx;
+    mutable ivy_mike::mutex m_tree_mtx;
     std::vector<std::vector <int> > ref_ng_map_;
-    probgap_model pm_;
-    stupid_ptr_guard<probgap_model> spg_;
+    std::vector<size_t> m_ref_rep;
+    std::vector<size_t> m_ref_unique;
+    probgap_model pm_; // the gap model of this run, referenced by the pvec_pgap vectors of the tree
 
 };
 
 
 template<typename seq_tag>
 class block_queue {
-    const static size_t VW = vu_config<seq_tag>::width;
+    const static size_t VW = vu_config<seq_tag>::max_width;
+
+    typedef typename packed_column<seq_tag>::cell_t cell_t;
+
+    class packed_cells;
 
 public:
     struct block_t {
@@ -531,17 +718,38 @@ public:
             memset( this, 0, sizeof( block_t )); // FIXME: hmm, this is still legal?
         }
 
-        // WARNING: these are pointers into m_ref_pvecs and m_ref_aux
-        // make sure they stay valid!
-        const int *seqptrs[VW];
-        const unsigned int *auxptrs[VW];
+        // WARNING: these are pointers into the packed vectors of the references (or the bound vectors of the queue)
+        // make sure they stay valid! The worker unpacks them for the kernels. If the references create the vectors on
+        // demand, they are 0 until the producer has created the vectors of the cluster (see produce).
+        const typename packed_column<seq_tag>::cell_t *cellptrs[VW];
         const double *gapp_ptrs[VW];
         size_t ref_len;
         size_t edges[VW];
         int num_valid;
+        size_t width; // number of used entries in the arrays above (i.e., the vector width of the scoring kernel)
     };
 
 
+    // a cluster of consecutive blocks. If has_bounds is set, lane i of 'bounds' holds the upper bound vector of blocks[i]
+    // (see references::cluster_bound), so that the scores of a query against all blocks of the cluster can be bounded
+    // from above with a single vectorized alignment. num_mixed[i] is the number of columns in which the cgap flags of the
+    // edges in blocks[i] differ, which adds to the bound (see worker).
+    // If queries is not empty, only these queries are aligned against the blocks of the cluster (see driver::prefilter_edges).
+    struct cluster_t {
+        cluster_t() : has_bounds(false) {
+            std::fill( num_mixed, num_mixed + VW, 0 );
+        }
+
+        std::vector<block_t> blocks;
+        std::vector<size_t> queries;
+        bool has_bounds;
+        block_t bounds;
+        size_t num_mixed[VW];
+
+        // lazy mode: the vectors the cellptrs of the blocks point to (see produce)
+        std::shared_ptr<packed_cells> cells;
+    };
+
 //    bool empty() {
 //        ivy_mike::lock_guard<ivy_mike::mutex> lock(m_qmtx);
 //
@@ -549,18 +757,34 @@ public:
 //
 //    }
 
-    bool get_block( block_t *block, size_t *queue_size = 0 ) {
-        ivy_mike::lock_guard<ivy_mike::mutex> lock( m_qmtx );
+    // the clusters are handed out in order through an atomic cursor into the pre-built list. Every index is taken by
+    // exactly one thread, so the cluster itself can be taken over without further synchronization. In lazy mode the
+    // thread waits until the producer has created the vectors of its cluster, and the ones of the previous cluster
+    // (passed in by the caller) are freed.
+    bool get_cluster( cluster_t *cluster, size_t *queue_size = 0 ) {
+        cluster->cells.reset();
+
+        const size_t i = m_next.fetch_add( 1, std::memory_order_relaxed );
 
-        if( m_blockqueue.empty() ) {
+        if( i >= m_blockqueue.size() ) {
             return false;
         }
 
-        *block = m_blockqueue.front();
-        m_blockqueue.pop_front();
+        if( m_vec_source ) {
+            std::unique_lock<ivy_mike::mutex> lock( m_lazy_mtx );
+            while( m_num_produced <= i && !m_producer_error ) {
+                m_produced_cv.wait( lock );
+            }
+
+            if( m_producer_error ) {
+                return false;
+            }
+        }
+
+        std::swap( *cluster, m_blockqueue[i] );
 
         if( queue_size != 0 ) {
-            *queue_size = m_blockqueue.size();
+            *queue_size = m_blockqueue.size() - i - 1;
         }
         
         return true;
@@ -568,22 +792,180 @@ public:
     }
 
 
-    // WARNING: this method is not synchronized, and shall only be called before the worker threads are running
-    void push_back( const block_t &b ) {
-        m_blockqueue.push_back(b);
+    // WARNING: these methods are not synchronized, and shall only be called before the worker threads are running
+    void push_back( const cluster_t &c ) {
+        m_blockqueue.push_back(c);
+    }
+
+    // stores the (packed) bound vector of a cluster. The returned pointer stays valid as long as the queue exists.
+    const typename packed_column<seq_tag>::cell_t *store_bound( const std::vector<int> &pvec, const std::vector<unsigned int> &aux ) {
+        m_bound_cells.push_back( std::vector<typename packed_column<seq_tag>::cell_t>( pvec.size() ));
+
+        for( size_t i = 0; i < pvec.size(); ++i ) {
+            m_bound_cells.back()[i] = packed_column<seq_tag>::pack( pvec[i], aux[i] );
+        }
+
+        return m_bound_cells.back().data();
+    }
+
+    // lazy mode (see references::lazy): the vectors of the blocks are created by source(first, last, out), which writes
+    // the packed vectors of the edges [first, last) to out (see references::create_packed). It is only called by the
+    // producer (one cluster at a time, in queue order), which stays at most max_bytes of vectors ahead of the workers.
+    typedef std::function<void (const size_t *, const size_t *, cell_t *)> vec_source_t;
+
+    void set_vec_source( const vec_source_t &source, size_t max_bytes ) {
+        m_vec_source = source;
+        m_max_bytes = max_bytes;
+    }
+
+    bool lazy() const {
+        return bool(m_vec_source);
+    }
+
+    // the producer of the lazy mode, run by a thread of its own next to the workers (see run_workers). Creates the
+    // vectors of the clusters in queue order and points the cellptrs of their blocks there. It waits while the
+    // vectors in flight (i.e., created but not yet freed by get_cluster) would exceed max_bytes, unless there are none.
+    // Consecutive tiles of the same blocks (see driver::build_block_queue) share their vectors.
+    // Errors are passed on to the workers (get_cluster returns false) and rethrown by rethrow_producer_error.
+    void produce() {
+        try {
+            std::shared_ptr<packed_cells> prev_cells;
+            std::vector<size_t> prev_edges;
+            std::vector<size_t> edges;
+
+            for( size_t i = 0; i < m_blockqueue.size(); ++i ) {
+                // the workers only touch this cluster after it is published below
+                cluster_t &cluster = m_blockqueue[i];
+
+                edges.clear();
+                for( typename std::vector<block_t>::const_iterator it = cluster.blocks.begin(); it != cluster.blocks.end(); ++it ) {
+                    edges.insert( edges.end(), it->edges, it->edges + it->num_valid );
+                }
+
+                if( prev_cells.get() == 0 || edges != prev_edges ) {
+                    prev_cells.reset();
+
+                    const size_t ref_len = cluster.blocks.empty() ? 0 : cluster.blocks.front().ref_len;
+                    prev_cells = std::make_shared<packed_cells>( this, edges.size() * ref_len );
+                    m_vec_source( edges.data(), edges.data() + edges.size(), prev_cells->data() );
+                    prev_edges.swap( edges );
+                }
+
+                const cell_t *cells = prev_cells->data();
+                for( typename std::vector<block_t>::iterator it = cluster.blocks.begin(); it != cluster.blocks.end(); ++it ) {
+                    for( size_t k = 0; k < it->width; ++k ) {
+                        if( k < size_t(it->num_valid) ) {
+                            it->cellptrs[k] = cells;
+                            cells += it->ref_len;
+                        } else {
+                            it->cellptrs[k] = it->cellptrs[k-1]; // padding
+                        }
+                    }
+                }
+                cluster.cells = prev_cells;
+
+                ivy_mike::lock_guard<ivy_mike::mutex> lock( m_lazy_mtx );
+                ++m_num_produced;
+                m_produced_cv.notify_all();
+            }
+        } catch( ... ) {
+            ivy_mike::lock_guard<ivy_mike::mutex> lock( m_lazy_mtx );
+            m_producer_error = std::current_exception();
+            m_produced_cv.notify_all();
+        }
+    }
+
+    // stops the producer (e.g., if a worker failed and the vectors in flight may never be freed)
+    void cancel_producer() {
+        ivy_mike::lock_guard<ivy_mike::mutex> lock( m_lazy_mtx );
+        m_producer_cancelled = true;
+        m_room_cv.notify_all();
+    }
+
+    void rethrow_producer_error() {
+        if( m_producer_error ) {
+            std::rethrow_exception( m_producer_error );
+        }
+    }
+
+    block_queue() : m_max_bytes(0), m_bytes_in_flight(0), m_num_produced(0), m_producer_cancelled(false), m_next(0) {}
+
+    // number of clusters not yet handed out
+    size_t size() const {
+        return m_blockqueue.size() - std::min( m_next.load( std::memory_order_relaxed ), m_blockqueue.size() );
     }
 
     ivy_mike::mutex *hack_mutex() {
         return &m_qmtx;
     }
 private:
-    ivy_mike::mutex m_qmtx; // mutex for the block queue and the qs best score/edge arrays
-    std::deque<block_t> m_blockqueue;
+    block_queue( const block_queue & );
+    block_queue &operator=( const block_queue & );
+
+    // the vectors the producer created for one or more consecutive clusters. The memory is accounted for in
+    // m_bytes_in_flight from construction (which waits for room, see produce) to destruction.
+    class packed_cells {
+    public:
+        packed_cells( block_queue *q, size_t size ) : q_(q), bytes_(size * sizeof(cell_t)) {
+            {
+                std::unique_lock<ivy_mike::mutex> lock( q_->m_lazy_mtx );
+                while( q_->m_bytes_in_flight != 0 && q_->m_bytes_in_flight + bytes_ > q_->m_max_bytes && !q_->m_producer_cancelled ) {
+                    q_->m_room_cv.wait( lock );
+                }
+
+                if( q_->m_producer_cancelled ) {
+                    throw std::runtime_error( "block_queue: producer cancelled" );
+                }
+                q_->m_bytes_in_flight += bytes_;
+            }
+
+            cells_.resize( size );
+        }
+
+        ~packed_cells() {
+            std::vector<cell_t>().swap( cells_ );
+
+            ivy_mike::lock_guard<ivy_mike::mutex> lock( q_->m_lazy_mtx );
+            q_->m_bytes_in_flight -= bytes_;
+            q_->m_room_cv.notify_all();
+        }
+
+        cell_t *data() {
+            return cells_.data();
+        }
+
+    private:
+        packed_cells( const packed_cells & );
+        packed_cells &operator=( const packed_cells & );
+
+        block_queue *q_;
+        size_t bytes_;
+        std::vector<cell_t> cells_;
+    };
+
+    ivy_mike::mutex m_qmtx; // only used to serialize the log output of the worker threads
+
+    // lazy mode (declared before the clusters, which may still hold packed_cells when the queue is destroyed)
+    vec_source_t m_vec_source;
+    size_t m_max_bytes;
+    ivy_mike::mutex m_lazy_mtx;
+    std::condition_variable m_produced_cv;
+    std::condition_variable m_room_cv;
+    size_t m_bytes_in_flight;
+    size_t m_num_produced;
+    bool m_producer_cancelled;
+    std::exception_ptr m_producer_error;
+
+    std::vector<cluster_t> m_blockqueue;
+    std::atomic<size_t> m_next;
+    std::deque<std::vector<typename packed_column<seq_tag>::cell_t> > m_bound_cells;
     std::vector <int> m_qs_bestscore;
     std::vector <int> m_qs_bestedge;
 };
 
 
+// best scores/edges (and optionally the best max_num candidates) per query. Not synchronized: during scoring every worker
+// thread owns a scoring_results object, and these are merged once all threads are done (see run_workers).
 class scoring_results {
 public:
     class candidate {
@@ -616,20 +998,38 @@ public:
 
         void offer( int score, size_t ref ) ;
 
+        bool full() const {
+            return size() >= max_num_;
+        }
+
+        // takes over the candidates of other (with the same max_num)
+        void assign( const candidates &other ) {
+            assert( other.max_num_ == max_num_ );
+            std::vector<candidate>::operator=( other );
+        }
+
+        // true if offer(score, ref) would change the candidates
+        bool accepts( int score, size_t ref ) const {
+            return !full() || (max_num_ != 0 && candidate( score, ref ) < back());
+        }
+
+        size_t max_num() const {
+            return max_num_;
+        }
+
         using std::vector<candidate>::at;
         using std::vector<candidate>::operator[];
         using std::vector<candidate>::size;
 
     private:
         const size_t max_num_;
-
-        std::vector<candidate> cands_;
     };
 
 public:
     scoring_results( size_t num_qs, const candidates &cands_template )
     : best_score_(num_qs, std::numeric_limits<int>::min() ),
       best_ref_(num_qs, size_t(-1)),
+      best_end_(num_qs, size_t(-1)),
       candss_(num_qs, cands_template )
     {}
 
@@ -638,27 +1038,77 @@ public:
     bool offer( size_t qs, size_t ref, int score ) ;
 
 
+    // end_start (optional): the end columns of the alignments (see scoring_kernel::align)
     template<typename idx_iter, typename score_iter>
-    void offer( size_t qs, idx_iter ref_start, idx_iter ref_end, score_iter score_start ) {
-        ivy_mike::lock_guard<ivy_mike::mutex> lock(mtx_);
-
+    void offer( size_t qs, idx_iter ref_start, idx_iter ref_end, score_iter score_start, const size_t *end_start = 0 ) {
+        candidates &cands = candss_.at( qs );
 
         while( ref_start != ref_end ) {
-            candss_.at( qs ).offer( *score_start, *ref_start );
+            cands.offer( *score_start, *ref_start );
 
 
             if( best_score_.at(qs) < *score_start || (best_score_.at(qs) == *score_start && *ref_start < best_ref_.at(qs))) {
                 best_score_[qs] = *score_start;
                 best_ref_.at(qs) = *ref_start;
+                best_end_[qs] = end_start != 0 ? *end_start : size_t(-1);
             }
 
 
             ++ref_start;
             ++score_start;
+            if( end_start != 0 ) {
+                ++end_start;
+            }
+        }
+
+    }
+
+    // the same for the scores of several queries against one reference (i.e., the output of the query-striped kernels)
+    template<typename idx_iter, typename score_iter>
+    void offer_queries( size_t ref, idx_iter qs_start, idx_iter qs_end, score_iter score_start ) {
+        while( qs_start != qs_end ) {
+            const size_t qs = *qs_start;
+
+            candss_.at( qs ).offer( *score_start, ref );
+
+            if( best_score_.at(qs) < *score_start || (best_score_.at(qs) == *score_start && ref < best_ref_.at(qs))) {
+                best_score_[qs] = *score_start;
+                best_ref_.at(qs) = ref;
+                best_end_[qs] = size_t(-1);
+            }
+
+            ++qs_start;
+            ++score_start;
         }
+    }
+
+
+    // lowest score a reference must reach to still change the results of query qs (i.e., become the best or one of the
+    // candidates). Scores below it can safely be skipped.
+    int pruning_threshold( size_t qs ) const {
+        const candidates &cands = candss_.at( qs );
 
+        if( !cands.full() ) {
+            return std::numeric_limits<int>::min();
+        } else if( cands.size() == 0 ) {
+            return best_score_.at( qs );
+        } else {
+            return std::min( best_score_.at( qs ), cands[cands.size() - 1].score() );
+        }
     }
 
+    // merges the results of another scoring_results object (i.e., the thread-local results of a worker). The result
+    // does not depend on the order of the merges: ties are broken by the lower reference index, as in offer, and the
+    // candidates are ordered by (score, reference index).
+    void merge( const scoring_results &other ) ;
+
+    size_t size() const {
+        return best_score_.size();
+    }
+
+    size_t max_candidates() const {
+        return candss_.empty() ? 0 : candss_.front().max_num();
+    }
 
     int bestscore_at(size_t i ) const {
         return best_score_.at(i);
@@ -668,18 +1118,48 @@ public:
         return best_ref_.at(i);
     }
 
+    // the column of the best edge in which the best alignment ends, or size_t(-1) if unknown
+    size_t bestend_at(size_t i ) const {
+        return best_end_.at(i);
+    }
+
     const candidates &candidates_at( size_t i ) const {
         return candss_.at( i );
     }
 
+    // adds the duplicates of the candidate references of query qs (dups[r]: the other references identical to r, see
+    // references::rep_at) with the same scores. The best reference stays as it is, as it is the lowest of its duplicates.
+    void add_duplicate_refs( size_t qs, const std::vector<std::vector<size_t> > &dups ) {
+        candidates &cands = candss_.at( qs );
+        std::vector<candidate> reps;
+
+        for( size_t i = 0; i < cands.size(); ++i ) {
+            reps.push_back( cands[i] );
+        }
+
+        for( std::vector<candidate>::iterator it = reps.begin(); it != reps.end(); ++it ) {
+            const std::vector<size_t> &d = dups.at( it->ref() );
+
+            for( std::vector<size_t>::const_iterator dit = d.begin(); dit != d.end() && cands.accepts( it->score(), *dit ); ++dit ) {
+                cands.offer( it->score(), *dit );
+            }
+        }
+    }
+
+    // copies the results of query from to query to (for identical queries, see queries::rep_at)
+    void copy_query( size_t from, size_t to ) {
+        best_score_.at(to) = best_score_.at(from);
+        best_ref_.at(to) = best_ref_.at(from);
+        best_end_.at(to) = best_end_.at(from);
+        candss_.at(to).assign( candss_.at(from) );
+    }
+
 private:
     std::vector<int> best_score_;
     std::vector<size_t> best_ref_;
+    std::vector<size_t> best_end_;
 
     std::vector<candidates> candss_;
-
-    ivy_mike::mutex mtx_;
-
 };
 
 
@@ -854,23 +1334,34 @@ public:
     typedef references<pvec_t,seq_tag> my_references;
     typedef block_queue<seq_tag> my_block_queue;
     
-    static void calc_scores( size_t n_threads, const my_references &refs, const my_queries &qs, scoring_results *res, const papara_score_parameters &sp );
+    // if qs_edges is non-null, each query is only aligned against the edges in (*qs_edges)[i] (and possibly some more)
+    static void calc_scores( size_t n_threads, const my_references &refs, const my_queries &qs, scoring_results *res, const papara_score_parameters &sp, const std::vector<std::vector<size_t> > *qs_edges = 0 );
+
+    // k-mer based prefilter (see kmer_prefilter.h): the num_edges most promising edges for each query (none for the
+    // duplicate queries, see queries::rep_at)
+    static void prefilter_edges( const my_references &refs, const my_queries &qs, size_t num_edges, std::vector<std::vector<size_t> > *qs_edges );
     
     static void do_newview( pvec_t &root_pvec, im_tree_parser::lnode *n1, im_tree_parser::lnode *n2, bool incremental ) ;
     
-    static void build_block_queue( const my_references &refs, my_block_queue *bq ) ;
+    // each cluster of edge blocks is split into tiles of qs_chunk of the queries qs_idx (0: all queries in one tile)
+    static void build_block_queue( const my_references &refs, my_block_queue *bq, size_t width, bool with_bounds, const std::vector<size_t> &qs_idx, size_t qs_chunk ) ;
+
+    static void build_group_block_queue( const my_references &refs, const std::vector<std::vector<size_t> > &qs_edges, my_block_queue *bq, size_t width ) ;
+
+    static void build_blocks( const my_references &refs, const std::vector<size_t> &edges, size_t width, std::vector<typename my_block_queue::block_t> *blocks ) ;
     
     static void seq_to_position_map(const std::vector< uint8_t >& seq, std::vector< int > &map) ;
     
     static void print_best_scores( std::ostream &os, const my_queries &qs, const scoring_results &res ) ;
     
-    static std::vector<std::vector<uint8_t> > generate_traces( std::ostream &os_quality, std::ostream &os_cands, const my_queries &qs, const my_references &refs, const scoring_results &res, const papara_score_parameters &sp ) ;
+    // recomputes the best alignment of each query with the scalar traceback kernel (on n_threads threads)
+    static std::vector<std::vector<uint8_t> > generate_traces( std::ostream &os_quality, std::ostream &os_cands, const my_queries &qs, const my_references &refs, const scoring_results &res, const papara_score_parameters &sp, size_t n_threads = 1 ) ;
     
     static void align_best_scores2( std::ostream &os, std::ostream &os_quality, std::ostream &os_cands, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp ) ;
     
     static void align_best_scores( std::ostream &os, std::ostream &os_quality, std::ostream &os_cands, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp ) ;
     
-    static void align_best_scores_oa( output_alignment *os, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp );
+    static void align_best_scores_oa( output_alignment *os, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp, size_t n_threads = 1 );
             
 };
 
@@ -17,6 +17,8 @@
  *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstdlib>
+
 #include "blast_partassign.h"
 
 #include "ivymike/getopt.h"
@@ -105,11 +107,38 @@ void print_help( std::ostream &os ) {
     options.push_back( "-n <run name>" );
     text.push_back( "Specify filename suffix of the output@files (default: \"default\")");
 
+    options.push_back( "-e <num edges>" );
+    text.push_back( "Only align each query against the <num edges> reference@edges with the most shared k-mers (default: 0 = all edges).@Heuristic for large reference trees, the recall is reported@in the log file.");
+
+    options.push_back( "-m <megabytes>" );
+    text.push_back( "Memory limit for the ancestral state vectors of the reference@edges (default: 0 = no limit). If they need more, they are@created on demand while aligning, which is slower.");
+
     options.push_back( "-r" );
     text.push_back( "Turn of writing RA-side gaps in the output file.");
 
     options.push_back( "-p" );
     text.push_back( "User defined scoring scheme: <open>:<extend>:<match>:<match cg>@The default scores correspond to '-p -3:-1:2:-3'" );
+
+    options.push_back( "-K <kernel>" );
+    text.push_back( "Scoring kernel: sse41, avx2 or avx512bw (default: the best one@supported by the cpu)");
+
+    options.push_back( "-S <mode>" );
+    text.push_back( "Scoring mode: edge (a query against a block of edges) or@query (a group of queries against one edge)@(default: by estimated cost)");
+
+    options.push_back( "-P" );
+    text.push_back( "Turn off skipping edge blocks by upper score bounds@(for benchmarking)");
+
+    options.push_back( "-R" );
+    text.push_back( "Turn off reusing the dp rows of shared query prefixes@(for benchmarking)");
+
+    options.push_back( "-T <num cells>" );
+    text.push_back( "Alignments with more dp cells use the slower, checkpointed@traceback, which needs much less memory (default: 67108864)");
+
+    options.push_back( "-B" );
+    text.push_back( "Turn off the banded traceback (for benchmarking)");
+
+    options.push_back( "-V" );
+    text.push_back( "Use the row-by-row traceback dp instead of the vectorized one@(for benchmarking)");
     
     print_help( os, options, text );
 
@@ -119,7 +148,7 @@ void print_help( std::ostream &os ) {
 
 
 template<typename pvec_t, typename seq_tag>
-void run_papara( const std::string &qs_name, const std::string &alignment_name, const std::string &tree_name, size_t num_threads, const std::string &run_name, bool ref_gaps, const papara_score_parameters &sp, bool write_fasta, partassign::part_assignment *part_assign, const std::pair<size_t,size_t> &fixed_qs_bounds ) {
+void run_papara( run_context &ctx, const std::string &qs_name, const std::string &alignment_name, const std::string &tree_name, size_t num_threads, const std::string &run_name, bool ref_gaps, const papara_score_parameters &sp, bool write_fasta, partassign::part_assignment *part_assign, const std::pair<size_t,size_t> &fixed_qs_bounds, size_t num_prefilter_edges, size_t ref_memory_mb ) {
 
     ivy_mike::perf_timer t1;
 
@@ -129,7 +158,7 @@ void run_papara( const std::string &qs_name, const std::string &alignment_name,
     
     
     t1.add_int();
-    references<pvec_t,seq_tag> refs( tree_name.c_str(), alignment_name.c_str(), &qs );
+    references<pvec_t,seq_tag> refs( ctx, tree_name.c_str(), alignment_name.c_str(), &qs );
 
     
     
@@ -140,7 +169,7 @@ void run_papara( const std::string &qs_name, const std::string &alignment_name,
     t1.add_int();
 
     refs.remove_full_gaps();
-    refs.build_ref_vecs();
+    refs.build_ref_vecs( ref_memory_mb * 1024 * 1024, num_threads );
 
     if( part_assign != 0 ) {
         if( ref_gaps ) {
@@ -175,9 +204,15 @@ void run_papara( const std::string &qs_name, const std::string &alignment_name,
     scoring_results res( qs.size(), scoring_results::candidates(num_candidates) );
 
 
-    lout << "scoring scheme: " << sp.gap_open << " " << sp.gap_extend << " " << sp.match << " " << sp.match_cgap << "\n";
+    ctx.log() << "scoring scheme: " << sp.gap_open << " " << sp.gap_extend << " " << sp.match << " " << sp.match_cgap << "\n";
 
-    driver<pvec_t,seq_tag>::calc_scores(num_threads, refs, qs, &res, sp );
+    if( num_prefilter_edges != 0 && num_prefilter_edges < refs.num_pvecs() ) {
+        std::vector<std::vector<size_t> > qs_edges;
+        driver<pvec_t,seq_tag>::prefilter_edges( refs, qs, num_prefilter_edges, &qs_edges );
+        driver<pvec_t,seq_tag>::calc_scores(num_threads, refs, qs, &res, sp, &qs_edges );
+    } else {
+        driver<pvec_t,seq_tag>::calc_scores(num_threads, refs, qs, &res, sp );
+    }
 
     std::string score_file(filename(run_name, "alignment"));
     std::string quality_file(filename(run_name, "quality"));
@@ -210,7 +245,7 @@ void run_papara( const std::string &qs_name, const std::string &alignment_name,
     
     //refs.write_seqs(os, pad);
     //     driver<pvec_t,seq_tag>::align_best_scores( os, os_qual, os_cands, qs, refs, res, pad, ref_gaps, sp );
-    driver<pvec_t,seq_tag>::align_best_scores_oa( oa.get(), qs, refs, res, pad, ref_gaps, sp );
+    driver<pvec_t,seq_tag>::align_best_scores_oa( oa.get(), qs, refs, res, pad, ref_gaps, sp, num_threads );
     
 }
 
@@ -241,6 +276,8 @@ int main( int argc, char *argv[] ) {
     
     bool opt_use_cgap;
     int opt_num_threads;
+    int opt_num_prefilter_edges;
+    int opt_ref_memory_mb;
     std::string opt_run_name;
     bool opt_write_testbench;
     bool opt_force_overwrite;
@@ -248,6 +285,13 @@ int main( int argc, char *argv[] ) {
     bool opt_no_ref_gaps;
     bool opt_print_help;
     bool opt_write_fasta;
+    std::string opt_kernel;
+    std::string opt_scoring_mode;
+    bool opt_no_edge_pruning;
+    bool opt_no_prefix_reuse;
+    std::string opt_traceback_max_cells;
+    bool opt_no_banded_traceback;
+    bool opt_no_vector_traceback;
     
     igp.add_opt( 't', igo::value<std::string>(opt_tree_name) );
     igp.add_opt( 's', igo::value<std::string>(opt_alignment_name) );
@@ -255,6 +299,8 @@ int main( int argc, char *argv[] ) {
     igp.add_opt( 'c', igo::value<bool>(opt_use_cgap, true).set_default(false) );
     igp.add_opt( 'a', igo::value<bool>(opt_aa, true).set_default(false) );
     igp.add_opt( 'j', igo::value<int>(opt_num_threads).set_default(1) );
+    igp.add_opt( 'e', igo::value<int>(opt_num_prefilter_edges).set_default(0) );
+    igp.add_opt( 'm', igo::value<int>(opt_ref_memory_mb).set_default(0) );
     igp.add_opt( 'n', igo::value<std::string>(opt_run_name).set_default("default") );
     igp.add_opt( 'b', igo::value<bool>(opt_write_testbench, true).set_default(false) );
     igp.add_opt( 'f', igo::value<bool>(opt_force_overwrite, true).set_default(false) );
@@ -265,6 +311,13 @@ int main( int argc, char *argv[] ) {
     igp.add_opt( 'l', igo::value<std::string>(opt_blast_hits) );
     igp.add_opt( 'x', igo::value<std::string>(opt_partitions) );
     igp.add_opt( 'k', igo::value<std::string>(opt_partition_name) );
+    igp.add_opt( 'K', igo::value<std::string>(opt_kernel).set_default("") );
+    igp.add_opt( 'S', igo::value<std::string>(opt_scoring_mode).set_default("") );
+    igp.add_opt( 'P', igo::value<bool>(opt_no_edge_pruning, true).set_default(false) );
+    igp.add_opt( 'R', igo::value<bool>(opt_no_prefix_reuse, true).set_default(false) );
+    igp.add_opt( 'T', igo::value<std::string>(opt_traceback_max_cells).set_default("") );
+    igp.add_opt( 'B', igo::value<bool>(opt_no_banded_traceback, true).set_default(false) );
+    igp.add_opt( 'V', igo::value<bool>(opt_no_vector_traceback, true).set_default(false) );
     
     igp.parse(argc,argv);
 
@@ -330,6 +383,44 @@ int main( int argc, char *argv[] ) {
         print_help( std::cerr );
         return 0;
     }
+
+    run_options opts;
+
+    if( !opt_kernel.empty() ) {
+        try {
+            select_kernel_isa( opt_kernel.c_str() );
+        } catch( const std::runtime_error &e ) {
+            std::cerr << "option -K: " << e.what() << "\n";
+            return 0;
+        }
+        opts.kernel = opt_kernel;
+    }
+
+    if( opt_scoring_mode == "edge" ) {
+        opts.mode = scoring_mode_edge;
+    } else if( opt_scoring_mode == "query" ) {
+        opts.mode = scoring_mode_query;
+    } else if( !opt_scoring_mode.empty() ) {
+        std::cerr << "option -S: unknown scoring mode: " << opt_scoring_mode << " (expected edge or query)\n";
+        return 0;
+    }
+
+    opts.edge_pruning = !opt_no_edge_pruning;
+    opts.prefix_reuse = !opt_no_prefix_reuse;
+
+    if( !opt_traceback_max_cells.empty() ) {
+        char *end = 0;
+        const unsigned long long max_cells = std::strtoull( opt_traceback_max_cells.c_str(), &end, 10 );
+
+        if( *end != 0 || max_cells == 0 || opt_traceback_max_cells[0] == '-' ) {
+            std::cerr << "option -T: expected a positive number of cells: " << opt_traceback_max_cells << "\n";
+            return 0;
+        }
+        opts.traceback_max_cells = size_t(max_cells);
+    }
+
+    opts.banded_traceback = !opt_no_banded_traceback;
+    opts.vector_traceback = !opt_no_vector_traceback;
         
     
     
@@ -348,7 +439,9 @@ int main( int argc, char *argv[] ) {
     }
     
     
-    papara::add_log_tee papara_log_cout( std::cout );
+    papara::run_context ctx;
+    ctx.options() = opts;
+    papara::add_log_tee papara_log_cout( ctx, std::cout );
     
     std::ofstream logs( log_filename.c_str());
     if( !logs ) {
@@ -357,10 +450,10 @@ int main( int argc, char *argv[] ) {
     }
     
     
-    papara::add_log_tee papara_log_file( logs );
+    papara::add_log_tee papara_log_file( ctx, logs );
 
-    papara::lout << "papara called as:\n";
-    print_commandline( papara::lout, argv, argc ); 
+    ctx.log() << "papara called as:\n";
+    print_commandline( ctx.log(), argv, argc ); 
 
     const bool ref_gaps = !opt_no_ref_gaps;
 
@@ -376,20 +469,20 @@ int main( int argc, char *argv[] ) {
     if( opt_use_cgap ) {
 
         if( opt_aa ) {
-            run_papara<pvec_cgap, tag_aa>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds );
+            run_papara<pvec_cgap, tag_aa>( ctx, opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds, std::max( 0, opt_num_prefilter_edges ), std::max( 0, opt_ref_memory_mb ) );
         } else {
-            run_papara<pvec_cgap, tag_dna>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds );
+            run_papara<pvec_cgap, tag_dna>( ctx, opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds, std::max( 0, opt_num_prefilter_edges ), std::max( 0, opt_ref_memory_mb ) );
         }
     } else {
         if( opt_aa ) {
-            run_papara<pvec_pgap, tag_aa>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds );
+            run_papara<pvec_pgap, tag_aa>( ctx, opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds, std::max( 0, opt_num_prefilter_edges ), std::max( 0, opt_ref_memory_mb ) );
         } else {
-            run_papara<pvec_pgap, tag_dna>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds );
+            run_papara<pvec_pgap, tag_dna>( ctx, opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds, std::max( 0, opt_num_prefilter_edges ), std::max( 0, opt_ref_memory_mb ) );
         }
     }
 
     std::cout << t.elapsed() << std::endl;
-    lout << "SUCCESS " << t.elapsed() << std::endl;
+    ctx.log() << "SUCCESS " << t.elapsed() << std::endl;
 
     
     
@@ -1899,14 +1899,15 @@ int main( int argc, char *argv[] ) {
         return 0;
     }
     
-    papara::add_log_tee log_cout(std::cout);
+    papara::run_context ctx;
+    papara::add_log_tee log_cout(ctx, std::cout);
     std::ofstream logs(log_filename.c_str());
     if(!logs){
         std::cout << "could not open logfile for writing: " << log_filename << std::endl;
         return 0;
     }
     
-    papara::add_log_tee log_file(logs);
+    papara::add_log_tee log_file(ctx, logs);
     
     
     std::shared_ptr<ln_pool> pool(new ln_pool(ln_pool::fact_ptr_type(new my_fact)));
@@ -2123,7 +2124,7 @@ int main( int argc, char *argv[] ) {
     }
 
     std::cout << t.elapsed() << std::endl;
-    papara::lout << "SUCCESS " << t.elapsed() << std::endl;
+    ctx.log() << "SUCCESS " << t.elapsed() << std::endl;
 
     std::cout << "mean quality: " << qual / num_qual << "\n";
 
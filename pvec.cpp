@@ -19,5 +19,159 @@
 
 
 #include <pvec.h>
+#include "vec_unit.h"
 
-ivy_mike::stupid_ptr<probgap_model> pvec_pgap::pgap_model;
\ No newline at end of file
+ivy_mike::stupid_ptr<probgap_model> pvec_pgap::pgap_model;
+
+namespace {
+
+// the per column logic of pvec_cgap::newview for 4 columns at a time. exact_cgap selects how the cgap flag of a child is
+// tested (see there), which is the only difference between the tip cases. g1/g2 are all ones for cgap children, the
+// result is (g1 | g2) & AUX_CGAP plus (g1 ^ g2) & AUX_OPEN.
+template<bool exact_cgap>
+void newview_cgap_columns( parsimony_state *p, int *pa, const parsimony_state *c1, const int *a1, const parsimony_state *c2, const int *a2, size_t n ) {
+    typedef vector_unit<int,4> vu;
+    typedef vu::vec_t vec_t;
+
+    const vec_t cgap = vu::set1( AUX_CGAP );
+    const vec_t open = vu::set1( AUX_OPEN );
+
+    size_t i = 0;
+    for( ; i + vu::W <= n; i += vu::W ) {
+        const vec_t s1 = vu::load( c1 + i );
+        const vec_t s2 = vu::load( c2 + i );
+        const vec_t both = vu::bit_and( s1, s2 );
+        const vec_t empty = vu::cmp_zero( both );
+
+        vu::store( vu::bit_or( vu::bit_andnot( empty, both ), vu::bit_and( empty, vu::bit_or( s1, s2 ))), p + i );
+
+        const vec_t f1 = vu::load( a1 + i );
+        const vec_t f2 = vu::load( a2 + i );
+        const vec_t g1 = exact_cgap ? vu::cmp_eq( f1, cgap ) : vu::cmp_eq( vu::bit_and( f1, cgap ), cgap );
+        const vec_t g2 = exact_cgap ? vu::cmp_eq( f2, cgap ) : vu::cmp_eq( vu::bit_and( f2, cgap ), cgap );
+
+        vu::store( vu::bit_or( vu::bit_and( vu::bit_or( g1, g2 ), cgap ), vu::bit_and( vu::bit_xor( g1, g2 ), open )), pa + i );
+    }
+
+    for( ; i < n; ++i ) {
+        const parsimony_state both = c1[i] & c2[i];
+        p[i] = both != 0 ? both : (c1[i] | c2[i]);
+
+        const int g1 = exact_cgap ? int(a1[i] == AUX_CGAP) : (a1[i] & AUX_CGAP);
+        const int g2 = exact_cgap ? int(a2[i] == AUX_CGAP) : (a2[i] & AUX_CGAP);
+
+        pa[i] = ((g1 | g2) != 0 ? AUX_CGAP : 0) | ((g1 ^ g2) != 0 ? AUX_OPEN : 0);
+    }
+}
+
+}
+
+void pvec_cgap::newview( pvec_cgap &p, pvec_cgap &c1, pvec_cgap &c2, double /*z1*/, double /*z2*/, ivy_mike::tip_case tc ) {
+    if( c1.v.size() != c2.v.size() ) {
+        std::cerr << "not equal: " << c1.size() << " " << c2.size() << "\n";
+        throw std::runtime_error( "newview: vectors have different lengths (illegal incremetal newview on modified data?)" );
+    }
+
+    p.v.resize(c1.v.size());
+    p.auxv.resize(c1.auxv.size());
+
+    if( tc == INNER_INNER ) {
+        newview_cgap_columns<true>( p.v.data(), p.auxv.data(), c1.v.data(), c1.auxv.data(), c2.v.data(), c2.auxv.data(), c1.v.size() );
+    } else {
+        newview_cgap_columns<false>( p.v.data(), p.auxv.data(), c1.v.data(), c1.auxv.data(), c2.v.data(), c2.auxv.data(), c1.v.size() );
+    }
+}
+void pvec_pgap::newview( pvec_pgap &p, const pvec_pgap &c1, const pvec_pgap &c2, double z1, double z2, ivy_mike::tip_case /*tc*/ ) {
+    namespace ublas = boost::numeric::ublas;
+    typedef vector_unit<double,2> vu;
+    typedef vu::vec_t vec_t;
+
+    assert( c1.v.size() == c2.v.size() );
+
+    if( c1.v.size() != c2.v.size() ) {
+        std::cerr << "not equal: " << c1.size() << " " << c2.size() << "\n";
+        throw std::runtime_error( "newview: vectors have different lengths (illegal incremetal newview on modified data?)" );
+    }
+
+    assert( c1.model() == c2.model() );
+    p.model_ = c1.model_;
+
+    const ublas::matrix<double> p1 = c1.model()->pmatrix(z1);
+    const ublas::matrix<double> &p2 = c1.model()->pmatrix(z2);
+
+    const size_t n = c1.gap_prob.size2();
+    assert( c1.gap_prob.size1() == 2 && c2.gap_prob.size1() == 2 && c2.gap_prob.size2() == n );
+
+    // resize only reallocates if the size changes (the rows are stored one after the other)
+    p.gap_prob.resize( 2, n, false );
+
+    const double *a0 = &c1.gap_prob.data()[0];
+    const double *a1 = a0 + n;
+    const double *b0 = &c2.gap_prob.data()[0];
+    const double *b1 = b0 + n;
+    double *r0 = &p.gap_prob.data()[0];
+    double *r1 = r0 + n;
+
+    const static double twotothe256 = 115792089237316195423570985008687907853269984665640564039457584007913129639936.0;
+                                                 /*  2**256 (exactly)  */
+
+    const static double minlikelihood  = 1.0/twotothe256;
+
+    // the same operations in the same order as ublas::prod/element_prod (the products of the 2x2 P-matrices with the
+    // children start their sums with the k = 0 term), so the results are identical to the old implementation.
+    const vec_t p1_00 = vu::set1( p1(0,0) );
+    const vec_t p1_01 = vu::set1( p1(0,1) );
+    const vec_t p1_10 = vu::set1( p1(1,0) );
+    const vec_t p1_11 = vu::set1( p1(1,1) );
+    const vec_t p2_00 = vu::set1( p2(0,0) );
+    const vec_t p2_01 = vu::set1( p2(0,1) );
+    const vec_t p2_10 = vu::set1( p2(1,0) );
+    const vec_t p2_11 = vu::set1( p2(1,1) );
+
+    const vec_t abs_mask = vu::cast_from_int( _mm_set1_epi64x( 0x7fffffffffffffffLL ));
+    const vec_t min_lh = vu::set1( minlikelihood );
+    const vec_t scale = vu::set1( twotothe256 );
+    const vec_t one = vu::set1( 1.0 );
+
+    size_t j = 0;
+    for( ; j + vu::W <= n; j += vu::W ) {
+        const vec_t x0 = vu::loadu( a0 + j );
+        const vec_t x1 = vu::loadu( a1 + j );
+        const vec_t y0 = vu::loadu( b0 + j );
+        const vec_t y1 = vu::loadu( b1 + j );
+
+        vec_t g0 = vu::mul( vu::add( vu::mul( p1_00, x0 ), vu::mul( p1_01, x1 )), vu::add( vu::mul( p2_00, y0 ), vu::mul( p2_01, y1 )));
+        vec_t g1 = vu::mul( vu::add( vu::mul( p1_10, x0 ), vu::mul( p1_11, x1 )), vu::add( vu::mul( p2_10, y0 ), vu::mul( p2_11, y1 )));
+
+        const vec_t small = vu::bit_and( vu::cmp_lt( vu::bit_and( g0, abs_mask ), min_lh ), vu::cmp_lt( vu::bit_and( g1, abs_mask ), min_lh ));
+        const vec_t f = vu::bit_or( vu::bit_and( small, scale ), vu::bit_andnot( small, one ));
+
+        vu::storeu( vu::mul( g0, f ), r0 + j );
+        vu::storeu( vu::mul( g1, f ), r1 + j );
+    }
+
+    for( ; j < n; ++j ) {
+        double g0 = (p1(0,0) * a0[j] + p1(0,1) * a1[j]) * (p2(0,0) * b0[j] + p2(0,1) * b1[j]);
+        double g1 = (p1(1,0) * a0[j] + p1(1,1) * a1[j]) * (p2(1,0) * b0[j] + p2(1,1) * b1[j]);
+
+        if( fabs(g0) < minlikelihood && fabs(g1) < minlikelihood ) {
+            g0 *= twotothe256;
+            g1 *= twotothe256;
+        }
+
+        r0[j] = g0;
+        r1[j] = g1;
+    }
+
+    p.v.resize(c1.v.size());
+
+    for( size_t i = 0; i < c1.v.size(); i++ ) {
+        parsimony_state ps = c1.v[i] & c2.v[i];
+
+        if( ps == 0 ) {
+            ps = c1.v[i] | c2.v[i];
+        }
+
+        p.v[i] = ps;
+    }
+}
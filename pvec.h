@@ -30,6 +30,10 @@
 #include <cassert>
 #include <algorithm>
 #include <iostream>
+#include <map>
+#include <list>
+#include <cstring>
+#include <stdint.h>
 
 //#define USE_CBLAS
 #ifdef USE_CBLAS
@@ -42,6 +46,8 @@ extern "C" {
 #include "parsimony.h"
 #include "ivymike/stupid_ptr.h"
 #include "ivymike/algorithm.h"
+#include "ivymike/aligned_buffer.h"
+#include "ivymike/thread.h"
 #include "sequence_model.h"
 namespace {
 //using ivy_mike::tip_case;
@@ -50,10 +56,17 @@ using ivy_mike::TIP_INNER;
 using ivy_mike::INNER_INNER;
 }
 
+class probgap_model;
+
 class pvec_cgap {
-    //     aligned_buffer<parsimony_state> v;
-    std::vector<parsimony_state> v;
-    std::vector<int> auxv;
+public:
+    // the states and aux flags are stored in aligned arrays, for the vectorized newview (see pvec.cpp)
+    typedef ivy_mike::aligned_buffer<parsimony_state, 16> state_buffer;
+    typedef ivy_mike::aligned_buffer<int, 16> aux_buffer;
+
+private:
+    state_buffer v;
+    aux_buffer auxv;
 
     template<typename seq_model>
     class seq2aux {
@@ -82,8 +95,9 @@ public:
 
 
 
+    // the gap model is only used by pvec_pgap
     template<typename seq_model>
-    void init2( const std::vector<uint8_t> &seq, const seq_model &sm ) {
+    void init2( const std::vector<uint8_t> &seq, const seq_model &sm, probgap_model *pgap_model = 0 ) {
         v.resize(seq.size());
         auxv.resize(seq.size());
         std::transform( seq.begin(), seq.end(), v.begin(), seq_model::s2p );
@@ -92,76 +106,17 @@ public:
         std::cerr << ">>>>>>>>>>>>>>>> WARNING: untested strange code!!!\n";
     }
 
-    inline const std::vector<parsimony_state> &get_v() {
+    inline const state_buffer &get_v() {
         return v;
     }
-    inline const std::vector<int> &get_auxv() {
+    inline const aux_buffer &get_auxv() {
         return auxv;
     }
 
-    static void newview( pvec_cgap &p, pvec_cgap &c1, pvec_cgap &c2, double /*z1*/, double /*z2*/, ivy_mike::tip_case tc ) {
-
-    	if( c1.v.size() != c2.v.size() ) {
-    		std::cout << "size2: " << c1.size() << " " << c2.size() << "\n";
-    	}
-        assert( c1.v.size() == c2.v.size() );
-
-        if( c1.v.size() != c2.v.size() ) {
-            std::cerr << "not equal: " << c1.size() << " " << c2.size() << "\n";
-            throw std::runtime_error( "newview: vectors have different lengths (illegal incremetal newview on modified data?)" );
-        }
-        
-//         p.v.resize(0);
-        p.v.resize(c1.v.size());
-        p.auxv.resize(c1.auxv.size());
-
-        
-
-        for( size_t i = 0; i < c1.v.size(); i++ ) {
-            parsimony_state ps = c1.v[i] & c2.v[i];
-
-            if( ps == 0 ) {
-                ps = c1.v[i] | c2.v[i];
-            }
-
-            //p.v.push_back( ps );
-            p.v[i] = ps;
-
-
-
-            const int a1 = c1.auxv[i];
-            const int a2 = c2.auxv[i];
-
-            const bool cgap1 = (a1 & AUX_CGAP) != 0;
-            const bool cgap2 = (a2 & AUX_CGAP) != 0;
-
-//             const bool open1 = (a1 & AUX_OPEN) != 0;
-//             const bool open2 = (a2 & AUX_OPEN) != 0;
-
-            p.auxv[i] = 0;
-
-            if( tc == TIP_TIP ) {
-                if( cgap1 && cgap2 ) {
-                    p.auxv[i] = AUX_CGAP;
-                } else if( cgap1 != cgap2 ) {
-                    p.auxv[i] = AUX_CGAP | AUX_OPEN;
-                }
-            } else if( tc == TIP_INNER ) {
-                if( cgap1 && cgap2 ) {
-                    p.auxv[i] = AUX_CGAP;
-                } else if( cgap1 != cgap2 ) {
-                    p.auxv[i] = AUX_CGAP | AUX_OPEN;
-                }
-            } else {
-                if( a1 == AUX_CGAP && a2 == AUX_CGAP ) {
-                    p.auxv[i] = AUX_CGAP;
-                } else if( a1 == AUX_CGAP || a2 == AUX_CGAP ) {
-                    p.auxv[i] = AUX_CGAP | AUX_OPEN;
-                }
-            }
-
-        }
-    }
+    // parsimony states: the intersection of the child states, or their union if it is empty. Aux flags: cgap if both
+    // children are cgaps, cgap + open if only one of them is. If there is a tip among the children, a child counts as cgap
+    // if its cgap bit is set, between two inner children only if its flags are exactly AUX_CGAP. Vectorized, see pvec.cpp.
+    static void newview( pvec_cgap &p, pvec_cgap &c1, pvec_cgap &c2, double /*z1*/, double /*z2*/, ivy_mike::tip_case tc ) ;
 
     inline size_t size() {
         return v.size();
@@ -177,7 +132,7 @@ public:
     template<typename oiter_, size_t STRIDE>
     inline void to_int_vec_strided( oiter_ out ) {
         //outv.assign( v.begin(), v.end() );
-        for( std::vector< parsimony_state >::iterator it = v.begin(); it != v.end(); ++it, out += STRIDE ) {
+        for( state_buffer::iterator it = v.begin(); it != v.end(); ++it, out += STRIDE ) {
             *out = *it;
             
         }
@@ -205,7 +160,7 @@ public:
     inline void to_aux_vec_strided( oiter_ out ) {
         //         std::cout << "v: " << v.size() << "\n";
         
-        for( std::vector< int >::iterator it = auxv.begin(); it != auxv.end(); ++it, out += STRIDE ) {
+        for( aux_buffer::iterator it = auxv.begin(); it != auxv.end(); ++it, out += STRIDE ) {
             if( *it == AUX_CGAP ) {
                 *out = 0xFFFF;
             } else {
@@ -223,7 +178,8 @@ public:
     }
     
     bool operator==( const pvec_cgap &other ) const {
-        return v == other.v && auxv == other.auxv;
+        return v.size() == other.v.size() && auxv.size() == other.auxv.size()
+            && std::equal( v.begin(), v.end(), other.v.begin() ) && std::equal( auxv.begin(), auxv.end(), other.auxv.begin() );
     }
     
     bool operator!=( const pvec_cgap &other ) const {
@@ -245,6 +201,13 @@ class probgap_model {
     double m_gap_freq;
     bool m_valid;
 
+    // see pmatrix: the matrices by branch length, in the order of their last use (least recently used first)
+    typedef std::list<std::pair<uint64_t, boost::numeric::ublas::matrix<double> > > pmatrix_lru;
+    const static size_t max_pmatrix_cache = 4096;
+    pmatrix_lru m_pmatrix_lru;
+    std::map<uint64_t, pmatrix_lru::iterator> m_pmatrix_cache;
+    ivy_mike::mutex m_pmatrix_mtx;
+
     double calc_gap_freq ( const std::vector< std::vector< uint8_t > > &seqs ) {
         size_t ngaps = 0;
         size_t nres = 0;
@@ -278,6 +241,12 @@ public:
     void reset( double gap_freq ) {
     	namespace ublas = boost::numeric::ublas;
 
+        {
+            ivy_mike::lock_guard<ivy_mike::mutex> lock( m_pmatrix_mtx );
+            m_pmatrix_cache.clear();
+            m_pmatrix_lru.clear();
+        }
+
     	m_gap_freq = gap_freq;
 		double f[2] = {m_gap_freq, 1-m_gap_freq};
     	        //double f[2] = {1-m_gap_freq, m_gap_freq};
@@ -334,6 +303,35 @@ public:
     }
 
 
+    // the same as setup_pmatrix, but computed only once per branch length: a tree has one length per edge, and the
+    // newviews of all edges (or the rebuilds in the stepwise addition tools) use the same ones over and over. The
+    // lengths are compared bitwise, so the result is exactly that of setup_pmatrix. Can be called concurrently.
+    // The cache keeps the max_pmatrix_cache most recently used lengths, so it does not grow without limit when the
+    // branch lengths keep changing (e.g., in stepwise addition). The matrix is returned by value, as it may be
+    // evicted by another thread.
+    boost::numeric::ublas::matrix<double> pmatrix( double t ) {
+        uint64_t key;
+        std::memcpy( &key, &t, sizeof(key) );
+
+        ivy_mike::lock_guard<ivy_mike::mutex> lock( m_pmatrix_mtx );
+
+        std::map<uint64_t, pmatrix_lru::iterator>::iterator it = m_pmatrix_cache.find( key );
+        if( it != m_pmatrix_cache.end() ) {
+            m_pmatrix_lru.splice( m_pmatrix_lru.end(), m_pmatrix_lru, it->second );
+            return it->second->second;
+        }
+
+        if( m_pmatrix_cache.size() >= max_pmatrix_cache ) {
+            m_pmatrix_cache.erase( m_pmatrix_lru.front().first );
+            m_pmatrix_lru.pop_front();
+        }
+
+        m_pmatrix_lru.push_back( std::make_pair( key, setup_pmatrix( t )));
+        m_pmatrix_cache.insert( std::make_pair( key, --m_pmatrix_lru.end() ));
+
+        return m_pmatrix_lru.back().second;
+    }
+
     inline double gap_freq() { return m_gap_freq; }
 
 };
@@ -343,12 +341,21 @@ class pvec_pgap {
     std::vector<parsimony_state> v;
     boost::numeric::ublas::matrix<double> gap_prob;
 
-    
+    // the gap model of the tree this vector belongs to. It is set on the tips by init2 and passed on to the inner
+    // vectors by newview, so vectors of different runs can use different models at the same time.
+    probgap_model *model_;
     
 public:
-    // WARNING WARNING WARNING: this is the stupid_pointer, used to inject a global probgap_model into class pvec_pgap
+    // WARNING WARNING WARNING: this is the stupid_pointer, used to inject a global probgap_model into class pvec_pgap.
+    // Only used for vectors without a model of their own (i.e., by the tools that do not pass one to init2).
     static ivy_mike::stupid_ptr<probgap_model> pgap_model;
 
+    pvec_pgap() : model_(0) {}
+
+    inline probgap_model *model() const {
+        return model_ != 0 ? model_ : &*pgap_model;
+    }
+
     inline const std::vector<parsimony_state> &get_v() const {
         return v;
     }
@@ -384,8 +391,9 @@ public:
     }
 
     template<typename seq_model>
-    void init2( const std::vector<uint8_t> &seq, seq_model sm ) {
+    void init2( const std::vector<uint8_t> &seq, seq_model sm, probgap_model *pgap_model = 0 ) {
         //assert( v.size() == 0 );
+        model_ = pgap_model;
         v.resize(seq.size());
 
         std::transform( seq.begin(), seq.end(), v.begin(), seq_model::s2p );
@@ -418,110 +426,10 @@ public:
     	//std::cout << "newview: " << gap_prob.size1() << "\n";
     }
 
-    static void newview( pvec_pgap &p, const pvec_pgap &c1, const pvec_pgap &c2, double z1, double z2, ivy_mike::tip_case tc ) {
-        namespace ublas = boost::numeric::ublas;
-            
-        assert( c1.v.size() == c2.v.size() );
-
-        if( c1.v.size() != c2.v.size() ) {
-            std::cerr << "not equal: " << c1.size() << " " << c2.size() << "\n";
-            throw std::runtime_error( "newview: vectors have different lengths (illegal incremetal newview on modified data?)" );
-        }
-
-//         p.v.resize(0);
-        p.v.resize(c1.v.size());
-        //p.gap_prob.resize(2, c1.v.size());
-
-        assert( pgap_model.is_valid_ptr() );
-
-        ublas::matrix<double> p1 = pgap_model->setup_pmatrix(z1);
-        ublas::matrix<double> p2 = pgap_model->setup_pmatrix(z2);
-
-
-
-#if 1
-        ublas::matrix<double> t1 = ublas::prod(p1, c1.gap_prob);
-        ublas::matrix<double> t2 = ublas::prod(p2, c2.gap_prob);
-#else
-        ublas::matrix<double> t1(c1.gap_prob.size1(), c1.gap_prob.size2(),0 );
-        ublas::matrix<double> t2(c2.gap_prob.size1(), c2.gap_prob.size2(),0 );    
-        
-        {
-            double *p1x = p1.data().begin();
-            double *p2x = p2.data().begin();
-            
-            double *c1x = c1.gap_prob.data().begin();
-            double *c2x = c2.gap_prob.data().begin();
-            
-            double *t1bx = t1.data().begin();
-            double *t2bx = t2.data().begin();
-            
-            size_t m = p1.size2();
-            size_t n = c1.gap_prob.size2();
-            size_t k = p1.size1();
-            
-            cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 1, p1x, m, c1x, n, 1, t1bx, n);
-            cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 1, p2x, m, c2x, n, 1, t2bx, n);
-        }
-#endif   
-        p.gap_prob = ublas::element_prod( t1, t2 );
-
-
-        const static double twotothe256 = 115792089237316195423570985008687907853269984665640564039457584007913129639936.0;
-                                                     /*  2**256 (exactly)  */
-
-        const static double minlikelihood  = 1.0/twotothe256;
-
-        for( ublas::matrix<double>::iterator2 it = p.gap_prob.begin2(); it != p.gap_prob.end2(); ++it ) {
-        	double &p1 = *it;
-        	double &p2 = *(it.begin() + 1);
-
-        	if( fabs(p1) < minlikelihood && fabs(p2) < minlikelihood ) {
-//        		std::cout << "scale: " << p1 << " " << p2;
-
-        		p1 *= twotothe256;
-        		p2 *= twotothe256;
-
-
-//        		std::cout << " -> " << p1 << " " << p2 << "\n";
-        	}
-
-
-        }
-
-        //ublas::matrix< double >::const_iterator1 xxx = p.gap_prob.begin1();
-       // xxx.
-
-        //std::cout << "pvec: " << *xxx << "\n";
-
-//         ublas::matrix< double >::iterator1 tit1 = p.gap_prob.begin1();
-//
-//
-//         boost::io::ios_all_saver ioss(std::cout);
-//         std::cout << std::setprecision(2);
-//
-//         std::cout << std::left;
-//
-// //         std::transform( tit1.begin(), tit1.end(), tit1.begin(), log );
-//         std::copy( tit1.begin(), tit1.end(), std::ostream_iterator<double>(std::cout, " "));
-//         std::cout << "\n";
-//         ++tit1;
-// //         std::transform( tit1.begin(), tit1.end(), tit1.begin(), log );
-//         std::copy( tit1.begin(), tit1.end() + 4, std::ostream_iterator<double>(std::cout, " "));
-//         std::cout << "\n";
-
-
-        for( size_t i = 0; i < c1.v.size(); i++ ) {
-            parsimony_state ps = c1.v[i] & c2.v[i];
-
-            if( ps == 0 ) {
-                ps = c1.v[i] | c2.v[i];
-            }
-
-            //p.v.push_back( ps );
-            p.v[i] = ps;
-        }
-    }
+    // the gap probabilities are the product of the ones of the children, each multiplied with the P-matrix of its branch
+    // (rescaled by 2^256 when both get too small), the parsimony states are the intersection or union as in pvec_cgap.
+    // Works directly on the 2xN gap probability arrays, without ublas temporaries (see pvec.cpp).
+    static void newview( pvec_pgap &p, const pvec_pgap &c1, const pvec_pgap &c2, double z1, double z2, ivy_mike::tip_case tc ) ;
 
     inline size_t size() const {
         return v.size();
@@ -538,35 +446,49 @@ public:
     }
     
 
-    static inline double gap_posterior( double v1, double v2 ) {
-    	assert( pgap_model.is_valid_ptr() );
-    	//return v1 / (v1 + v2);
+    class gap_posterior {
+    public:
+        gap_posterior( double gap_freq ) : gap_freq_(gap_freq) {}
 
-    	v1 *= 1 - pgap_model->gap_freq();
-    //	throw std::runtime_error( "i think there is an error in this function. why v1 in the next line?");
-    	v2 *= pgap_model->gap_freq();
+        inline double operator()( double v1, double v2 ) const {
+            //return v1 / (v1 + v2);
 
-    	float v = float(v1 / (v1 + v2));
+            v1 *= 1 - gap_freq_;
+        //	throw std::runtime_error( "i think there is an error in this function. why v1 in the next line?");
+            v2 *= gap_freq_;
 
-    	if( v != v ) {
-     		std::cerr << "meeeeep: " << v1 << " " << v2 << "\n";
+            float v = float(v1 / (v1 + v2));
 
-     		throw std::runtime_error("bailing out.");
-    	}
+            if( v != v ) {
+                std::cerr << "meeeeep: " << v1 << " " << v2 << "\n";
 
-    	return v;
-    }
+                throw std::runtime_error("bailing out.");
+            }
+
+            return v;
+        }
+
+    private:
+        double gap_freq_;
+    };
+
+    class gap_ancestral_probability {
+    public:
+        gap_ancestral_probability( double gap_freq ) : gap_freq_(gap_freq) {}
 
-    static inline double gap_ancestral_probability( double v1, double v2 ) {
-		assert( pgap_model.is_valid_ptr() );
-		//return v1 / (v1 + v2);
+        inline double operator()( double v1, double v2 ) const {
+            //return v1 / (v1 + v2);
 
-		const double freq_ngap = 1 - pgap_model->gap_freq();
-		const double freq_gap = pgap_model->gap_freq();
+            const double freq_ngap = 1 - gap_freq_;
+            const double freq_gap = gap_freq_;
 
 
-		return v2 * freq_gap / (v1 * freq_ngap + v2 * freq_gap);
-	}
+            return v2 * freq_gap / (v1 * freq_ngap + v2 * freq_gap);
+        }
+
+    private:
+        double gap_freq_;
+    };
 
 
 
@@ -577,14 +499,14 @@ public:
     	outv.clear();
     	outv.resize(v.size());
 
-    	ivy_mike::binary_twizzle(t.begin2(), t.end2(), (t.begin1() + 1).begin(), outv.begin(), gap_posterior );
+    	ivy_mike::binary_twizzle(t.begin2(), t.end2(), (t.begin1() + 1).begin(), outv.begin(), gap_posterior( model()->gap_freq() ));
 
     }
    
     template<typename oiter>
     inline void to_ancestral_gap_prob( oiter it ) {
     	const boost::numeric::ublas::matrix<double> &t = get_pgap();
-    	std::transform(t.begin2(), t.end2(), (t.begin1() + 1).begin(), it, gap_ancestral_probability );
+    	std::transform(t.begin2(), t.end2(), (t.begin1() + 1).begin(), it, gap_ancestral_probability( model()->gap_freq() ));
     }
 
 
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+#include "scoring_kernel.h"
+
+using namespace papara;
+
+namespace {
+
+#ifdef _MSC_VER
+// msvc has no __builtin_cpu_supports: check the cpuid feature bits and that the os saves the wide registers (xgetbv)
+bool cpu_supports( kernel_isa isa ) {
+    int regs[4];
+    __cpuid( regs, 0 );
+    const int max_leaf = regs[0];
+
+    __cpuid( regs, 1 );
+    const bool sse41 = (regs[2] & (1 << 19)) != 0;
+    const bool osxsave = (regs[2] & (1 << 27)) != 0;
+
+    if( isa == isa_sse41 ) {
+        return sse41;
+    }
+
+    if( !osxsave || max_leaf < 7 ) {
+        return false;
+    }
+
+    const unsigned long long xcr0 = _xgetbv( 0 );
+    __cpuidex( regs, 7, 0 );
+
+    const bool ymm_enabled = (xcr0 & 0x6) == 0x6;
+    const bool zmm_enabled = (xcr0 & 0xe6) == 0xe6;
+
+    if( isa == isa_avx2 ) {
+        return ymm_enabled && (regs[1] & (1 << 5)) != 0;
+    } else {
+        return zmm_enabled && (regs[1] & (1 << 30)) != 0;
+    }
+}
+#else
+bool cpu_supports( kernel_isa isa ) {
+    __builtin_cpu_init();
+
+    switch( isa ) {
+    case isa_sse41:
+        return __builtin_cpu_supports( "sse4.1" );
+    case isa_avx2:
+        return __builtin_cpu_supports( "avx2" );
+    case isa_avx512bw:
+        return __builtin_cpu_supports( "avx512bw" );
+    }
+
+    return false;
+}
+#endif
+
+}
+
+const char *papara::kernel_isa_name( kernel_isa isa ) {
+    switch( isa ) {
+    case isa_sse41:
+        return "sse41";
+    case isa_avx2:
+        return "avx2";
+    case isa_avx512bw:
+        return "avx512bw";
+    }
+
+    return "unknown";
+}
+
+
+kernel_isa papara::select_kernel_isa( const char *force ) {
+    kernel_isa best;
+
+    if( cpu_supports( isa_avx512bw ) ) {
+        best = isa_avx512bw;
+    } else if( cpu_supports( isa_avx2 ) ) {
+        best = isa_avx2;
+    } else if( cpu_supports( isa_sse41 ) ) {
+        best = isa_sse41;
+    } else {
+        throw std::runtime_error( "papara requires a cpu with at least SSE4.1 support" );
+    }
+
+    if( force != 0 && *force != 0 ) {
+        const kernel_isa all[] = { isa_sse41, isa_avx2, isa_avx512bw };
+
+        for( size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i ) {
+            if( std::strcmp( force, kernel_isa_name( all[i] )) == 0 && all[i] <= best ) {
+                return all[i];
+            }
+        }
+
+        throw std::runtime_error( std::string( "unknown or unsupported scoring kernel: " ) + force );
+    }
+
+    return best;
+}
+
+std::unique_ptr<scoring_kernel> papara::create_scoring_kernel( kernel_isa isa, score_bits bits, int match, int match_cgap, int gap_open, int gap_extend ) {
+    switch( isa ) {
+    case isa_sse41:
+        return std::unique_ptr<scoring_kernel>( create_scoring_kernel_sse41( bits, match, match_cgap, gap_open, gap_extend ));
+    case isa_avx2:
+        return std::unique_ptr<scoring_kernel>( create_scoring_kernel_avx2( bits, match, match_cgap, gap_open, gap_extend ));
+    case isa_avx512bw:
+        return std::unique_ptr<scoring_kernel>( create_scoring_kernel_avx512bw( bits, match, match_cgap, gap_open, gap_extend ));
+    }
+
+    throw std::runtime_error( "create_scoring_kernel: bad kernel_isa" );
+}
+
+std::unique_ptr<query_scoring_kernel> papara::create_query_scoring_kernel( kernel_isa isa, score_bits bits, int match, int match_cgap, int gap_open, int gap_extend ) {
+    switch( isa ) {
+    case isa_sse41:
+        return std::unique_ptr<query_scoring_kernel>( create_query_scoring_kernel_sse41( bits, match, match_cgap, gap_open, gap_extend ));
+    case isa_avx2:
+        return std::unique_ptr<query_scoring_kernel>( create_query_scoring_kernel_avx2( bits, match, match_cgap, gap_open, gap_extend ));
+    case isa_avx512bw:
+        return std::unique_ptr<query_scoring_kernel>( create_query_scoring_kernel_avx512bw( bits, match, match_cgap, gap_open, gap_extend ));
+    }
+
+    throw std::runtime_error( "create_query_scoring_kernel: bad kernel_isa" );
+}
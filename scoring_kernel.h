@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __scoring_kernel_h
+#define __scoring_kernel_h
+
+#include <cstddef>
+#include <stdint.h>
+#include <memory>
+
+// Interface between the (portable) driver code and the vectorized scoring kernel (pvec_aligner_vec).
+// The kernel is compiled once per instruction set in its own translation unit (scoring_kernel_<isa>.cpp), which
+// are the only files built with the corresponding -m flags. The best one is chosen at runtime, so that a binary
+// built on one machine does not crash with an illegal instruction on an older one.
+// Keep this header free of intrinsics and heavy includes: it is shared between code compiled for different targets.
+
+namespace papara {
+
+enum kernel_isa {
+    isa_sse41,
+    isa_avx2,
+    isa_avx512bw
+};
+
+const char *kernel_isa_name( kernel_isa isa );
+
+// the best kernel supported by the cpu, or the one named by force (sse41, avx2 or avx512bw, see kernel_isa_name), which
+// must be supported by the cpu (mostly useful for benchmarking/debugging). Throws for unknown or unsupported names.
+kernel_isa select_kernel_isa( const char *force = 0 );
+
+// score precisions of the kernels. Narrower scores mean more lanes per register (e.g., 16/8/4 edges per SSE register).
+// The 8bit kernels use saturating arithmetic and a per query bias and report saturation, the 16bit ones are
+// only used for queries that cannot overflow (see max_query_len), the 32bit ones are the last resort.
+enum score_bits {
+    score_8bit = 8,
+    score_16bit = 16,
+    score_32bit = 32
+};
+
+// aligns a query against a block of width() ancestral state vectors at a time.
+class scoring_kernel {
+public:
+    virtual ~scoring_kernel() {}
+
+    // number of reference edges aligned in parallel
+    virtual size_t width() const = 0;
+
+    // queries up to this length can be aligned without the scores leaving the range of the score type
+    // (for 8bit kernels this only guarantees the lower limit, the upper one is detected by align. Queries that would
+    // almost certainly exceed the upper one are not accepted either, see scoring_kernel_impl).
+    virtual size_t max_query_len() const = 0;
+
+    // build the profile for the next block. seqptrs/auxptrs must contain width() entries of reflen elements.
+    // cstate_map maps each of the num_cstates query c-states to its parsimony state bit-vector.
+    virtual void init_block( const int **seqptrs, const unsigned int **auxptrs, size_t reflen, const int *cstate_map, size_t num_cstates ) = 0;
+
+    // align query [b_start,b_end) (in c-state representation) against the current block and write width() scores
+    // to out. If a_start_idx/a_end_idx are -1 the full reference is used. If end_cols is non-null, the columns in which
+    // the best alignments end are written there (see pvec_aligner_vec::align).
+    // Returns false if the scores saturated, in which case out is undefined and the query has to be re-scored with
+    // a wider score type.
+    // The dp state after the num_checkpoint_rows (increasing) checkpoint_rows is kept for later queries of the same block
+    // that start with the same characters, which then skip these rows (see pvec_aligner_vec::align).
+    virtual bool align( const uint8_t *b_start, const uint8_t *b_end, size_t a_start_idx, size_t a_end_idx, int *out, size_t *end_cols, const size_t *checkpoint_rows, size_t num_checkpoint_rows ) = 0;
+
+    virtual uint64_t ticks_all() const = 0;
+    virtual uint64_t inner_iters_all() const = 0;
+};
+
+// the query-striped counterpart of scoring_kernel: aligns width() queries at a time against a single ancestral state
+// vector (pvec_aligner_vec_qs). Used when there are fewer reference edges than queries (e.g., small trees), where
+// the edge-striped kernel would leave most of the lanes idle. Only 16 and 32bit scores are supported.
+class query_scoring_kernel {
+public:
+    virtual ~query_scoring_kernel() {}
+
+    // number of queries aligned in parallel
+    virtual size_t width() const = 0;
+
+    // see scoring_kernel::max_query_len. Longer queries are rejected by align.
+    virtual size_t max_query_len() const = 0;
+
+    // set the ancestral state vector (reflen elements) for the following calls to align.
+    virtual void init_edge( const int *seqptr, const unsigned int *auxptr, size_t reflen, const int *cstate_map, size_t num_cstates ) = 0;
+
+    // align the num <= width() queries [b_starts[i], b_starts[i] + b_lens[i]) against the current edge and write num scores to out.
+    // Returns false (leaving out undefined) if one of the queries is longer than max_query_len().
+    virtual bool align( const uint8_t * const *b_starts, const size_t *b_lens, size_t num, int *out ) = 0;
+
+    virtual uint64_t ticks_all() const = 0;
+    virtual uint64_t inner_iters_all() const = 0;
+};
+
+std::unique_ptr<scoring_kernel> create_scoring_kernel( kernel_isa isa, score_bits bits, int match, int match_cgap, int gap_open, int gap_extend );
+std::unique_ptr<query_scoring_kernel> create_query_scoring_kernel( kernel_isa isa, score_bits bits, int match, int match_cgap, int gap_open, int gap_extend );
+
+
+// per instruction set factories. Only to be called after checking for cpu support (i.e., through create_scoring_kernel)
+scoring_kernel *create_scoring_kernel_sse41( score_bits bits, int match, int match_cgap, int gap_open, int gap_extend );
+scoring_kernel *create_scoring_kernel_avx2( score_bits bits, int match, int match_cgap, int gap_open, int gap_extend );
+scoring_kernel *create_scoring_kernel_avx512bw( score_bits bits, int match, int match_cgap, int gap_open, int gap_extend );
+
+query_scoring_kernel *create_query_scoring_kernel_sse41( score_bits bits, int match, int match_cgap, int gap_open, int gap_extend );
+query_scoring_kernel *create_query_scoring_kernel_avx2( score_bits bits, int match, int match_cgap, int gap_open, int gap_extend );
+query_scoring_kernel *create_query_scoring_kernel_avx512bw( score_bits bits, int match, int match_cgap, int gap_open, int gap_extend );
+
+}
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __scoring_kernel_impl_h
+#define __scoring_kernel_impl_h
+
+// only to be included by the scoring_kernel_<isa>.cpp files. Everything in here must have internal linkage (i.e.,
+// live in the anonymous namespace, like stepwise_align.h), otherwise the linker could merge code compiled for
+// different instruction sets.
+
+#include "scoring_kernel.h"
+#include "stepwise_align.h"
+
+#include <algorithm>
+
+namespace {
+
+// value bounds of the dp-matrix cells of pvec_aligner_vec, which decide if a query can be aligned with a given score type:
+// - every path can only gain 'max_gain' per query character (match/cgap scores, gaps are penalties), so the
+//   scores of a query of length n are <= n * max_gain.
+// - the main-cell in row r is at least as good as opening a gap at the top and extending it down to row r (and the
+//   stored gap-cells are at most another gap-open below), so all cells are >= 2 * gap_open + n * gap_extend.
+struct cell_bounds {
+    cell_bounds( int match, int match_cgap, int gap_open, int gap_extend )
+      : max_gain( std::max( std::max( 0, match ), std::max( match_cgap, match + match_cgap ))),
+        min_step( std::min( std::min( 0, match_cgap ), std::min( match + match_cgap, std::min( gap_open, gap_extend )))),
+        gap_open_( gap_open ),
+        gap_extend_( gap_extend ),
+        valid( gap_open <= 0 && gap_extend <= 0 )
+    {}
+
+    int64_t lower( size_t n ) const {
+        return 2 * int64_t(gap_open_) + int64_t(gap_extend_) * int64_t(n);
+    }
+
+    int64_t upper( size_t n ) const {
+        return int64_t(max_gain) * int64_t(n);
+    }
+
+    // largest n with lower(n) >= limit
+    size_t max_len_lower( int64_t limit ) const {
+        if( lower(0) < limit ) {
+            return 0;
+        } else if( gap_extend_ == 0 ) {
+            return unlimited();
+        } else {
+            return size_t((lower(0) - limit) / -int64_t(gap_extend_));
+        }
+    }
+
+    // largest n with upper(n) <= limit
+    size_t max_len_upper( int64_t limit ) const {
+        if( max_gain == 0 ) {
+            return unlimited();
+        } else {
+            return size_t(limit / max_gain);
+        }
+    }
+
+    // largest n with upper(n) - lower(n) <= limit
+    size_t max_len_span( int64_t limit ) const {
+        const int64_t span0 = upper(0) - lower(0);
+        const int64_t span_step = int64_t(max_gain) - int64_t(gap_extend_);
+
+        if( span0 > limit ) {
+            return 0;
+        } else if( span_step == 0 ) {
+            return unlimited();
+        } else {
+            return size_t((limit - span0) / span_step);
+        }
+    }
+
+    static size_t unlimited() {
+        return size_t(-1) / 2;
+    }
+
+    const int max_gain;
+    const int min_step;
+private:
+    const int gap_open_;
+    const int gap_extend_;
+public:
+    const bool valid;
+};
+
+
+template<typename score_t, size_t W>
+class scoring_kernel_impl : public papara::scoring_kernel {
+    typedef vector_unit<score_t,W> vu;
+
+    // the 8bit vector units use saturating arithmetic. The scores are biased per query to use the whole range, and
+    // overflows of the upper limit are detected after the fact. The wider ones wrap around, so for them the query
+    // length is limited in advance to the range where nothing can overflow.
+    const static bool saturating = sizeof(score_t) == 1;
+
+public:
+    scoring_kernel_impl( int match, int match_cgap, int gap_open, int gap_extend )
+      : out_scores_(W),
+        cell_max_(W),
+        bounds_( match, match_cgap, gap_open, gap_extend ),
+        match_(match),
+        match_cgap_(match_cgap),
+        gap_open_(gap_open),
+        gap_extend_(gap_extend),
+        max_query_len_(0),
+        ticks_all_(0),
+        inner_iters_all_(0)
+    {
+        if( !bounds_.valid ) {
+            // positive gap scores: no bounds. Only the widest score type is used (as before the adaptive precision)
+            max_query_len_ = sizeof(score_t) >= sizeof(int) ? cell_bounds::unlimited() : 0;
+        } else if( !fits( match ) || !fits( match_cgap ) || !fits( gap_open ) || !fits( gap_extend ) ) {
+            max_query_len_ = 0;
+        } else if( saturating ) {
+            // all real cell values have to stay above SMALL_VALUE (=the saturated lower limit) after biasing,
+            // so that they still win against the 'minus infinity' gap-cells.
+            // The upper limit is only detected after the fact, but the scores of well matching queries are close to
+            // upper(n): once the span of the cell bounds exceeds the biased range by more than a small tolerance,
+            // practically every such query saturates and its 8bit pass is wasted, so these go to 16bit right away.
+            const int64_t range = int64_t(vu::POS_MAX_VALUE) - (int64_t(vu::SMALL_VALUE) + 1);
+            max_query_len_ = std::min( bounds_.max_len_lower( int64_t(vu::SMALL_VALUE) + 1 - int64_t(vu::POS_MAX_VALUE) ), bounds_.max_len_span( range + range / 8 ));
+        } else {
+            // real cell values (and the candidates computed from them) must not wrap around, and must stay above SMALL_VALUE.
+            max_query_len_ = std::min( bounds_.max_len_lower( int64_t(vu::SMALL_VALUE) + 1 - bounds_.min_step ), bounds_.max_len_upper( vu::POS_MAX_VALUE ));
+        }
+    }
+
+    size_t width() const {
+        return W;
+    }
+
+    size_t max_query_len() const {
+        return max_query_len_;
+    }
+
+    void init_block( const int **seqptrs, const unsigned int **auxptrs, size_t reflen, const int *cstate_map, size_t num_cstates ) {
+        flush_counters();
+
+        pav_.reset( new pvec_aligner_vec<score_t,W>( seqptrs, auxptrs, reflen, match_, match_cgap_, gap_open_, gap_extend_, table_map(cstate_map), num_cstates ));
+    }
+
+    bool align( const uint8_t *b_start, const uint8_t *b_end, size_t a_start_idx, size_t a_end_idx, int *out, size_t *end_cols, const size_t *checkpoint_rows, size_t num_checkpoint_rows ) {
+        assert( pav_.get() != 0 );
+
+        const size_t qlen = std::distance( b_start, b_end );
+
+        if( qlen > max_query_len_ ) {
+            return false;
+        }
+
+        score_t bias = 0;
+        if( saturating ) {
+            // shift the lowest possible cell value to SMALL_VALUE + 1
+            bias = score_t( int64_t(vu::SMALL_VALUE) + 1 - bounds_.lower( qlen ));
+        }
+
+        pav_->align( b_start, b_end, match_, match_cgap_, gap_open_, gap_extend_, out_scores_.begin(), a_start_idx, a_end_idx, bias, saturating ? cell_max_.data() : 0, end_cols, checkpoint_rows, num_checkpoint_rows );
+
+        if( saturating ) {
+            for( size_t i = 0; i < W; ++i ) {
+                if( cell_max_[i] == vu::POS_MAX_VALUE ) {
+                    return false;
+                }
+            }
+        }
+
+        for( size_t i = 0; i < W; ++i ) {
+            out[i] = int(out_scores_[i]) - int(bias);
+        }
+
+        return true;
+    }
+
+    uint64_t ticks_all() const {
+        return ticks_all_ + (pav_.get() != 0 ? pav_->ticks_all() : 0);
+    }
+
+    uint64_t inner_iters_all() const {
+        return inner_iters_all_ + (pav_.get() != 0 ? pav_->inner_iters_all() : 0);
+    }
+
+private:
+    struct table_map {
+        table_map( const int *t ) : t_(t) {}
+
+        int operator()( size_t i ) const {
+            return t_[i];
+        }
+
+        const int *t_;
+    };
+
+    static bool fits( int v ) {
+        return v >= vu::SMALL_VALUE && v <= vu::POS_MAX_VALUE;
+    }
+
+    void flush_counters() {
+        if( pav_.get() != 0 ) {
+            ticks_all_ += pav_->ticks_all();
+            inner_iters_all_ += pav_->inner_iters_all();
+        }
+    }
+
+    std::unique_ptr<pvec_aligner_vec<score_t,W> > pav_;
+    typename pvec_aligner_vec<score_t,W>::buffer_t out_scores_;
+    typename pvec_aligner_vec<score_t,W>::buffer_t cell_max_;
+
+    const cell_bounds bounds_;
+
+    const score_t match_;
+    const score_t match_cgap_;
+    const score_t gap_open_;
+    const score_t gap_extend_;
+
+    size_t max_query_len_;
+
+    uint64_t ticks_all_;
+    uint64_t inner_iters_all_;
+};
+
+template<typename score_t, size_t W>
+papara::scoring_kernel *new_scoring_kernel( int match, int match_cgap, int gap_open, int gap_extend ) {
+    return new scoring_kernel_impl<score_t,W>( match, match_cgap, gap_open, gap_extend );
+}
+
+
+template<typename score_t, size_t W>
+class query_scoring_kernel_impl : public papara::query_scoring_kernel {
+    typedef vector_unit<score_t,W> vu;
+
+public:
+    query_scoring_kernel_impl( int match, int match_cgap, int gap_open, int gap_extend )
+      : out_scores_(W),
+        bounds_( match, match_cgap, gap_open, gap_extend ),
+        match_(match),
+        match_cgap_(match_cgap),
+        gap_open_(gap_open),
+        gap_extend_(gap_extend),
+        max_query_len_(0),
+        ticks_all_(0),
+        inner_iters_all_(0)
+    {
+        // same limits as for the (non-saturating) edge-striped kernels. The rows past the end of the shorter queries in a
+        // group are within the same bounds, as long as the longest query is.
+        if( !bounds_.valid ) {
+            max_query_len_ = sizeof(score_t) >= sizeof(int) ? cell_bounds::unlimited() : 0;
+        } else if( !fits( match ) || !fits( match_cgap ) || !fits( gap_open ) || !fits( gap_extend ) ) {
+            max_query_len_ = 0;
+        } else {
+            max_query_len_ = std::min( bounds_.max_len_lower( int64_t(vu::SMALL_VALUE) + 1 - bounds_.min_step ), bounds_.max_len_upper( vu::POS_MAX_VALUE ));
+        }
+    }
+
+    size_t width() const {
+        return W;
+    }
+
+    size_t max_query_len() const {
+        return max_query_len_;
+    }
+
+    void init_edge( const int *seqptr, const unsigned int *auxptr, size_t reflen, const int *cstate_map, size_t num_cstates ) {
+        flush_counters();
+
+        pav_.reset( new pvec_aligner_vec_qs<score_t,W>( seqptr, auxptr, reflen, match_, match_cgap_, table_map(cstate_map), num_cstates ));
+    }
+
+    bool align( const uint8_t * const *b_starts, const size_t *b_lens, size_t num, int *out ) {
+        assert( pav_.get() != 0 );
+        assert( num <= W );
+
+        for( size_t i = 0; i < num; ++i ) {
+            if( b_lens[i] > max_query_len_ ) {
+                return false;
+            }
+        }
+
+        pav_->align( b_starts, b_lens, num, gap_open_, gap_extend_, out_scores_.begin() );
+
+        for( size_t i = 0; i < num; ++i ) {
+            out[i] = out_scores_[i];
+        }
+
+        return true;
+    }
+
+    uint64_t ticks_all() const {
+        return ticks_all_ + (pav_.get() != 0 ? pav_->ticks_all() : 0);
+    }
+
+    uint64_t inner_iters_all() const {
+        return inner_iters_all_ + (pav_.get() != 0 ? pav_->inner_iters_all() : 0);
+    }
+
+private:
+    struct table_map {
+        table_map( const int *t ) : t_(t) {}
+
+        int operator()( size_t i ) const {
+            return t_[i];
+        }
+
+        const int *t_;
+    };
+
+    static bool fits( int v ) {
+        return v >= vu::SMALL_VALUE && v <= vu::POS_MAX_VALUE;
+    }
+
+    void flush_counters() {
+        if( pav_.get() != 0 ) {
+            ticks_all_ += pav_->ticks_all();
+            inner_iters_all_ += pav_->inner_iters_all();
+        }
+    }
+
+    std::unique_ptr<pvec_aligner_vec_qs<score_t,W> > pav_;
+    typename pvec_aligner_vec_qs<score_t,W>::buffer_t out_scores_;
+
+    const cell_bounds bounds_;
+
+    const score_t match_;
+    const score_t match_cgap_;
+    const score_t gap_open_;
+    const score_t gap_extend_;
+
+    size_t max_query_len_;
+
+    uint64_t ticks_all_;
+    uint64_t inner_iters_all_;
+};
+
+template<typename score_t, size_t W>
+papara::query_scoring_kernel *new_query_scoring_kernel( int match, int match_cgap, int gap_open, int gap_extend ) {
+    return new query_scoring_kernel_impl<score_t,W>( match, match_cgap, gap_open, gap_extend );
+}
+
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// scoring kernels for SSE4.1 (128bit registers: 16/8/4 edges per block with 8/16/32bit scores)
+
+#if !defined(__SSE4_1__) && !defined(_MSC_VER)
+#error "scoring_kernel_sse41.cpp must be compiled with -msse4.1"
+#endif
+
+#include "scoring_kernel_impl.h"
+
+papara::scoring_kernel *papara::create_scoring_kernel_sse41( score_bits bits, int match, int match_cgap, int gap_open, int gap_extend ) {
+    switch( bits ) {
+    case score_8bit:
+        return new_scoring_kernel<signed char,16>( match, match_cgap, gap_open, gap_extend );
+    case score_16bit:
+        return new_scoring_kernel<short,8>( match, match_cgap, gap_open, gap_extend );
+    case score_32bit:
+        return new_scoring_kernel<int,4>( match, match_cgap, gap_open, gap_extend );
+    }
+
+    throw std::runtime_error( "create_scoring_kernel_sse41: bad score_bits" );
+}
+
+papara::query_scoring_kernel *papara::create_query_scoring_kernel_sse41( score_bits bits, int match, int match_cgap, int gap_open, int gap_extend ) {
+    switch( bits ) {
+    case score_8bit:
+        break;
+    case score_16bit:
+        return new_query_scoring_kernel<short,8>( match, match_cgap, gap_open, gap_extend );
+    case score_32bit:
+        return new_query_scoring_kernel<int,4>( match, match_cgap, gap_open, gap_extend );
+    }
+
+    throw std::runtime_error( "create_query_scoring_kernel_sse41: bad score_bits" );
+}
@@ -25,6 +25,11 @@
 #include <ostream>
 #include <iterator>
 #include <cassert>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <deque>
+#include <vector>
 
 #include "ivymike/aligned_buffer.h"
 #include "ivymike/fasta.h"
@@ -599,16 +604,36 @@ inline void align_pvec_score_vec( ivy_mike::aligned_buffer<score_t> &a_prof, ivy
 //
 
 
+// allocator for the buffers of pvec_aligner_vec. Its only purpose is to have internal linkage: pvec_aligner_vec is compiled
+// for several instruction sets (see scoring_kernel_impl.h). With the default allocator, the out-of-line std::vector members
+// would be weak symbols shared with all other translation units, and the linker could pick e.g., the AVX-512 version.
+template<typename T>
+class kernel_alloc : public ivy_mike::ab_internal_::alloc<T,4096> {
+public:
+    template<typename O>
+    struct rebind {
+        typedef kernel_alloc<O> other;
+    };
+
+    kernel_alloc() {}
+
+    template<typename O>
+    kernel_alloc( const kernel_alloc<O> & ) {}
+};
+
 template<typename score_t, size_t W>
 class pvec_aligner_vec {
 public:
     typedef vector_unit<score_t,W> vu;
     typedef typename vu::vec_t vec_t;
+    typedef typename vu::mask_t mask_t;
+    typedef ivy_mike::aligned_buffer<score_t, 4096, kernel_alloc<score_t> > buffer_t;
 
 
     template<typename mapf>
     pvec_aligner_vec( const int *seqptrs[W], const unsigned int *auxptrs[W], size_t reflen, const score_t match_score_sc, const score_t match_cgap_sc, const score_t gap_open_sc, const score_t gap_extend_sc, mapf map, size_t nstates )
-     : pvec_prof_( W * reflen ),
+     : num_ckpts_(0),
+       pvec_prof_( W * reflen ),
        aux_prof_( W * reflen ),
        sm_inc_prof_( W * reflen * nstates ),
        num_cstates_(nstates),
@@ -620,8 +645,8 @@ public:
     {
 
 
-        typename ivy_mike::aligned_buffer<score_t>::iterator it = pvec_prof_.begin();
-        typename ivy_mike::aligned_buffer<score_t>::iterator ait = aux_prof_.begin();
+        typename buffer_t::iterator it = pvec_prof_.begin();
+        typename buffer_t::iterator ait = aux_prof_.begin();
 //        typename aligned_buffer<score_t>::iterator oit = gap_open_cgap_prof_.begin();
 //        typename aligned_buffer<score_t>::iterator eit = gap_extend_cgap_prof_.begin();
 
@@ -646,10 +671,10 @@ public:
         assert( match_cgap_sc + match_score_sc < 0 );
 //        assert( W == 8 );
         for( size_t i = 0; i < nstates; i++ ) {
-            typename ivy_mike::aligned_buffer<score_t>::iterator it = sm_inc_prof_.begin() + i * reflen * W;
+            typename buffer_t::iterator it = sm_inc_prof_.begin() + i * reflen * W;
 
-            typename ivy_mike::aligned_buffer<score_t>::iterator pit = pvec_prof_.begin();
-            typename ivy_mike::aligned_buffer<score_t>::iterator ait = aux_prof_.begin();
+            typename buffer_t::iterator pit = pvec_prof_.begin();
+            typename buffer_t::iterator ait = aux_prof_.begin();
             score_t bc = map(i);
             for( size_t j = 0; j < reflen * W; ++j, ++it, ++pit, ++ait ) {
                 bool match = (bc & *pit) != 0;
@@ -671,8 +696,23 @@ public:
     }
 
 
+    // bias is the (stored) value of a zero score, i.e., all scores are shifted by bias. This is used to make the most out of
+    // the representable range with the (saturating) 8bit vector units.
+    // If cell_max_out is non-null, the maximum over all main-cells of the dp-matrix is stored there, which can be
+    // used to detect saturation (the output scores can be lower than the saturated cells they stem from).
+    // If end_col_out is non-null, the column in which the best alignment of each lane ends is stored there: the first
+    // column of the last row with the best score, or the last column if the best score is (also) reached there. This is
+    // the end cell that align_freeshift_pvec chooses, and lets the traceback be restricted to a band (see
+    // align_freeshift_pvec_banded). The last row is scanned once per block of columns, so this adds nothing to the inner loop.
+    //
+    // Shared-prefix reuse: the state of the first k rows only depends on the first k query characters. After the rows
+    // listed in checkpoint_rows (increasing), the row state is kept in a stack of checkpoints. A later query that
+    // starts with the same characters (with the same bias and bounds) resumes from the deepest matching checkpoint
+    // instead of recomputing these rows. Checkpoints that do not match are dropped, so the queries should come in
+    // lexicographic order, with each query checkpointing the rows that the following ones share with it (see prefix_plan
+    // in papara.cpp). The results are the same as without checkpoints.
     template<typename biter, typename oiter>
-    inline void align( biter b_start, biter b_end, const score_t match_score_sc, const score_t match_cgap_sc, const score_t gap_open_sc, const score_t gap_extend_sc, oiter out_start, size_t a_start_idx = -1, size_t a_end_idx = -1 ) {
+    inline void align( biter b_start, biter b_end, const score_t match_score_sc, const score_t match_cgap_sc, const score_t gap_open_sc, const score_t gap_extend_sc, oiter out_start, size_t a_start_idx = -1, size_t a_end_idx = -1, const score_t bias = 0, score_t *cell_max_out = 0, size_t *end_col_out = 0, const size_t *checkpoint_rows = 0, size_t num_checkpoint_rows = 0 ) {
         
 //         aiter a_start, a_end, a_aux_start;
 //         
@@ -723,7 +763,9 @@ public:
         // overall size of a whole row of vectors (=length of 'a' * vector width)
         const size_t av_size_all = pvec_prof_.size();
 //         const size_t a_size_all = av_size_all / W;
-        const size_t block_width = 512;
+        // number of columns per block. Keep the number of cells (and thereby the cache footprint of s_/si_) constant,
+        // so that wider vector units (e.g., 16 lanes on AVX2) do not fall out of L1.
+        const size_t block_width = 4096 / W;
 //         assert( av_size >= block_width * W ); // the code below should handle this case, but is untested
 
         
@@ -746,12 +788,28 @@ public:
 
 
         const score_t SMALL = vu::SMALL_VALUE;
-        std::fill( s_.begin(), s_.end(), 0 );
+        std::fill( s_.begin(), s_.end(), bias );
         std::fill( si_.begin(), si_.end(), SMALL );
 //         si_[0] = 0;
 
 
-        vec_t max_score = vu::set1(SMALL);
+        // the rows before first_row are taken from the checkpoint. Apart from the last row (which is never shared), they
+        // contribute to max_score only through the last column, i.e., exactly like to last_col_max.
+        const checkpoint *resume = find_checkpoint( b_start, bsize, a_start_idx, a_end_idx, bias );
+        const size_t first_row = resume != 0 ? resume->rows : 0;
+
+        vec_t max_score = resume != 0 ? vu::load( resume->acc(0) ) : vu::set1(SMALL);
+        vec_t cell_max = resume != 0 ? vu::load( resume->acc(W) ) : vu::set1(SMALL);
+        vec_t last_col_max = max_score;
+
+        const size_t first_save = num_ckpts_;
+        push_checkpoints( b_start, bsize, a_start_idx, a_end_idx, bias, av_size_bound, first_row, checkpoint_rows, num_checkpoint_rows, resume );
+
+        // best main-cell of the last row per lane (for end_col_out)
+        score_t last_row_max[W];
+        size_t last_row_col[W];
+        std::fill( last_row_max, last_row_max + W, SMALL );
+        std::fill( last_row_col, last_row_col + W, a_end_idx - 1 );
 
         const vec_t zero = vu::setzero();
         const vec_t gap_extend = vu::set1(gap_extend_sc);
@@ -771,10 +829,10 @@ public:
     //
     //    std::vector<ali_score_block_t<vec_t> > blocks( bsize, btemp ); // TODO: maybe put this into the persistent state, if sbrk mucks up again.
 
-        typedef ivy_mike::aligned_buffer<score_t,4096> block_vec;
-        block_vec block_sdiag(bsize * W, 0);
+        typedef buffer_t block_vec;
+        block_vec block_sdiag(bsize * W, bias);
         block_vec block_sl(bsize * W, SMALL);
-        block_vec block_sc(bsize * W, 0);
+        block_vec block_sc(bsize * W, bias);
 
 
 
@@ -799,14 +857,14 @@ public:
 //             std::cout << "block start outer: " << block_start_outer << "\n";
 
 
-            std::fill( s_.begin(), s_.begin() + W * block_width, 0 );
+            std::fill( s_.begin(), s_.begin() + W * block_width, bias );
             std::fill( si_.begin(), si_.begin() + W * block_width, SMALL );
 
     //        typename std::vector<ali_score_block_t<vec_t> >::iterator it_block = blocks.begin();
 
-            typename block_vec::iterator block_sl_it = block_sl.begin();
-            typename block_vec::iterator block_sc_it = block_sc.begin();
-            typename block_vec::iterator block_sdiag_it = block_sdiag.begin();
+            typename block_vec::iterator block_sl_it = block_sl.begin() + first_row * W;
+            typename block_vec::iterator block_sc_it = block_sc.begin() + first_row * W;
+            typename block_vec::iterator block_sdiag_it = block_sdiag.begin() + first_row * W;
 
 
             size_t block_end = block_start_outer + block_width;
@@ -815,10 +873,23 @@ public:
                 block_end = a_end_idx;
             }
 
+            // offset of this block of columns in the (whole) rows stored in the checkpoints
+            const size_t ckpt_offset = (block_start_outer - a_start_idx) * W;
+            const size_t ckpt_size = (block_end - block_start_outer) * W;
 
-            biter it_b = b_start;
+            if( resume != 0 ) {
+                std::copy( resume->s.begin() + ckpt_offset, resume->s.begin() + ckpt_offset + ckpt_size, s_.begin() );
+                std::copy( resume->si.begin() + ckpt_offset, resume->si.begin() + ckpt_offset + ckpt_size, si_.begin() );
+            }
+
+            // contributions of the rows of this block to last_col_max/cell_max (for the checkpoints)
+            vec_t run_last_col_max = vu::set1(SMALL);
+            vec_t run_cell_max = vu::set1(SMALL);
+            size_t next_save = first_save;
 
-            inner_iters_all_ += std::distance(b_start, b_end) * (block_end - block_start_outer);
+            biter it_b = b_start + first_row;
+
+            inner_iters_all_ += (bsize - first_row) * (block_end - block_start_outer);
 
 
             for( ; it_b != b_end; ++it_b, block_sl_it += W, block_sc_it += W, block_sdiag_it += W ) {
@@ -890,7 +961,7 @@ public:
 
                     // match increase: sum of match and match_cgap score/penalty
                     const vec_t sm_inc = vu::load( sm_inc_iter );
-                    const vec_t cgap = vu::cmp_lt( sm_inc, zero ); // HACK: assume that match_score + match_cgap_penalty < 0
+                    const mask_t cgap = vu::cmp_lt( sm_inc, zero ); // HACK: assume that match_score + match_cgap_penalty < 0
 
 
                     // match score (last_sdiag is preloaded in the previous iteration)
@@ -947,10 +1018,27 @@ public:
 
                 if( done ) {
                     max_score = vu::max( max_score, last_sc );
+                    last_col_max = vu::max( last_col_max, last_sc );
+                    run_last_col_max = vu::max( run_last_col_max, last_sc );
                 }
                 if( lastrow ) {
                     max_score = vu::max( max_score, row_max_score );
                 }
+                cell_max = vu::max( cell_max, row_max_score );
+
+                if( next_save != num_ckpts_ ) {
+                    run_cell_max = vu::max( run_cell_max, row_max_score );
+
+                    checkpoint &c = ckpts_[next_save];
+                    if( c.rows == size_t(std::distance( b_start, it_b )) + 1 ) {
+                        std::copy( s_.begin(), s_.begin() + ckpt_size, c.s.begin() + ckpt_offset );
+                        std::copy( si_.begin(), si_.begin() + ckpt_size, c.si.begin() + ckpt_offset );
+
+                        vu::store( vu::max( vu::load( c.acc(0) ), run_last_col_max ), c.acc(0) );
+                        vu::store( vu::max( vu::load( c.acc(W) ), run_cell_max ), c.acc(W) );
+                        ++next_save;
+                    }
+                }
 
                 //*it_block = block;
 
@@ -963,6 +1051,18 @@ public:
             }
 
 
+            if( end_col_out != 0 ) {
+                // s_ now holds the last row of this block of columns
+                for( size_t i = 0; i < block_end - block_start_outer; ++i ) {
+                    for( size_t j = 0; j < W; ++j ) {
+                        if( s_[i * W + j] > last_row_max[j] ) {
+                            last_row_max[j] = s_[i * W + j];
+                            last_row_col[j] = block_start_outer + i;
+                        }
+                    }
+                }
+            }
+
             block_start_outer = block_end;
         }
 
@@ -971,6 +1071,20 @@ public:
         //
 
         vu::store( max_score, &(*out_start) );
+
+        if( cell_max_out != 0 ) {
+            vu::store( cell_max, cell_max_out );
+        }
+
+        if( end_col_out != 0 ) {
+            end_tmp_.resize( 2 * W );
+            vu::store( max_score, end_tmp_(0) );
+            vu::store( last_col_max, end_tmp_(W) );
+
+            for( size_t j = 0; j < W; ++j ) {
+                end_col_out[j] = (end_tmp_[W + j] == end_tmp_[j]) ? a_end_idx - 1 : last_row_col[j];
+            }
+        }
     }
 
 
@@ -993,12 +1107,77 @@ private:
         vec_t last_sc;
     };
 
-    ivy_mike::aligned_buffer<score_t> s_;
-    ivy_mike::aligned_buffer<score_t> si_;
+    // dp state after the first 'rows' rows of a query: the main- and gap-from-above cells of the whole (bounded) row,
+    // and last_col_max/cell_max of these rows in acc.
+    struct checkpoint {
+        size_t rows;
+        size_t a_start_idx;
+        size_t a_end_idx;
+        score_t bias;
+        std::vector<int> prefix;
+
+        buffer_t s;
+        buffer_t si;
+        buffer_t acc;
+    };
+
+    // pop the checkpoints from the stack until the top one can be used for query b
+    template<typename biter>
+    const checkpoint *find_checkpoint( biter b_start, size_t bsize, size_t a_start_idx, size_t a_end_idx, score_t bias ) {
+        for( ; num_ckpts_ > 0; --num_ckpts_ ) {
+            const checkpoint &c = ckpts_[num_ckpts_ - 1];
+
+            if( c.rows < bsize && c.bias == bias && c.a_start_idx == a_start_idx && c.a_end_idx == a_end_idx && std::equal( c.prefix.begin(), c.prefix.end(), b_start )) {
+                return &c;
+            }
+        }
+        return 0;
+    }
+
+    // push the checkpoints requested for query b (below first_row they already exist). The memory of the stack is limited,
+    // the deepest checkpoints are left out if it is full.
+    template<typename biter>
+    void push_checkpoints( biter b_start, size_t bsize, size_t a_start_idx, size_t a_end_idx, score_t bias, size_t av_size_bound, size_t first_row, const size_t *rows, size_t num_rows, const checkpoint *resume ) {
+        const size_t max_bytes = 4 * 1024 * 1024;
+        const size_t max_ckpts = std::max( size_t(1), max_bytes / (2 * std::max( av_size_bound, size_t(1) ) * sizeof(score_t)) );
+
+        for( size_t i = 0; i < num_rows && num_ckpts_ < max_ckpts; ++i ) {
+            if( rows[i] <= first_row || rows[i] > bsize ) {
+                continue;
+            }
+
+            if( num_ckpts_ == ckpts_.size() ) {
+                ckpts_.push_back( checkpoint() );
+            }
+
+            checkpoint &c = ckpts_[num_ckpts_++];
+            c.rows = rows[i];
+            c.a_start_idx = a_start_idx;
+            c.a_end_idx = a_end_idx;
+            c.bias = bias;
+            c.prefix.assign( b_start, b_start + rows[i] );
+            c.s.resize( av_size_bound );
+            c.si.resize( av_size_bound );
+            c.acc.resize( 2 * W );
+
+            if( resume != 0 ) {
+                std::copy( resume->acc.begin(), resume->acc.end(), c.acc.begin() );
+            } else {
+                std::fill( c.acc.begin(), c.acc.end(), score_t(vu::SMALL_VALUE) );
+            }
+        }
+    }
+
+    buffer_t s_;
+    buffer_t si_;
+    buffer_t end_tmp_;
 
-    ivy_mike::aligned_buffer<score_t> pvec_prof_;
-    ivy_mike::aligned_buffer<score_t> aux_prof_;
-    ivy_mike::aligned_buffer<score_t> sm_inc_prof_;
+    std::deque<checkpoint> ckpts_; // stack of the first num_ckpts_ entries (the others are kept for their buffers)
+    size_t num_ckpts_;
+
+    buffer_t pvec_prof_;
+    buffer_t aux_prof_;
+    buffer_t sm_inc_prof_;
     const size_t num_cstates_;
 
     uint64_t ticks_all_;
@@ -1019,211 +1198,437 @@ private:
 
 
 //
-// the 'full enchilada' aligner including traceback.
-// The freeshift/global implementations are currently separate mainly because they
-// act as reference for the optimized versions and I don't want to screw them up too much...
+// query-striped variant of pvec_aligner_vec: aligns up to W queries (one per lane) against a single ancestral state vector,
+// instead of one query against W of them. This keeps the lanes busy for trees with fewer edges than lanes.
+// The recurrences are exactly the same. The profile is built per query row and per class of reference column
+// (i.e., distinct parsimony state/cgap combination), and the rows beyond the end of a (shorter) query are masked out.
 //
 
-template<typename score_t>
-struct align_arrays_traceback {
-    ivy_mike::aligned_buffer<score_t> s;
-    ivy_mike::aligned_buffer<score_t> si;  
-    
-    std::vector<uint8_t> tb;
-};
+template<typename score_t, size_t W>
+class pvec_aligner_vec_qs {
+public:
+    typedef vector_unit<score_t,W> vu;
+    typedef typename vu::vec_t vec_t;
+    typedef typename vu::mask_t mask_t;
+    typedef ivy_mike::aligned_buffer<score_t, 4096, kernel_alloc<score_t> > buffer_t;
+    typedef ivy_mike::aligned_buffer<int, 4096, kernel_alloc<int> > int_buffer_t;
+
+    template<typename mapf>
+    pvec_aligner_vec_qs( const int *seqptr, const unsigned int *auxptr, size_t reflen, const score_t match_score_sc, const score_t match_cgap_sc, mapf map, size_t nstates )
+     : col_class_( reflen ),
+       match_score_(match_score_sc),
+       match_cgap_(match_cgap_sc),
+       num_cstates_(nstates),
+       ticks_all_(0),
+       inner_iters_all_(0)
+    {
+        assert( match_cgap_sc + match_score_sc < 0 );
 
+        cstate_map_.resize( nstates );
+        for( size_t i = 0; i < nstates; ++i ) {
+            cstate_map_[i] = map(i);
+        }
 
-template<typename score_t, typename aiter, typename auxiter, typename biter>
-score_t align_freeshift_pvec( aiter astart, aiter aend, auxiter auxstart, biter bstart, biter bend, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, std::vector<uint8_t>& tb_out, align_arrays_traceback<score_t> &arr ) {
+        // find the column classes with a small open addressing hash table (key: parsimony state * 2 + cgap flag)
+        size_t table_size = 64;
+        while( table_size < 2 * reflen ) {
+            table_size *= 2;
+        }
 
-    const uint8_t b_sl_stay = 0x1;
-    const uint8_t b_su_stay = 0x2;
-    const uint8_t b_s_l = 0x4;
-    const uint8_t b_s_u = 0x8;
+        int_buffer_t table( table_size, -1 );
 
+        for( size_t i = 0; i < reflen; ++i ) {
+            const int key = seqptr[i] * 2 + ((auxptr[i] == AUX_CGAP) ? 1 : 0);
 
-    const size_t asize = std::distance(astart, aend);
-    const size_t bsize = std::distance(bstart, bend);
+            size_t h = (size_t(key) * 2654435761u) & (table_size - 1);
+            while( table[h] != -1 && class_key_[table[h]] != key ) {
+                h = (h + 1) & (table_size - 1);
+            }
 
-    if( arr.s.size() < asize  ) {
-        arr.s.resize( asize );
-        arr.si.resize( asize );
+            if( table[h] == -1 ) {
+                table[h] = int(class_key_.size());
+                class_key_.push_back( key );
+            }
+
+            col_class_[i] = table[h];
+        }
     }
 
-    std::fill( arr.s.begin(), arr.s.end(), 0 );
-    std::fill( arr.si.begin(), arr.si.end(), 0 );
-    const score_t SMALL = -32000;
+    // align the queries [b_starts[i], b_starts[i] + b_lens[i]) for i < num <= W against the ancestral state vector.
+    // The scores of queries i >= num are undefined.
+    template<typename oiter>
+    inline void align( const uint8_t * const *b_starts, const size_t *b_lens, size_t num, const score_t gap_open_sc, const score_t gap_extend_sc, oiter out_start ) {
+        assert( num <= W );
 
-    score_t max_score = SMALL;
-    int max_a = 0;
-    int max_b = 0;
+        size_t bsize = 0;
+        for( size_t j = 0; j < num; ++j ) {
+            bsize = std::max( bsize, b_lens[j] );
+        }
 
-    arr.tb.resize( asize * bsize );
+        const size_t a_start_idx = 0;
+        const size_t a_end_idx = col_class_.size();
+        const size_t num_classes = class_key_.size();
 
+        const score_t SMALL = vu::SMALL_VALUE;
 
-    struct index_calc {
-        const size_t as, bs;
-        index_calc( size_t as_, size_t bs_ ) : as(as_), bs(bs_) {}
+        // build the profile: for each query row and column class the match score increase (row major, lanes innermost).
+        // Lanes past the end of their query get the 'no match' score, so that the cgap detection in the inner loop still works.
+        // row_valid / row_last mark the rows that belong to the query in each lane and its last row
+        prof_.resize( bsize * num_classes * W );
+        row_valid_.resize( bsize * W );
+        row_last_.resize( bsize * W );
 
-        size_t operator()(size_t ia, size_t ib ) {
-            assert( ia < as );
-            assert( ib < bs );
+        for( size_t i = 0; i < bsize; ++i ) {
+            for( size_t j = 0; j < W; ++j ) {
+                const bool valid = j < num && i < b_lens[j];
 
-            //return ia * bs + ib;
-            return ib * as + ia;
-        }
+                int bc = 0;
+                if( valid ) {
+                    assert( b_starts[j][i] < num_cstates_ );
+                    bc = cstate_map_[b_starts[j][i]];
+                }
 
-    };
+                row_valid_[i * W + j] = valid ? score_t(-1) : 0;
+                row_last_[i * W + j] = (valid && i == b_lens[j] - 1) ? score_t(-1) : 0;
 
-    index_calc ic( asize, bsize );
+                for( size_t k = 0; k < num_classes; ++k ) {
+                    const int key = class_key_[k];
+                    score_t sc = ((bc & (key / 2)) != 0) ? match_score_ : 0;
 
+                    if( (key & 1) != 0 ) {
+                        sc += match_cgap_;
+                    }
 
-    for( size_t ib = 0; ib < bsize; ib++ ) {
-        int bc = *(bstart + ib);
+                    prof_[(i * num_classes + k) * W + j] = sc;
+                }
+            }
+        }
 
-        score_t last_sl = SMALL;
-        score_t last_sc = score_t(0.0);
-        score_t last_sdiag = score_t(0.0);
+        const size_t block_width = 4096 / W;
 
-        score_t * __restrict s_iter = arr.s.base();
-        score_t * __restrict si_iter = arr.si.base();
-        score_t * __restrict s_end = s_iter + asize;
-        bool lastrow = ib == (bsize - 1);
+        const size_t av_size_bound = (a_end_idx - a_start_idx) * W;
+        const size_t av_minsize = std::max(av_size_bound, block_width * W);
 
-        //for( ; s_iter != s_end; s_iter += W, si_iter += W, qpp_iter += W ) {
+        s_.resize( av_minsize );
+        si_.resize( av_minsize );
 
-        for( size_t ia = 0; ia < asize; ++ia, ++s_iter, ++si_iter ) {
-            //score_t match = sm.get_score( a[ia], bc );
-            uint8_t tb_val = 0;
-            int ac = *(astart + ia);
-            const bool cgap = *(auxstart + ia)  == AUX_CGAP;
+        vec_t max_score = vu::set1(SMALL);
 
-                // determine match or mis-match according to parsimony bits coming from the tree.
-            score_t match = ( ac & bc ) != 0 ? match_score : 0;
+        const vec_t small = vu::set1(SMALL);
+        const vec_t zero = vu::setzero();
+        const vec_t gap_extend = vu::set1(gap_extend_sc);
+        const vec_t gap_open = vu::set1(gap_open_sc);
 
+        bool done = false;
 
+        buffer_t block_sdiag(bsize * W, 0);
+        buffer_t block_sl(bsize * W, SMALL);
+        buffer_t block_sc(bsize * W, 0);
 
-            score_t sm = last_sdiag + match;
+        size_t block_start_outer = a_start_idx;
 
-            last_sdiag = *s_iter;
+        ticks ticks1 = getticks();
 
-            score_t last_sc_OPEN;
-            score_t sl_score_stay;
+        while( !done ) {
+            std::fill( s_.begin(), s_.begin() + W * block_width, 0 );
+            std::fill( si_.begin(), si_.begin() + W * block_width, SMALL );
 
-            if( cgap ) {
-                last_sc_OPEN = last_sc;
-                sl_score_stay = last_sl;
-                sm += match_cgap;
-            } else {
-                last_sc_OPEN = last_sc + gap_open;
-                sl_score_stay = last_sl + gap_extend;
-            }
+            typename buffer_t::iterator block_sl_it = block_sl.begin();
+            typename buffer_t::iterator block_sc_it = block_sc.begin();
+            typename buffer_t::iterator block_sdiag_it = block_sdiag.begin();
 
-            score_t sl;
-            if( sl_score_stay > last_sc_OPEN ) {
-                sl = sl_score_stay;
-                //arr.sl_stay[ic(ia,ib)] = true;
-                tb_val |= b_sl_stay;
-            } else {
-                sl = last_sc_OPEN;
-            }
+            size_t block_end = block_start_outer + block_width;
 
-            last_sl = sl;
+            if( block_end > a_end_idx ) {
+                block_end = a_end_idx;
+            }
 
+            inner_iters_all_ += bsize * (block_end - block_start_outer);
 
-            score_t su_gap_open = last_sdiag + gap_open;
-            score_t su_GAP_EXTEND = *si_iter + gap_extend;
+            for( size_t ib = 0; ib != bsize; ++ib, block_sl_it += W, block_sc_it += W, block_sdiag_it += W ) {
+                vec_t row_max_score = vu::set1(SMALL);
 
-            score_t su;// = max( su_GAP_EXTEND,  );
-            if( su_GAP_EXTEND > su_gap_open ) {
-                su = su_GAP_EXTEND;
-                //arr.su_stay[ic(ia,ib)] = true;
-                tb_val |= b_su_stay;
-            } else {
-                su = su_gap_open;
-            }
+                const size_t block_start = block_start_outer;
 
+                score_t * s_iter = s_.base();
+                score_t * si_iter = si_.base();
 
-            *si_iter = su;
+                const score_t * const row_prof = &prof_[ib * num_classes * W];
+                const int * class_iter = &col_class_[0] + block_start;
+                const int * const class_end = &col_class_[0] + block_end;
 
-            score_t sc;
-            if( (su > sl) && su > sm ) {
-                sc = su;
-                //arr.s_u[ic(ia,ib)] = true;
-                tb_val |= b_s_u;
-            } else if( ( sl >= su ) && sl > sm ) {
-                sc = sl;
-                //arr.s_l[ic(ia,ib)] = true;
-                tb_val |= b_s_l;
-            } else { // implicit: sm_zero > sl && sm_zero > su
-                sc = sm;
-            }
+                vec_t last_sdiag = vu::load( &(*block_sdiag_it));
+                vec_t last_sl = vu::load( &(*block_sl_it));
+                vec_t last_sc = vu::load( &(*block_sc_it));
 
+                // see pvec_aligner_vec for comments on the inner loop. The only difference is where sm_inc comes from.
+                for(; class_iter != class_end; ++class_iter, s_iter += W, si_iter += W ) {
+                    const vec_t sm_inc = vu::load( row_prof + (*class_iter) * W );
+                    const mask_t cgap = vu::cmp_lt( sm_inc, zero ); // HACK: assume that match_score + match_cgap_penalty < 0
 
-            last_sc = sc;
-            *s_iter = sc;
-            arr.tb[ic(ia,ib)] = tb_val;
+                    const vec_t s_diag = last_sdiag;
+                    const vec_t sm = vu::add(s_diag, sm_inc );
 
-            if( s_iter == s_end - 1 || lastrow ) {
-                if( sc > max_score ) {
-                    max_a = int(ia);
-                    max_b = int(ib);
-                    max_score = sc;
-                }
+                    const vec_t sc_left = last_sc;
+                    const vec_t sl_open = vu::add( sc_left, vu::bit_andnot( cgap, gap_open) );
 
+                    const vec_t sl_left = last_sl;
+                    const vec_t sl_extend = vu::add( sl_left, vu::bit_andnot( cgap, gap_extend) );
 
-            }
-        }
+                    const vec_t sl = vu::max( sl_open, sl_extend );
+                    last_sl = sl;
 
-    }
+                    const vec_t sc_above = vu::load( s_iter );
 
-//    std::cout << "max score: " << max_score << "\n";
-//    std::cout << "max " << max_a << " " << max_b << "\n";
+                    last_sdiag = sc_above;
 
-	
-    ptrdiff_t ia = asize - 1;
-    ptrdiff_t ib = bsize - 1;
+                    const vec_t su_open = vu::add( sc_above, gap_open);
+                    const vec_t su_extend = vu::add( vu::load( si_iter ), gap_extend );
+                    const vec_t su = vu::max( su_open, su_extend );
 
-    assert( ia == max_a || ib == max_b );
+                    vu::store( su, si_iter );
 
-    bool in_l = false;
-    bool in_u = false;
+                    const vec_t sc = vu::max( sm, vu::max( su, sl ) );
+                    last_sc = sc;
+                    row_max_score = vu::max( row_max_score, sc );
 
-    while( ia > max_a ) {
-        tb_out.push_back(1);
-        --ia;
-    }
+                    vu::store( last_sc, s_iter );
+                }
 
-    while( ib > max_b ) {
-        tb_out.push_back(2);
-        --ib;
-    }
+                done = block_start == a_end_idx;
 
-    while( ia >= 0 && ib >= 0 ) {
-        size_t c = ic( ia, ib );
+                // only take the rows into account that belong to the query of the respective lane
+                if( done ) {
+                    const vec_t valid = vu::load( &row_valid_[ib * W] );
+                    max_score = vu::max( max_score, vu::bit_or( vu::bit_and( valid, last_sc ), vu::bit_andnot( valid, small )));
+                }
 
-        if( !in_l && !in_u ) {
-            in_l = (arr.tb[c] & b_s_l) != 0;
-            in_u = (arr.tb[c] & b_s_u) != 0;
+                const vec_t last = vu::load( &row_last_[ib * W] );
+                max_score = vu::max( max_score, vu::bit_or( vu::bit_and( last, row_max_score ), vu::bit_andnot( last, small )));
 
-            if( !in_l && !in_u ) {
-                tb_out.push_back(0);
-                --ia;
-                --ib;
+                vu::store( last_sdiag, &(*block_sdiag_it) );
+                vu::store( last_sc, &(*block_sc_it) );
+                vu::store( last_sl, &(*block_sl_it) );
             }
 
+            block_start_outer = block_end;
         }
 
-        if( in_u ) {
-            tb_out.push_back(2);
-            --ib;
+        ticks ticks2 = getticks();
+        ticks_all_ += uint64_t(elapsed(ticks2, ticks1 ));
 
-            in_u = (arr.tb[c] & b_su_stay) != 0;
-        } else if( in_l ) {
-            tb_out.push_back(1);
-            --ia;
+        vu::store( max_score, &(*out_start) );
+    }
+
+    uint64_t ticks_all() {
+        return ticks_all_;
+    }
+
+    uint64_t inner_iters_all() {
+        return inner_iters_all_;
+    }
+
+private:
+    buffer_t s_;
+    buffer_t si_;
+
+    buffer_t prof_;
+    buffer_t row_valid_;
+    buffer_t row_last_;
+
+    int_buffer_t col_class_;
+    int_buffer_t class_key_;
+    int_buffer_t cstate_map_;
+
+    const score_t match_score_;
+    const score_t match_cgap_;
+    const size_t num_cstates_;
+
+    uint64_t ticks_all_;
+    uint64_t inner_iters_all_;
+};
+
+
+//
+// the 'full enchilada' aligner including traceback.
+// The freeshift/global implementations are currently separate mainly because they
+// act as reference for the optimized versions and I don't want to screw them up too much...
+//
+
+template<typename score_t>
+struct align_arrays_traceback {
+    align_arrays_traceback() : max_tb_cells( size_t(1) << 26 ), vectorized(true) {}
+
+    ivy_mike::aligned_buffer<score_t> s;
+    ivy_mike::aligned_buffer<score_t> si;  
+    
+    std::vector<uint8_t> tb;
+
+    // align_freeshift_pvec switches to the checkpointed traceback (see there) for alignments with more than max_tb_cells
+    // cells. The checkpoints store the s/si rows.
+    size_t max_tb_cells;
+    std::vector<score_t> cp_s;
+    std::vector<score_t> cp_si;
+
+    // use the vectorized dp (align_freeshift_pvec_fill_strips) where possible. The skewed reference profile and the
+    // per-strip output rows live here as well.
+    bool vectorized;
+    ivy_mike::aligned_buffer<score_t> strip_a;
+    ivy_mike::aligned_buffer<score_t> strip_cgap;
+    ivy_mike::aligned_buffer<score_t> strip_s;
+    ivy_mike::aligned_buffer<score_t> strip_si;
+};
+
+// traceback flags of align_freeshift_pvec
+struct freeshift_tb_flags {
+    static const uint8_t sl_stay = 0x1;
+    static const uint8_t su_stay = 0x2;
+    static const uint8_t s_l = 0x4;
+    static const uint8_t s_u = 0x8;
+};
+
+// one row (i.e., query character bc) of the freeshift dp: updates s/si (the scores of the previous row) in place and stores
+// the traceback flags of the row in tb. If max_score is non-null, the best score in the last column/row is tracked.
+// first_sc/first_diag are the main-cell scores left of the first column in this and the previous row (0 for the full
+// matrix). If last_col is false, the last column is not treated as the end of the reference (see align_freeshift_pvec_banded).
+template<typename score_t, typename aiter, typename auxiter>
+inline void align_freeshift_pvec_row( aiter astart, auxiter auxstart, size_t asize, int bc, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, score_t * __restrict s_iter, score_t * __restrict si_iter, uint8_t * __restrict tb, bool lastrow, size_t ib, score_t *max_score, int *max_a, int *max_b, score_t first_sc = 0, score_t first_diag = 0, bool last_col = true ) {
+    const score_t SMALL = -32000;
+
+    score_t last_sl = SMALL;
+    score_t last_sc = first_sc;
+    score_t last_sdiag = first_diag;
+
+    score_t * __restrict s_end = s_iter + asize;
+
+    for( size_t ia = 0; ia < asize; ++ia, ++s_iter, ++si_iter ) {
+        //score_t match = sm.get_score( a[ia], bc );
+        uint8_t tb_val = 0;
+        int ac = *(astart + ia);
+        const bool cgap = *(auxstart + ia)  == AUX_CGAP;
+
+            // determine match or mis-match according to parsimony bits coming from the tree.
+        score_t match = ( ac & bc ) != 0 ? match_score : 0;
+
+
+
+        score_t sm = last_sdiag + match;
+
+        last_sdiag = *s_iter;
+
+        score_t last_sc_OPEN;
+        score_t sl_score_stay;
+
+        if( cgap ) {
+            last_sc_OPEN = last_sc;
+            sl_score_stay = last_sl;
+            sm += match_cgap;
+        } else {
+            last_sc_OPEN = last_sc + gap_open;
+            sl_score_stay = last_sl + gap_extend;
+        }
+
+        score_t sl;
+        if( sl_score_stay > last_sc_OPEN ) {
+            sl = sl_score_stay;
+            tb_val |= freeshift_tb_flags::sl_stay;
+        } else {
+            sl = last_sc_OPEN;
+        }
+
+        last_sl = sl;
+
+
+        score_t su_gap_open = last_sdiag + gap_open;
+        score_t su_GAP_EXTEND = *si_iter + gap_extend;
+
+        score_t su;// = max( su_GAP_EXTEND,  );
+        if( su_GAP_EXTEND > su_gap_open ) {
+            su = su_GAP_EXTEND;
+            tb_val |= freeshift_tb_flags::su_stay;
+        } else {
+            su = su_gap_open;
+        }
+
+
+        *si_iter = su;
+
+        score_t sc;
+        if( (su > sl) && su > sm ) {
+            sc = su;
+            tb_val |= freeshift_tb_flags::s_u;
+        } else if( ( sl >= su ) && sl > sm ) {
+            sc = sl;
+            tb_val |= freeshift_tb_flags::s_l;
+        } else { // implicit: sm_zero > sl && sm_zero > su
+            sc = sm;
+        }
+
+
+        last_sc = sc;
+        *s_iter = sc;
+        tb[ia] = tb_val;
+
+        if( max_score != 0 && ((last_col && s_iter == s_end - 1) || lastrow) ) {
+            if( sc > *max_score ) {
+                *max_a = int(ia);
+                *max_b = int(ib);
+                *max_score = sc;
+            }
+
+
+        }
+    }
+}
+
+// follows the traceback flags from the best cell (max_a, max_b) back to the start and appends the gap stream to tb_out
+// (reversed: 0 = match, 1 = gap in b, 2 = gap in a). tb_at(ia, ib) returns the flags of a cell, and is called with
+// non-increasing ib.
+template<typename tb_access>
+void align_freeshift_pvec_traceback( tb_access &tb_at, size_t asize, size_t bsize, int max_a, int max_b, std::vector<uint8_t>& tb_out ) {
+    ptrdiff_t ia = asize - 1;
+    ptrdiff_t ib = bsize - 1;
+
+    assert( ia == max_a || ib == max_b );
+
+    bool in_l = false;
+    bool in_u = false;
+
+    while( ia > max_a ) {
+        tb_out.push_back(1);
+        --ia;
+    }
+
+    while( ib > max_b ) {
+        tb_out.push_back(2);
+        --ib;
+    }
+
+    while( ia >= 0 && ib >= 0 ) {
+        const uint8_t tb = tb_at( ia, ib );
+
+        if( !in_l && !in_u ) {
+            in_l = (tb & freeshift_tb_flags::s_l) != 0;
+            in_u = (tb & freeshift_tb_flags::s_u) != 0;
+
+            if( !in_l && !in_u ) {
+                tb_out.push_back(0);
+                --ia;
+                --ib;
+            }
 
-            in_l = (arr.tb[c] & b_sl_stay) != 0;
+        }
+
+        if( in_u ) {
+            tb_out.push_back(2);
+            --ib;
+
+            in_u = (tb & freeshift_tb_flags::su_stay) != 0;
+        } else if( in_l ) {
+            tb_out.push_back(1);
+            --ia;
+
+            in_l = (tb & freeshift_tb_flags::sl_stay) != 0;
         }
 
 
@@ -1238,9 +1643,675 @@ score_t align_freeshift_pvec( aiter astart, aiter aend, auxiter auxstart, biter
         tb_out.push_back(2);
         --ib;
     }
+}
+
+// traceback flags stored by align_freeshift_pvec_fill for the columns [lo, lo + width). The rows are grouped into strips
+// of 'rows' rows. Within a strip, the flags of row k and column c are stored at step c + k, lane k (so one strip row is the
+// plain row major matrix). Reading a cell left of lo means that the traceback left the band (which should not happen if
+// the band was derived correctly, see align_freeshift_pvec_banded).
+class freeshift_tb_matrix {
+public:
+    freeshift_tb_matrix( const std::vector<uint8_t> &tb, size_t lo, size_t width, size_t rows ) : tb_(tb), lo_(lo), width_(width), rows_(rows), left_band_(false) {}
+
+    uint8_t operator()( size_t ia, size_t ib ) {
+        if( ia < lo_ ) {
+            left_band_ = true;
+            return 0;
+        }
+
+        assert( ia - lo_ < width_ );
+        const size_t lane = ib % rows_;
+        return tb_[((ib / rows_) * (width_ + rows_ - 1) + ia - lo_ + lane) * rows_ + lane];
+    }
+
+    bool left_band() const {
+        return left_band_;
+    }
+
+private:
+    const std::vector<uint8_t> &tb_;
+    const size_t lo_;
+    const size_t width_;
+    const size_t rows_;
+    bool left_band_;
+};
+
+// the forward dp of align_freeshift_pvec over the columns [0, width): initializes arr.s/arr.si, stores the traceback flags
+// of all cells in arr.tb and tracks the best score in the last column/row (first_sc and last_col as in
+// align_freeshift_pvec_row; the main-cell left of the top row is always 0). Returns the strip height of the flag layout
+// (see freeshift_tb_matrix), which is 1 for this row-by-row version.
+template<typename score_t, typename aiter, typename auxiter, typename biter>
+size_t align_freeshift_pvec_fill_rows( aiter astart, auxiter auxstart, size_t width, biter bstart, size_t bsize, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, score_t first_sc, bool last_col, align_arrays_traceback<score_t> &arr, score_t *max_score, int *max_a, int *max_b ) {
+    if( arr.s.size() < width ) {
+        arr.s.resize( width );
+        arr.si.resize( width );
+    }
+
+    std::fill( arr.s.begin(), arr.s.begin() + width, 0 );
+    std::fill( arr.si.begin(), arr.si.begin() + width, 0 );
+    arr.tb.resize( width * bsize );
+
+    for( size_t ib = 0; ib < bsize; ib++ ) {
+        const score_t first_diag = ib == 0 ? 0 : first_sc;
+
+        align_freeshift_pvec_row( astart, auxstart, width, *(bstart + ib), match_score, match_cgap, gap_open, gap_extend,
+                                  arr.s.base(), arr.si.base(), arr.tb.data() + ib * width, ib == (bsize - 1), ib, max_score, max_a, max_b,
+                                  first_sc, first_diag, last_col );
+    }
+
+    return 1;
+}
+
+// vectorized version of align_freeshift_pvec_fill_rows for 32bit scores. The rows are processed in strips of W rows, and
+// lane k of the vector unit works on row k of the strip, lagging one column behind lane k - 1 (i.e., one step covers an
+// anti-diagonal of the strip). This way the cell above is what the lane below computed in the previous step, and the
+// diagonal cell what it computed two steps ago, so one step only needs a lane shift instead of the horizontal dependency
+// of the row-by-row dp. The reference profile is skewed in the same way once per call, and the four flags of each cell are
+// packed into one byte per lane. Computes exactly the same cells (and ties) as align_freeshift_pvec_row.
+template<typename aiter, typename auxiter, typename biter>
+size_t align_freeshift_pvec_fill_strips( aiter astart, auxiter auxstart, size_t width, biter bstart, size_t bsize, int match_score, int match_cgap, int gap_open, int gap_extend, int first_sc, bool last_col, align_arrays_traceback<int> &arr, int *max_score, int *max_a, int *max_b ) {
+    typedef vector_unit<int,4> vu;
+    typedef vu::vec_t vec_t;
+
+    const size_t W = vu::W;
+    const size_t num_steps = width + W - 1;
+    const size_t num_strips = (bsize + W - 1) / W;
+    const int SMALL = -32000;
+
+    // lane 0 reads the row above up to step num_steps - 1
+    if( arr.s.size() < num_steps ) {
+        arr.s.resize( num_steps );
+        arr.si.resize( num_steps );
+    }
+
+    std::fill( arr.s.begin(), arr.s.begin() + num_steps, 0 );
+    std::fill( arr.si.begin(), arr.si.begin() + num_steps, 0 );
+
+    arr.strip_a.resize( num_steps * W );
+    arr.strip_cgap.resize( num_steps * W );
+    arr.strip_s.resize( num_steps * W );
+    arr.strip_si.resize( num_steps * W );
+
+    // the columns outside the reference never match
+    for( size_t t = 0; t < num_steps; ++t ) {
+        for( size_t k = 0; k < W; ++k ) {
+            const bool inside = t >= k && t - k < width;
+            arr.strip_a[t * W + k] = inside ? *(astart + (t - k)) : 0;
+            arr.strip_cgap[t * W + k] = (inside && *(auxstart + (t - k)) == AUX_CGAP) ? -1 : 0;
+        }
+    }
+
+    arr.tb.resize( num_strips * num_steps * W );
+
+    const vec_t match_v = vu::set1( match_score );
+    const vec_t match_cgap_v = vu::set1( match_cgap );
+    const vec_t gap_open_v = vu::set1( gap_open );
+    const vec_t gap_extend_v = vu::set1( gap_extend );
+    const vec_t first_sc_v = vu::set1( first_sc );
+    const vec_t small_v = vu::set1( SMALL );
+
+    const vec_t sl_stay_f = vu::set1( freeshift_tb_flags::sl_stay );
+    const vec_t su_stay_f = vu::set1( freeshift_tb_flags::su_stay );
+    const vec_t s_l_f = vu::set1( freeshift_tb_flags::s_l );
+    const vec_t s_u_f = vu::set1( freeshift_tb_flags::s_u );
+
+    ivy_mike::aligned_buffer<int> tmp( W );
+    for( size_t k = 0; k < W; ++k ) {
+        tmp[k] = int(k);
+    }
+    const vec_t lane_v = vu::load( tmp.base() );
+
+    const int * __restrict strip_a = arr.strip_a.base();
+    const int * __restrict strip_cgap = arr.strip_cgap.base();
+    int * __restrict strip_s = arr.strip_s.base();
+    int * __restrict strip_si = arr.strip_si.base();
+    int * __restrict s = arr.s.base();
+    int * __restrict si = arr.si.base();
+
+    for( size_t strip = 0; strip < num_strips; ++strip ) {
+        const size_t ib0 = strip * W;
+        const size_t num_rows = std::min( W, bsize - ib0 );
+
+        for( size_t k = 0; k < W; ++k ) {
+            tmp[k] = k < num_rows ? *(bstart + (ib0 + k)) : 0;
+        }
+        const vec_t bc = vu::load( tmp.base() );
+
+        // state of the previous step. Lanes that have not reached the first column yet hold the cells left of it.
+        vec_t sc = first_sc_v;
+        vec_t sl = small_v;
+        vec_t su = vu::setzero();
+        vec_t diag = vu::shift_in( first_sc_v, ib0 == 0 ? 0 : first_sc );
+
+        uint8_t * __restrict tb = arr.tb.data() + strip * num_steps * W;
+
+        for( size_t t = 0; t < num_steps; ++t ) {
+            const vec_t ac = vu::load( strip_a + t * W );
+            const vec_t cgap = vu::load( strip_cgap + t * W );
+
+            const vec_t up = vu::shift_in( sc, s[t] );
+            const vec_t up_i = vu::shift_in( su, si[t] );
+
+            vec_t sm = vu::add( diag, vu::bit_andnot( vu::cmp_zero( vu::bit_and( ac, bc )), match_v ));
+            sm = vu::add( sm, vu::bit_and( cgap, match_cgap_v ));
+            diag = up;
+
+            const vec_t sl_open = vu::add( sc, vu::bit_andnot( cgap, gap_open_v ));
+            const vec_t sl_ext = vu::add( sl, vu::bit_andnot( cgap, gap_extend_v ));
+            const vec_t sl_stay = vu::cmp_lt( sl_open, sl_ext );
+            sl = vu::max( sl_open, sl_ext );
+
+            const vec_t su_open = vu::add( up, gap_open_v );
+            const vec_t su_ext = vu::add( up_i, gap_extend_v );
+            const vec_t su_stay = vu::cmp_lt( su_open, su_ext );
+            su = vu::max( su_open, su_ext );
+
+            const vec_t sl_lt_su = vu::cmp_lt( sl, su );
+            const vec_t s_u = vu::bit_and( sl_lt_su, vu::cmp_lt( sm, su ));
+            const vec_t s_l = vu::bit_andnot( sl_lt_su, vu::cmp_lt( sm, sl ));
+
+            sc = vu::max( sm, vu::max( sl, su ));
+
+            const vec_t flags = vu::bit_or( vu::bit_or( vu::bit_and( sl_stay, sl_stay_f ), vu::bit_and( su_stay, su_stay_f )),
+                                            vu::bit_or( vu::bit_and( s_l, s_l_f ), vu::bit_and( s_u, s_u_f )));
+            vu::store_u8( flags, tb + t * W );
+
+            if( t + 1 < W ) {
+                const vec_t started = vu::cmp_lt( lane_v, vu::set1( int(t) + 1 ));
+                sc = vu::bit_or( vu::bit_and( started, sc ), vu::bit_andnot( started, first_sc_v ));
+                sl = vu::bit_or( vu::bit_and( started, sl ), vu::bit_andnot( started, small_v ));
+            }
+
+            vu::store( sc, strip_s + t * W );
+            vu::store( su, strip_si + t * W );
+        }
+
+        // the last lane is the row above the next strip
+        if( ib0 + W < bsize ) {
+            for( size_t c = 0; c < width; ++c ) {
+                s[c] = strip_s[(c + W - 1) * W + W - 1];
+                si[c] = strip_si[(c + W - 1) * W + W - 1];
+            }
+        }
+
+        if( max_score == 0 ) {
+            continue;
+        }
+
+        // best score in the last column/row, in the same order as align_freeshift_pvec_row
+        for( size_t k = 0; k < num_rows; ++k ) {
+            const size_t ib = ib0 + k;
+            const bool lastrow = ib == bsize - 1;
+
+            if( !lastrow && !last_col ) {
+                continue;
+            }
+
+            for( size_t c = lastrow ? 0 : width - 1; c < width; ++c ) {
+                const int sc = strip_s[(c + k) * W + k];
+
+                if( sc > *max_score ) {
+                    *max_a = int(c);
+                    *max_b = int(ib);
+                    *max_score = sc;
+                }
+            }
+        }
+    }
+
+    return W;
+}
+
+template<typename score_t, typename aiter, typename auxiter, typename biter>
+inline size_t align_freeshift_pvec_fill( aiter astart, auxiter auxstart, size_t width, biter bstart, size_t bsize, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, score_t first_sc, bool last_col, align_arrays_traceback<score_t> &arr, score_t *max_score, int *max_a, int *max_b ) {
+    return align_freeshift_pvec_fill_rows( astart, auxstart, width, bstart, bsize, match_score, match_cgap, gap_open, gap_extend, first_sc, last_col, arr, max_score, max_a, max_b );
+}
+
+template<typename aiter, typename auxiter, typename biter>
+inline size_t align_freeshift_pvec_fill( aiter astart, auxiter auxstart, size_t width, biter bstart, size_t bsize, int match_score, int match_cgap, int gap_open, int gap_extend, int first_sc, bool last_col, align_arrays_traceback<int> &arr, int *max_score, int *max_a, int *max_b ) {
+    if( !arr.vectorized ) {
+        return align_freeshift_pvec_fill_rows( astart, auxstart, width, bstart, bsize, match_score, match_cgap, gap_open, gap_extend, first_sc, last_col, arr, max_score, max_a, max_b );
+    }
+
+    return align_freeshift_pvec_fill_strips( astart, auxstart, width, bstart, bsize, match_score, match_cgap, gap_open, gap_extend, first_sc, last_col, arr, max_score, max_a, max_b );
+}
+
+// traceback flags of the checkpointed traceback: the forward pass keeps the s/si rows at the start of every block of
+// block_rows rows, and the flags of a block are recomputed from its checkpoint once the traceback enters it. This
+// repeats the dp once, but needs only O(asize * (bsize / block_rows + block_rows)) memory instead of O(asize * bsize).
+// Unlike a Hirschberg-style split it runs exactly the same dp, so the resulting gap stream is identical.
+template<typename score_t, typename aiter, typename auxiter, typename biter>
+class freeshift_checkpoint_tb {
+public:
+    freeshift_checkpoint_tb( aiter astart, auxiter auxstart, size_t asize, biter bstart, size_t bsize, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, size_t block_rows, align_arrays_traceback<score_t> &arr )
+      : astart_(astart), auxstart_(auxstart), asize_(asize), bstart_(bstart), bsize_(bsize),
+        match_score_(match_score), match_cgap_(match_cgap), gap_open_(gap_open), gap_extend_(gap_extend),
+        block_rows_(block_rows), arr_(arr), block_start_(bsize)
+    {}
+
+    uint8_t operator()( size_t ia, size_t ib ) {
+        assert( ia < asize_ && ib < bsize_ );
+
+        if( ib < block_start_ ) {
+            fill_block( ib / block_rows_ );
+        }
+
+        return arr_.tb[(ib - block_start_) * asize_ + ia];
+    }
+
+private:
+    void fill_block( size_t block ) {
+        block_start_ = block * block_rows_;
+        const size_t block_end = std::min( block_start_ + block_rows_, bsize_ );
+
+        std::copy( arr_.cp_s.begin() + block * asize_, arr_.cp_s.begin() + (block + 1) * asize_, arr_.s.begin() );
+        std::copy( arr_.cp_si.begin() + block * asize_, arr_.cp_si.begin() + (block + 1) * asize_, arr_.si.begin() );
+
+        for( size_t ib = block_start_; ib < block_end; ++ib ) {
+            align_freeshift_pvec_row( astart_, auxstart_, asize_, *(bstart_ + ib), match_score_, match_cgap_, gap_open_, gap_extend_,
+                                      arr_.s.base(), arr_.si.base(), arr_.tb.data() + (ib - block_start_) * asize_, false, ib, (score_t *)0, (int *)0, (int *)0 );
+        }
+    }
+
+    aiter astart_;
+    auxiter auxstart_;
+    const size_t asize_;
+    biter bstart_;
+    const size_t bsize_;
+    const score_t match_score_, match_cgap_, gap_open_, gap_extend_;
+    const size_t block_rows_;
+    align_arrays_traceback<score_t> &arr_;
+
+    size_t block_start_; // first row of the block currently in arr_.tb
+};
+
+template<typename score_t, typename aiter, typename auxiter, typename biter>
+score_t align_freeshift_pvec( aiter astart, aiter aend, auxiter auxstart, biter bstart, biter bend, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, std::vector<uint8_t>& tb_out, align_arrays_traceback<score_t> &arr ) {
+    const size_t asize = std::distance(astart, aend);
+    const size_t bsize = std::distance(bstart, bend);
+
+    const score_t SMALL = -32000;
+
+    score_t max_score = SMALL;
+    int max_a = 0;
+    int max_b = 0;
+
+    if( asize * bsize <= arr.max_tb_cells ) {
+        const size_t rows = align_freeshift_pvec_fill( astart, auxstart, asize, bstart, bsize, match_score, match_cgap, gap_open, gap_extend, score_t(0), true, arr, &max_score, &max_a, &max_b );
+
+        freeshift_tb_matrix tb_at( arr.tb, 0, asize, rows );
+        align_freeshift_pvec_traceback( tb_at, asize, bsize, max_a, max_b, tb_out );
+
+        return max_score;
+    }
+
+    if( arr.s.size() < asize  ) {
+        arr.s.resize( asize );
+        arr.si.resize( asize );
+    }
+
+    std::fill( arr.s.begin(), arr.s.end(), 0 );
+    std::fill( arr.si.begin(), arr.si.end(), 0 );
+
+    // too large for the full traceback matrix: checkpoint every block_rows rows, with block_rows chosen to minimize the
+    // memory of the checkpoints (2 * sizeof(score_t) bytes per cell) plus one block of flags (1 byte per cell).
+    const size_t block_rows = std::max( size_t(1), size_t( std::sqrt( double(2 * sizeof(score_t) * bsize) )));
+    const size_t num_blocks = (bsize + block_rows - 1) / block_rows;
+
+    arr.cp_s.resize( num_blocks * asize );
+    arr.cp_si.resize( num_blocks * asize );
+    arr.tb.resize( block_rows * asize );
+
+    for( size_t ib = 0; ib < bsize; ib++ ) {
+        if( ib % block_rows == 0 ) {
+            std::copy( arr.s.begin(), arr.s.begin() + asize, arr.cp_s.begin() + (ib / block_rows) * asize );
+            std::copy( arr.si.begin(), arr.si.begin() + asize, arr.cp_si.begin() + (ib / block_rows) * asize );
+        }
+
+        // the flags of the forward pass are not needed, so they are just written to the first row of the block buffer
+        align_freeshift_pvec_row( astart, auxstart, asize, *(bstart + ib), match_score, match_cgap, gap_open, gap_extend,
+                                  arr.s.base(), arr.si.base(), arr.tb.data(), ib == (bsize - 1), ib, &max_score, &max_a, &max_b );
+    }
+
+    freeshift_checkpoint_tb<score_t, aiter, auxiter, biter> tb_at( astart, auxstart, asize, bstart, bsize, match_score, match_cgap, gap_open, gap_extend, block_rows, arr );
+    align_freeshift_pvec_traceback( tb_at, asize, bsize, max_a, max_b, tb_out );
+
     return max_score;
 }
 
+// align_freeshift_pvec restricted to a band of reference columns, for the case that the best score and the column in
+// which the best alignment ends (end_col, see pvec_aligner_vec::align) are already known. Every diagonal step can gain
+// at most max_gain and every gap in a non-cgap column costs at least -max(gap_open, gap_extend), so an alignment
+// reaching known_score spans at most bsize + (bsize * max_gain - known_score) / -max(gap_open, gap_extend) non-cgap
+// columns (the cgap columns can be skipped for free). Left of the band the dp is cut off, and all other cells have the
+// same values (and traceback flags) along the best alignment as in the full matrix, so the gap stream is identical.
+// freeshift_band_start computes the first column of the band, or returns false if the gap scores do not allow one.
+template<typename score_t, typename auxiter>
+bool freeshift_band_start( auxiter auxstart, size_t asize, size_t bsize, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, score_t known_score, size_t end_col, size_t *lo_out ) {
+    const score_t max_gap = std::max( gap_open, gap_extend );
+    if( max_gap >= 0 || gap_open > 0 || bsize == 0 || end_col >= asize ) {
+        return false;
+    }
+
+    const int64_t max_gain = std::max( std::max( int64_t(0), int64_t(match_score) ), std::max( int64_t(match_cgap), int64_t(match_score) + match_cgap ));
+    const int64_t budget = int64_t(bsize) * max_gain - known_score;
+
+    if( budget < 0 ) {
+        return false;
+    }
+
+    const size_t max_noncgap = bsize + size_t(budget / -int64_t(max_gap)) + 1;
+
+    size_t lo = end_col + 1;
+    for( size_t num_noncgap = 0; lo > 0 && num_noncgap < max_noncgap; ) {
+        --lo;
+        if( *(auxstart + lo) != AUX_CGAP ) {
+            ++num_noncgap;
+        }
+    }
+
+    *lo_out = lo;
+    return true;
+}
+
+// align_freeshift_pvec_banded returns false (without touching tb_out) if there is no band, or the banded score differs
+// from known_score; then the full align_freeshift_pvec has to be used.
+template<typename score_t, typename aiter, typename auxiter, typename biter>
+bool align_freeshift_pvec_banded( aiter astart, aiter aend, auxiter auxstart, biter bstart, biter bend, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, score_t known_score, size_t end_col, std::vector<uint8_t>& tb_out, align_arrays_traceback<score_t> &arr ) {
+    const size_t asize = std::distance(astart, aend);
+    const size_t bsize = std::distance(bstart, bend);
+
+    size_t lo;
+    if( !freeshift_band_start( auxstart, asize, bsize, match_score, match_cgap, gap_open, gap_extend, known_score, end_col, &lo )) {
+        return false;
+    }
+
+    const size_t width = end_col + 1 - lo;
+    if( width == asize || width * bsize > arr.max_tb_cells ) {
+        return false;
+    }
+
+    // the cells left of the band: 0 in the top row, cut off in all other rows (unless the band starts at the first column)
+    const score_t cut_off = std::numeric_limits<score_t>::min() / 2;
+    const score_t first_sc = lo == 0 ? 0 : cut_off;
+    const bool last_col = end_col == asize - 1;
+
+    score_t max_score = -32000;
+    int max_a = 0;
+    int max_b = 0;
+
+    const size_t rows = align_freeshift_pvec_fill( astart + lo, auxstart + lo, width, bstart, bsize, match_score, match_cgap, gap_open, gap_extend, first_sc, last_col, arr, &max_score, &max_a, &max_b );
+
+    if( max_score != known_score ) {
+        return false;
+    }
+
+    const size_t old_size = tb_out.size();
+
+    freeshift_tb_matrix tb_at( arr.tb, lo, width, rows );
+    align_freeshift_pvec_traceback( tb_at, asize, bsize, int(lo) + max_a, max_b, tb_out );
+
+    if( tb_at.left_band() ) {
+        tb_out.resize( old_size );
+        return false;
+    }
+
+    return true;
+}
+
+// traceback flags of align_freeshift_pvec_fill_batch for one of the lanes: W flags per cell, row major over the columns
+// [lo, lo + width). Like freeshift_tb_matrix, reading a cell left of lo means that the traceback left the band.
+class freeshift_batch_tb {
+public:
+    freeshift_batch_tb( const std::vector<uint8_t> &tb, size_t lo, size_t width, size_t lane, size_t num_lanes ) : tb_(tb), lo_(lo), width_(width), lane_(lane), num_lanes_(num_lanes), left_band_(false) {}
+
+    uint8_t operator()( size_t ia, size_t ib ) {
+        if( ia < lo_ ) {
+            left_band_ = true;
+            return 0;
+        }
+
+        assert( ia - lo_ < width_ );
+        return tb_[(ib * width_ + ia - lo_) * num_lanes_ + lane_];
+    }
+
+    bool left_band() const {
+        return left_band_;
+    }
+
+private:
+    const std::vector<uint8_t> &tb_;
+    const size_t lo_;
+    const size_t width_;
+    const size_t lane_;
+    const size_t num_lanes_;
+    bool left_band_;
+};
+
+// the forward dp of align_freeshift_pvec_fill_rows for up to W = 4 queries against the same reference columns [0, width),
+// one query per lane of vector_unit<int,4> (like pvec_aligner_vec_qs does for the scores). The reference profile is
+// broadcast to the lanes once, and the rows past the end of the shorter queries are computed but never used. The best
+// score and its cell per query are stored in max_score/max_a/max_b[0..num). Computes exactly the same cells (and ties)
+// as align_freeshift_pvec_row.
+template<typename aiter, typename auxiter, typename biter>
+void align_freeshift_pvec_fill_batch( aiter astart, auxiter auxstart, size_t width, const biter *bstarts, const size_t *bsizes, size_t num, int match_score, int match_cgap, int gap_open, int gap_extend, int first_sc, bool last_col, align_arrays_traceback<int> &arr, int *max_score, int *max_a, int *max_b ) {
+    typedef vector_unit<int,4> vu;
+    typedef vu::vec_t vec_t;
+
+    const size_t W = vu::W;
+    const int SMALL = -32000;
+
+    assert( num <= W );
+    const size_t num_rows = *std::max_element( bsizes, bsizes + num );
+
+    arr.strip_a.resize( width * W );
+    arr.strip_cgap.resize( width * W );
+    arr.strip_s.assign( width * W, 0 );
+    arr.strip_si.assign( width * W, 0 );
+
+    for( size_t c = 0; c < width; ++c ) {
+        std::fill( arr.strip_a.begin() + c * W, arr.strip_a.begin() + (c + 1) * W, *(astart + c) );
+        std::fill( arr.strip_cgap.begin() + c * W, arr.strip_cgap.begin() + (c + 1) * W, *(auxstart + c) == AUX_CGAP ? -1 : 0 );
+    }
+
+    arr.tb.resize( num_rows * width * W );
+
+    const vec_t match_v = vu::set1( match_score );
+    const vec_t match_cgap_v = vu::set1( match_cgap );
+    const vec_t gap_open_v = vu::set1( gap_open );
+    const vec_t gap_extend_v = vu::set1( gap_extend );
+    const vec_t first_sc_v = vu::set1( first_sc );
+    const vec_t small_v = vu::set1( SMALL );
+
+    const vec_t sl_stay_f = vu::set1( freeshift_tb_flags::sl_stay );
+    const vec_t su_stay_f = vu::set1( freeshift_tb_flags::su_stay );
+    const vec_t s_l_f = vu::set1( freeshift_tb_flags::s_l );
+    const vec_t s_u_f = vu::set1( freeshift_tb_flags::s_u );
+
+    // last row of each lane (-1 for the unused ones, so that they are never tracked)
+    ivy_mike::aligned_buffer<int> tmp( W );
+    for( size_t k = 0; k < W; ++k ) {
+        tmp[k] = k < num ? int(bsizes[k]) - 1 : -1;
+    }
+    const vec_t last_row_v = vu::load( tmp.base() );
+
+    vec_t best = small_v;
+    vec_t best_a = vu::setzero();
+    vec_t best_b = vu::setzero();
+
+    const int * __restrict prof_a = arr.strip_a.base();
+    const int * __restrict prof_cgap = arr.strip_cgap.base();
+    int * __restrict s = arr.strip_s.base();
+    int * __restrict si = arr.strip_si.base();
+
+    for( size_t ib = 0; ib < num_rows; ++ib ) {
+        bool any_last = false;
+        for( size_t k = 0; k < W; ++k ) {
+            tmp[k] = (k < num && ib < bsizes[k]) ? *(bstarts[k] + ib) : 0;
+            any_last |= k < num && ib + 1 == bsizes[k];
+        }
+        const vec_t bc = vu::load( tmp.base() );
+        const vec_t ib_v = vu::set1( int(ib) );
+        const vec_t lastrow = vu::cmp_eq( last_row_v, ib_v );
+
+        vec_t sc = first_sc_v;
+        vec_t sl = small_v;
+        vec_t diag = ib == 0 ? vu::setzero() : first_sc_v;
+
+        uint8_t * __restrict tb = arr.tb.data() + ib * width * W;
+
+        for( size_t ia = 0; ia < width; ++ia ) {
+            const vec_t ac = vu::load( prof_a + ia * W );
+            const vec_t cgap = vu::load( prof_cgap + ia * W );
+
+            const vec_t up = vu::load( s + ia * W );
+            const vec_t up_i = vu::load( si + ia * W );
+
+            vec_t sm = vu::add( diag, vu::bit_andnot( vu::cmp_zero( vu::bit_and( ac, bc )), match_v ));
+            sm = vu::add( sm, vu::bit_and( cgap, match_cgap_v ));
+            diag = up;
+
+            const vec_t sl_open = vu::add( sc, vu::bit_andnot( cgap, gap_open_v ));
+            const vec_t sl_ext = vu::add( sl, vu::bit_andnot( cgap, gap_extend_v ));
+            const vec_t sl_stay = vu::cmp_lt( sl_open, sl_ext );
+            sl = vu::max( sl_open, sl_ext );
+
+            const vec_t su_open = vu::add( up, gap_open_v );
+            const vec_t su_ext = vu::add( up_i, gap_extend_v );
+            const vec_t su_stay = vu::cmp_lt( su_open, su_ext );
+            const vec_t su = vu::max( su_open, su_ext );
+
+            const vec_t sl_lt_su = vu::cmp_lt( sl, su );
+            const vec_t s_u = vu::bit_and( sl_lt_su, vu::cmp_lt( sm, su ));
+            const vec_t s_l = vu::bit_andnot( sl_lt_su, vu::cmp_lt( sm, sl ));
+
+            sc = vu::max( sm, vu::max( sl, su ));
+
+            vu::store( su, si + ia * W );
+            vu::store( sc, s + ia * W );
+
+            const vec_t flags = vu::bit_or( vu::bit_or( vu::bit_and( sl_stay, sl_stay_f ), vu::bit_and( su_stay, su_stay_f )),
+                                            vu::bit_or( vu::bit_and( s_l, s_l_f ), vu::bit_and( s_u, s_u_f )));
+            vu::store_u8( flags, tb + ia * W );
+
+            if( any_last ) {
+                const vec_t better = vu::bit_and( lastrow, vu::cmp_lt( best, sc ));
+                best = vu::bit_or( vu::bit_and( better, sc ), vu::bit_andnot( better, best ));
+                best_a = vu::bit_or( vu::bit_and( better, vu::set1( int(ia) )), vu::bit_andnot( better, best_a ));
+                best_b = vu::bit_or( vu::bit_and( better, ib_v ), vu::bit_andnot( better, best_b ));
+            }
+        }
+
+        // last column of the rows above the last one (the last row is tracked completely above)
+        if( last_col ) {
+            const vec_t better = vu::bit_and( vu::cmp_lt( ib_v, last_row_v ), vu::cmp_lt( best, sc ));
+            best = vu::bit_or( vu::bit_and( better, sc ), vu::bit_andnot( better, best ));
+            best_a = vu::bit_or( vu::bit_and( better, vu::set1( int(width) - 1 )), vu::bit_andnot( better, best_a ));
+            best_b = vu::bit_or( vu::bit_and( better, ib_v ), vu::bit_andnot( better, best_b ));
+        }
+    }
+
+    vu::store( best, tmp.base() );
+    std::copy( tmp.begin(), tmp.begin() + num, max_score );
+    vu::store( best_a, tmp.base() );
+    std::copy( tmp.begin(), tmp.begin() + num, max_a );
+    vu::store( best_b, tmp.base() );
+    std::copy( tmp.begin(), tmp.begin() + num, max_b );
+}
+
+// align_freeshift_pvec_banded for up to 4 queries with the same best reference (e.g., many similar queries landing on one
+// edge), using align_freeshift_pvec_fill_batch. The band is the union of the bands of the single queries, which only
+// lowers the cut off, so all values stay between the ones of the single band and of the full matrix and the best cell
+// stays the same. A query is only added to the batch if the union band does not cost more vector steps than tracing
+// the queries one by one with align_freeshift_pvec_fill_strips. ok[i] is false for the queries which were not traced
+// this way (no band, too wide, too large, score mismatch or left the band); they have to be retried with
+// align_freeshift_pvec_banded/align_freeshift_pvec.
+template<typename aiter, typename auxiter, typename biter>
+void align_freeshift_pvec_banded_batch( aiter astart, aiter aend, auxiter auxstart, const biter *bstarts, const size_t *bsizes, size_t num, int match_score, int match_cgap, int gap_open, int gap_extend, const int *known_scores, const size_t *end_cols, std::vector<uint8_t> * const *tb_outs, bool *ok, align_arrays_traceback<int> &arr ) {
+    const size_t W = vector_unit<int,4>::W;
+    const size_t asize = std::distance(astart, aend);
+
+    assert( num <= W );
+
+    size_t lanes[W];
+    biter lane_bstarts[W];
+    size_t lane_bsizes[W];
+    size_t num_lanes = 0;
+
+    size_t lo = asize;
+    size_t hi = 0;
+    size_t num_rows = 0;
+    size_t single_steps = 0;
+
+    for( size_t i = 0; i < num; ++i ) {
+        size_t q_lo;
+        ok[i] = freeshift_band_start( auxstart, asize, bsizes[i], match_score, match_cgap, gap_open, gap_extend, known_scores[i], end_cols[i], &q_lo );
+
+        if( !ok[i] ) {
+            continue;
+        }
+
+        const size_t new_lo = std::min( lo, q_lo );
+        const size_t new_hi = std::max( hi, end_cols[i] );
+        const size_t new_rows = std::max( num_rows, bsizes[i] );
+        const size_t new_single_steps = single_steps + (end_cols[i] - q_lo + W) * ((bsizes[i] + W - 1) / W);
+
+        ok[i] = num_lanes == 0 || (new_hi + 1 - new_lo) * new_rows <= new_single_steps;
+
+        if( ok[i] ) {
+            lo = new_lo;
+            hi = new_hi;
+            num_rows = new_rows;
+            single_steps = new_single_steps;
+
+            lanes[num_lanes] = i;
+            lane_bstarts[num_lanes] = bstarts[i];
+            lane_bsizes[num_lanes] = bsizes[i];
+            ++num_lanes;
+        }
+    }
+
+    if( num_lanes == 0 ) {
+        return;
+    }
+
+    const size_t width = hi + 1 - lo;
+
+    if( width * num_rows > arr.max_tb_cells ) {
+        std::fill( ok, ok + num, false );
+        return;
+    }
+
+    const int cut_off = std::numeric_limits<int>::min() / 2;
+
+    int max_score[W];
+    int max_a[W];
+    int max_b[W];
+
+    align_freeshift_pvec_fill_batch( astart + lo, auxstart + lo, width, lane_bstarts, lane_bsizes, num_lanes, match_score, match_cgap, gap_open, gap_extend,
+                                     lo == 0 ? 0 : cut_off, hi == asize - 1, arr, max_score, max_a, max_b );
+
+    for( size_t j = 0; j < num_lanes; ++j ) {
+        const size_t i = lanes[j];
+
+        if( max_score[j] != known_scores[i] ) {
+            ok[i] = false;
+            continue;
+        }
+
+        std::vector<uint8_t> &tb_out = *tb_outs[i];
+        const size_t old_size = tb_out.size();
+
+        freeshift_batch_tb tb_at( arr.tb, lo, width, j, W );
+        align_freeshift_pvec_traceback( tb_at, asize, bsizes[i], int(lo) + max_a[j], max_b[j], tb_out );
+
+        if( tb_at.left_band() ) {
+            tb_out.resize( old_size );
+            ok[i] = false;
+        }
+    }
+}
+
 // backward compatibility wrapper
 template<typename score_t, typename state_t>
 inline score_t align_freeshift_pvec( std::vector<state_t> &a, std::vector<state_t> &a_aux, std::vector<state_t> &b, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, std::vector<uint8_t>& tb_out, align_arrays_traceback<score_t> &arr ) {
@@ -24,6 +24,7 @@
 #include <stdexcept>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <stdint.h>
 
 
@@ -109,6 +110,7 @@ struct vector_unit<short, 8> {
     const static bool do_checks = false;
     
     typedef __m128i vec_t;
+    typedef vec_t mask_t; // comparisons return all-ones/all-zeros lanes (unlike AVX-512, see vector_unit<short,32>)
     typedef short T;
 
     
@@ -210,8 +212,8 @@ struct vector_unit<short, 8> {
     
 };
 
-#ifndef __AVX__
-// vector unit specialization: future AVX 16x16bit integer
+#ifndef __AVX2__
+// vector unit specialization: 16x16bit integer emulated by a pair of SSE registers (the native version for AVX2 is below)
 
 template<>
 struct vector_unit<short, 16> {
@@ -225,6 +227,7 @@ struct vector_unit<short, 16> {
         vec_t( const __m128i &ll, const __m128i &hh ) : l(ll), h(hh) {}
 
     };
+    typedef vec_t mask_t;
 
     typedef short T;
 
@@ -338,6 +341,7 @@ struct vector_unit<int, 4> {
     const static bool do_checks = false;
     
     typedef __m128i vec_t;
+    typedef vec_t mask_t;
     typedef int T;
     const static T POS_MAX_VALUE = 0x7fffffff;
     const static T LARGE_VALUE = 2100000000;
@@ -371,9 +375,17 @@ struct vector_unit<int, 4> {
         return _mm_and_si128( a, b );
     }
     
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm_or_si128( a, b );
+    }
+    
     static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
         return _mm_andnot_si128( a, b );
     }
+
+    static inline const vec_t bit_xor( const vec_t &a, const vec_t &b ) {
+        return _mm_xor_si128( a, b );
+    }
     
 //     static inline const vec_t bit_invert( const vec_t &a ) {
 //         //return _mm_andnot_pd(a, set1(0xffff));
@@ -455,7 +467,20 @@ struct vector_unit<int, 4> {
 //         #error missing SSSSSSSSSE3
         #endif
     }
-    
+
+    // moves every element one lane up (lane i -> i + 1, dropping the last one) and puts val into lane 0
+    static inline const vec_t shift_in( const vec_t &v, T val ) {
+        return _mm_or_si128( _mm_slli_si128( v, sizeof(T) ), _mm_cvtsi32_si128( val ) );
+    }
+
+    // stores the (unsigned saturated) low bytes of the W elements to addr[0..W)
+    static inline void store_u8( const vec_t &v, uint8_t *addr ) {
+        const __m128i p = _mm_packus_epi16( _mm_packs_epi32( v, v ), setzero() );
+        const int packed = _mm_cvtsi128_si32( p );
+
+        std::memcpy( addr, &packed, W );
+    }
+
     static inline void assert_alignment( T * p ) {
         assert( size_t(p) % required_alignment == 0 );
     }
@@ -626,6 +651,15 @@ struct vector_unit<double, 2> {
         return _mm_load_pd( (T*)addr );
     }
 
+    // the same for addresses that are not aligned
+    static inline void storeu( const vec_t &v, T *addr ) {
+        _mm_storeu_pd( addr, v );
+    }
+
+    static inline const vec_t loadu( const T* addr ) {
+        return _mm_loadu_pd( addr );
+    }
+
 #if 1
     static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
         return _mm_and_pd( a, b );
@@ -746,181 +780,6 @@ struct vector_unit<double, 2> {
 
 
 #ifdef HAVE_AVX
-// AVX is the most pointless thing in the world, as far as integers are concerned.
-// waiting for AVX5.7
-
-// AVX 16x16bit vector unit
-template<>
-struct vector_unit<short, 16> {
-
-    const static bool do_checks = false;
-    
-    typedef __m256i vec_t;
-    typedef short T;
-    
-    const static T SMALL_VALUE = -32000;
-    const static T BIAS = 0;
-    const static size_t W = 8;
-    
-    static inline vec_t setzero() {
-        return _mm256_setzero_si256();
-    }
-    
-    static inline vec_t set1( T val ) {
-        return _mm256_set1_epi16( val );
-    }
-    
-    static inline void store( const vec_t &v, T *addr ) {
-
-        if( do_checks && addr == 0 ) {
-            throw std::runtime_error( "store: addr == 0" );
-        }
-        //std::cout << "store to: " << addr << "\n";
-        
-        _mm256_store_si256( (vec_t*)addr, v );
-    }
-    
-    static inline const vec_t load( T* addr ) {
-        return _mm256_load_si256( (vec_t*)addr );
-    }
-    
-    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_and_si128( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_and_si128( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
-    }
-    
-    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_andnot_si128( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_andnot_si128( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
-    }
-    
-//     static inline const vec_t bit_invert( const vec_t &a ) {
-//         //return _mm_andnot_pd(a, set1(0xffff));
-//     }
-    
-    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
-        const __m128i lowa = _mm256_extractf128_si256(a,0);
-        const __m128i lowb = _mm256_extractf128_si256(b,0);
-        
-        //lowa = _mm_add_epi16( lowa, lowb );
-        
-        
-        const __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        //higha = _mm_add_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(_mm_add_epi16( lowa, lowb )),  _mm_add_epi16( higha, highb ), 1 );
-    }
-    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_sub_epi16( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_sub_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
-    }
-    static inline const vec_t cmp_zero( const vec_t &a ) {
-        return cmp_eq( a, setzero() );
-    }
-    
-    static inline const vec_t cmp_eq( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_cmpeq_epi16( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_cmpeq_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
-    }
-    
-    static inline const vec_t cmp_lt( const vec_t &a, const vec_t &b ) {
-     
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_cmplt_epi16( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_cmplt_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
-    }
-    
-    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_min_epi16( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_min_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
-    }
-    
-    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_max_epi16( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_max_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
-    }
-};
-
-
 
 template<>
 struct vector_unit<double, 4> {
@@ -932,9 +791,9 @@ struct vector_unit<double, 4> {
 
 //    const static uint64_t SIGN_MASK_U64 = 0x7FFFFFFFFFFFFFFF;
 
-    const static T LARGE_VALUE;//  = 1e8;
-    const static T SMALL_VALUE; //= -1e8;
-    const static T BIAS;// = 0;
+//     const static T LARGE_VALUE;//  = 1e8;
+//     const static T SMALL_VALUE; //= -1e8;
+//     const static T BIAS;// = 0;
     const static size_t W = 2;
 
 
@@ -1056,9 +915,668 @@ struct vector_unit<double, 4> {
 
 
 };
-const double vector_unit<double,4>::LARGE_VALUE  = 1e8;
-const double vector_unit<double,4>::SMALL_VALUE = -1e8;
-const double vector_unit<double,4>::BIAS = 0;
+// NOTE: these must not be defined in the header, as vec_unit.h is included by multiple translation units
+// compiled with AVX enabled (see scoring_kernel_*.cpp). They are unused anyway.
+// const vector_unit<double,4>::T vector_unit<double,4>::LARGE_VALUE  = 1e8;
+// const vector_unit<double,4>::T vector_unit<double,4>::SMALL_VALUE = -1e8;
+// const vector_unit<double,4>::T vector_unit<double,4>::BIAS = 0;
+
+#endif
+
+
+#ifdef __AVX2__
+// with AVX2 the 256bit registers are finally usable for integers, so the 16x16bit and 8x32bit
+// units are native now (i.e., no more splitting into two 128bit halves like in the pre-AVX2 16x16bit version).
+
+// vector unit specialization: AVX2 16x16bit integer
+template<>
+struct vector_unit<short, 16> {
+
+    const static bool do_checks = false;
+
+    typedef __m256i vec_t;
+    typedef vec_t mask_t;
+    typedef short T;
+
+
+    const static T POS_MAX_VALUE = 0x7fff;
+    const static T LARGE_VALUE = 32000;
+    const static T SMALL_VALUE = -32000;
+    const static T BIAS = 0;
+    const static size_t W = 16;
+
+    static inline vec_t setzero() {
+        return _mm256_setzero_si256();
+    }
+
+    static inline vec_t set1( T val ) {
+        return _mm256_set1_epi16( val );
+    }
+
+    static inline void store( const vec_t &v, T *addr ) {
+
+        if( do_checks && addr == 0 ) {
+            throw std::runtime_error( "store: addr == 0" );
+        }
+
+        _mm256_store_si256( (vec_t*)addr, v );
+    }
+
+    static inline const vec_t load( const T* addr ) {
+        return _mm256_load_si256( (const vec_t*)addr );
+    }
+
+    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
+        return _mm256_and_si256( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm256_or_si256( a, b );
+    }
+    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
+        return _mm256_andnot_si256( a, b );
+    }
+    static inline const vec_t bit_invert( const vec_t &a ) {
+        return _mm256_xor_si256( a, set1(T(0xffff)) );
+    }
+
+    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
+        return _mm256_add_epi16( a, b );
+    }
+    static inline const vec_t adds( const vec_t &a, const vec_t &b ) {
+        return _mm256_adds_epi16( a, b );
+    }
+
+    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
+        return _mm256_sub_epi16( a, b );
+    }
+    static inline const vec_t cmp_zero( const vec_t &a ) {
+        return _mm256_cmpeq_epi16( a, setzero() );
+    }
+
+    static inline const vec_t cmp_eq( const vec_t &a, const vec_t &b ) {
+        return _mm256_cmpeq_epi16( a, b );
+    }
+
+    static inline const vec_t cmp_lt( const vec_t &a, const vec_t &b ) {
+        // there is no cmplt in AVX2. swap the operands instead.
+        return _mm256_cmpgt_epi16( b, a );
+    }
+
+    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
+        return _mm256_min_epi16( a, b );
+    }
+
+    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
+        return _mm256_max_epi16( a, b );
+    }
+
+    static inline const vec_t abs_diff( const vec_t &a, const vec_t &b ) {
+        return _mm256_abs_epi16(sub(a,b));
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % sizeof(vec_t) == 0 );
+    }
+
+};
+
+// vector unit specialization: AVX2 8x32bit integer
+template<>
+struct vector_unit<int, 8> {
+
+    const static bool do_checks = false;
+
+    typedef __m256i vec_t;
+    typedef vec_t mask_t;
+    typedef int T;
+    const static T POS_MAX_VALUE = 0x7fffffff;
+    const static T LARGE_VALUE = 2100000000;
+    const static T SMALL_VALUE = -2100000000;
+    const static T BIAS = 0;
+    const static size_t W = 8;
+
+    static inline vec_t setzero() {
+        return _mm256_setzero_si256();
+    }
+
+    static inline vec_t set1( T val ) {
+        return _mm256_set1_epi32( val );
+    }
+
+    static inline void store( const vec_t &v, T *addr ) {
+
+        if( do_checks && addr == 0 ) {
+            throw std::runtime_error( "store: addr == 0" );
+        }
+
+        _mm256_store_si256( (vec_t*)addr, v );
+    }
+
+    static inline const vec_t load( const T* addr ) {
+        return _mm256_load_si256( (const vec_t*)addr );
+    }
+
+    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
+        return _mm256_and_si256( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm256_or_si256( a, b );
+    }
+
+    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
+        return _mm256_andnot_si256( a, b );
+    }
+
+    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
+        return _mm256_add_epi32( a, b );
+    }
+    static inline const vec_t adds( const vec_t &a, const vec_t &b ) {
+        // same as in the SSE version: no saturating add for 32bit int.
+        return _mm256_add_epi32( a, b );
+    }
+
+    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
+        return _mm256_sub_epi32( a, b );
+    }
+    static inline const vec_t cmp_zero( const vec_t &a ) {
+        return _mm256_cmpeq_epi32( a, setzero() );
+    }
+
+    static inline const vec_t cmp_eq( const vec_t &a, const vec_t &b ) {
+        return _mm256_cmpeq_epi32( a, b );
+    }
+
+    static inline const vec_t cmp_lt( const vec_t &a, const vec_t &b ) {
+        return _mm256_cmpgt_epi32( b, a );
+    }
+
+    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
+        return _mm256_min_epi32( a, b );
+    }
+
+    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
+        return _mm256_max_epi32( a, b );
+    }
+
+    static inline const vec_t abs_diff( const vec_t &a, const vec_t &b ) {
+        return _mm256_abs_epi32(sub(a,b));
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % sizeof(vec_t) == 0 );
+    }
+
+};
+
+// vector unit specialization: AVX2 32x8bit signed integer, with saturating arithmetic
+template<>
+struct vector_unit<signed char, 32> {
+
+    const static bool do_checks = false;
+
+    typedef __m256i vec_t;
+    typedef vec_t mask_t;
+    typedef signed char T;
+
+    const static T POS_MAX_VALUE = 127;
+    const static T LARGE_VALUE = 127;
+    const static T SMALL_VALUE = -128;
+    const static T BIAS = 0;
+    const static size_t W = 32;
+
+    static inline vec_t setzero() {
+        return _mm256_setzero_si256();
+    }
+
+    static inline vec_t set1( T val ) {
+        return _mm256_set1_epi8( val );
+    }
+
+    static inline void store( const vec_t &v, T *addr ) {
+
+        if( do_checks && addr == 0 ) {
+            throw std::runtime_error( "store: addr == 0" );
+        }
+
+        _mm256_store_si256( (vec_t*)addr, v );
+    }
+
+    static inline const vec_t load( const T* addr ) {
+        return _mm256_load_si256( (const vec_t*)addr );
+    }
+
+    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
+        return _mm256_and_si256( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm256_or_si256( a, b );
+    }
+    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
+        return _mm256_andnot_si256( a, b );
+    }
+    static inline const vec_t bit_invert( const vec_t &a ) {
+        return _mm256_xor_si256( a, set1(T(-1)) );
+    }
+
+    // NOTE: add is saturating: out-of-range scores stick to the limits (detectable) instead of wrapping around
+    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
+        return _mm256_adds_epi8( a, b );
+    }
+    static inline const vec_t adds( const vec_t &a, const vec_t &b ) {
+        return _mm256_adds_epi8( a, b );
+    }
+
+    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
+        return _mm256_subs_epi8( a, b );
+    }
+    static inline const mask_t cmp_zero( const vec_t &a ) {
+        return cmp_eq( a, setzero() );
+    }
+
+    static inline const mask_t cmp_eq( const vec_t &a, const vec_t &b ) {
+        return _mm256_cmpeq_epi8( a, b );
+    }
+
+    static inline const mask_t cmp_lt( const vec_t &a, const vec_t &b ) {
+        return _mm256_cmpgt_epi8( b, a );
+    }
+
+    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
+        return _mm256_min_epi8( a, b );
+    }
+
+    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
+        return _mm256_max_epi8( a, b );
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % sizeof(vec_t) == 0 );
+    }
+
+};
+
+#endif
+
+#ifdef __AVX512BW__
+// AVX-512 comparisons do not produce vectors but write into the dedicated mask registers (one bit per lane).
+// cmp_* return a mask_t, and bit_andnot accepts it as first argument, so that the cgap handling in
+// pvec_aligner_vec (bit_andnot( cmp_lt(...), x )) maps to a single zero-masking move.
+// The unmasked forms of some AVX-512F intrinsics (andnot, min/max/abs epi32) pass _mm512_undefined_epi32() as the
+// merge source, which makes GCC 12 report a (false positive) -Wmaybe-uninitialized once they are inlined into the
+// kernels. Their merge-masking forms with an all-ones mask are used instead; they compile to the same instructions.
+
+// vector unit specialization: AVX-512BW 32x16bit integer
+template<>
+struct vector_unit<short, 32> {
+
+    const static bool do_checks = false;
+
+    typedef __m512i vec_t;
+    typedef __mmask32 mask_t;
+    typedef short T;
+
+
+    const static T POS_MAX_VALUE = 0x7fff;
+    const static T LARGE_VALUE = 32000;
+    const static T SMALL_VALUE = -32000;
+    const static T BIAS = 0;
+    const static size_t W = 32;
+
+    static inline vec_t setzero() {
+        return _mm512_setzero_si512();
+    }
+
+    static inline vec_t set1( T val ) {
+        return _mm512_set1_epi16( val );
+    }
+
+    static inline void store( const vec_t &v, T *addr ) {
+
+        if( do_checks && addr == 0 ) {
+            throw std::runtime_error( "store: addr == 0" );
+        }
+
+        _mm512_store_si512( (vec_t*)addr, v );
+    }
+
+    static inline const vec_t load( const T* addr ) {
+        return _mm512_load_si512( (const vec_t*)addr );
+    }
+
+    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
+        return _mm512_and_si512( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm512_or_si512( a, b );
+    }
+    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
+        return _mm512_mask_andnot_epi32( b, __mmask16(-1), a, b );
+    }
+    static inline const vec_t bit_andnot( const mask_t &m, const vec_t &b ) {
+        return _mm512_maskz_mov_epi16( mask_t(~m), b );
+    }
+    static inline const vec_t bit_invert( const vec_t &a ) {
+        return _mm512_xor_si512( a, set1(T(0xffff)) );
+    }
+
+    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
+        return _mm512_add_epi16( a, b );
+    }
+    static inline const vec_t adds( const vec_t &a, const vec_t &b ) {
+        return _mm512_adds_epi16( a, b );
+    }
+
+    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
+        return _mm512_sub_epi16( a, b );
+    }
+    static inline const mask_t cmp_zero( const vec_t &a ) {
+        return _mm512_cmpeq_epi16_mask( a, setzero() );
+    }
+
+    static inline const mask_t cmp_eq( const vec_t &a, const vec_t &b ) {
+        return _mm512_cmpeq_epi16_mask( a, b );
+    }
+
+    static inline const mask_t cmp_lt( const vec_t &a, const vec_t &b ) {
+        return _mm512_cmplt_epi16_mask( a, b );
+    }
+
+    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
+        return _mm512_min_epi16( a, b );
+    }
+
+    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
+        return _mm512_max_epi16( a, b );
+    }
+
+    static inline const vec_t abs_diff( const vec_t &a, const vec_t &b ) {
+        return _mm512_abs_epi16(sub(a,b));
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % sizeof(vec_t) == 0 );
+    }
+
+};
+
+// vector unit specialization: AVX-512 16x32bit integer (only needs AVX-512F)
+template<>
+struct vector_unit<int, 16> {
+
+    const static bool do_checks = false;
+
+    typedef __m512i vec_t;
+    typedef __mmask16 mask_t;
+    typedef int T;
+    const static T POS_MAX_VALUE = 0x7fffffff;
+    const static T LARGE_VALUE = 2100000000;
+    const static T SMALL_VALUE = -2100000000;
+    const static T BIAS = 0;
+    const static size_t W = 16;
+
+    static inline vec_t setzero() {
+        return _mm512_setzero_si512();
+    }
+
+    static inline vec_t set1( T val ) {
+        return _mm512_set1_epi32( val );
+    }
+
+    static inline void store( const vec_t &v, T *addr ) {
+
+        if( do_checks && addr == 0 ) {
+            throw std::runtime_error( "store: addr == 0" );
+        }
+
+        _mm512_store_si512( (vec_t*)addr, v );
+    }
+
+    static inline const vec_t load( const T* addr ) {
+        return _mm512_load_si512( (const vec_t*)addr );
+    }
+
+    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
+        return _mm512_and_si512( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm512_or_si512( a, b );
+    }
+    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
+        return _mm512_mask_andnot_epi32( b, __mmask16(-1), a, b );
+    }
+    static inline const vec_t bit_andnot( const mask_t &m, const vec_t &b ) {
+        return _mm512_maskz_mov_epi32( mask_t(~m), b );
+    }
+    static inline const vec_t bit_invert( const vec_t &a ) {
+        return _mm512_xor_si512( a, set1(T(0xffffffff)) );
+    }
+
+    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
+        return _mm512_add_epi32( a, b );
+    }
+
+    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
+        return _mm512_sub_epi32( a, b );
+    }
+    static inline const mask_t cmp_zero( const vec_t &a ) {
+        return _mm512_cmpeq_epi32_mask( a, setzero() );
+    }
+
+    static inline const mask_t cmp_eq( const vec_t &a, const vec_t &b ) {
+        return _mm512_cmpeq_epi32_mask( a, b );
+    }
+
+    static inline const mask_t cmp_lt( const vec_t &a, const vec_t &b ) {
+        return _mm512_cmplt_epi32_mask( a, b );
+    }
+
+    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
+        return _mm512_mask_min_epi32( a, __mmask16(-1), a, b );
+    }
+
+    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
+        return _mm512_mask_max_epi32( a, __mmask16(-1), a, b );
+    }
+
+    static inline const vec_t abs_diff( const vec_t &a, const vec_t &b ) {
+        const vec_t d = sub(a,b);
+        return _mm512_mask_abs_epi32( d, __mmask16(-1), d );
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % sizeof(vec_t) == 0 );
+    }
+
+};
+
+// vector unit specialization: AVX-512BW 64x8bit signed integer, with saturating arithmetic
+template<>
+struct vector_unit<signed char, 64> {
+
+    const static bool do_checks = false;
+
+    typedef __m512i vec_t;
+    typedef __mmask64 mask_t;
+    typedef signed char T;
+
+    const static T POS_MAX_VALUE = 127;
+    const static T LARGE_VALUE = 127;
+    const static T SMALL_VALUE = -128;
+    const static T BIAS = 0;
+    const static size_t W = 64;
+
+    static inline vec_t setzero() {
+        return _mm512_setzero_si512();
+    }
+
+    static inline vec_t set1( T val ) {
+        return _mm512_set1_epi8( val );
+    }
+
+    static inline void store( const vec_t &v, T *addr ) {
+
+        if( do_checks && addr == 0 ) {
+            throw std::runtime_error( "store: addr == 0" );
+        }
+
+        _mm512_store_si512( (vec_t*)addr, v );
+    }
+
+    static inline const vec_t load( const T* addr ) {
+        return _mm512_load_si512( (const vec_t*)addr );
+    }
+
+    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
+        return _mm512_and_si512( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm512_or_si512( a, b );
+    }
+    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
+        return _mm512_mask_andnot_epi32( b, __mmask16(-1), a, b );
+    }
+    static inline const vec_t bit_andnot( const mask_t &m, const vec_t &b ) {
+        return _mm512_maskz_mov_epi8( mask_t(~m), b );
+    }
+    static inline const vec_t bit_invert( const vec_t &a ) {
+        return _mm512_xor_si512( a, set1(T(-1)) );
+    }
+
+    // NOTE: add is saturating: out-of-range scores stick to the limits (detectable) instead of wrapping around
+    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
+        return _mm512_adds_epi8( a, b );
+    }
+    static inline const vec_t adds( const vec_t &a, const vec_t &b ) {
+        return _mm512_adds_epi8( a, b );
+    }
+
+    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
+        return _mm512_subs_epi8( a, b );
+    }
+    static inline const mask_t cmp_zero( const vec_t &a ) {
+        return cmp_eq( a, setzero() );
+    }
+
+    static inline const mask_t cmp_eq( const vec_t &a, const vec_t &b ) {
+        return _mm512_cmpeq_epi8_mask( a, b );
+    }
+
+    static inline const mask_t cmp_lt( const vec_t &a, const vec_t &b ) {
+        return _mm512_cmplt_epi8_mask( a, b );
+    }
+
+    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
+        return _mm512_min_epi8( a, b );
+    }
+
+    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
+        return _mm512_max_epi8( a, b );
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % sizeof(vec_t) == 0 );
+    }
+
+};
+
+#endif
+
+
+// The 8bit signed units are meant for the first pass of the adaptive precision scoring (see scoring_kernel_impl.h)
+#ifdef __SSE4_1__
+// vector unit specialization: SSE4.1 16x8bit signed integer, with saturating arithmetic
+template<>
+struct vector_unit<signed char, 16> {
+
+    const static bool do_checks = false;
+
+    typedef __m128i vec_t;
+    typedef vec_t mask_t;
+    typedef signed char T;
+
+    const static T POS_MAX_VALUE = 127;
+    const static T LARGE_VALUE = 127;
+    const static T SMALL_VALUE = -128;
+    const static T BIAS = 0;
+    const static size_t W = 16;
+
+    static inline vec_t setzero() {
+        return _mm_setzero_si128();
+    }
+
+    static inline vec_t set1( T val ) {
+        return _mm_set1_epi8( val );
+    }
+
+    static inline void store( const vec_t &v, T *addr ) {
+
+        if( do_checks && addr == 0 ) {
+            throw std::runtime_error( "store: addr == 0" );
+        }
+
+        _mm_store_si128( (vec_t*)addr, v );
+    }
+
+    static inline const vec_t load( const T* addr ) {
+        return _mm_load_si128( (const vec_t*)addr );
+    }
+
+    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
+        return _mm_and_si128( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm_or_si128( a, b );
+    }
+    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
+        return _mm_andnot_si128( a, b );
+    }
+    static inline const vec_t bit_invert( const vec_t &a ) {
+        return _mm_xor_si128( a, set1(T(-1)) );
+    }
+
+    // NOTE: add is saturating: out-of-range scores stick to the limits (detectable) instead of wrapping around
+    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
+        return _mm_adds_epi8( a, b );
+    }
+    static inline const vec_t adds( const vec_t &a, const vec_t &b ) {
+        return _mm_adds_epi8( a, b );
+    }
+
+    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
+        return _mm_subs_epi8( a, b );
+    }
+    static inline const mask_t cmp_zero( const vec_t &a ) {
+        return cmp_eq( a, setzero() );
+    }
+
+    static inline const mask_t cmp_eq( const vec_t &a, const vec_t &b ) {
+        return _mm_cmpeq_epi8( a, b );
+    }
+
+    static inline const mask_t cmp_lt( const vec_t &a, const vec_t &b ) {
+        return _mm_cmplt_epi8( a, b );
+    }
+
+    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
+        return _mm_min_epi8( a, b );
+    }
+
+    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
+        return _mm_max_epi8( a, b );
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % sizeof(vec_t) == 0 );
+    }
+
+};
 
 #endif
 
@@ -1071,6 +1589,7 @@ struct vector_unit<unsigned char, 16> {
     const static bool do_checks = false;
     
     typedef __m128i vec_t;
+    typedef vec_t mask_t;
     typedef unsigned char T;
     
     const static size_t W = 16;